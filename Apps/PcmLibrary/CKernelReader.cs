@@ -18,6 +18,26 @@ namespace PcmHacking
         private readonly Protocol protocol;
         private readonly ILogger logger;
 
+        /// <summary>
+        /// Upper limit on how much memory a single blank-map query asks the kernel to scan.
+        /// </summary>
+        private const int MaxBlankMapScanSize = 128 * 1024;
+
+        /// <summary>
+        /// How many blocks to request at once when streaming.
+        /// </summary>
+        private const int StreamWindowBlocks = 8;
+
+        /// <summary>
+        /// Set when the kernel turns out not to support streaming reads.
+        /// </summary>
+        private bool streamingDisabled;
+
+        /// <summary>
+        /// Set when every block is read with a CRC, so the file doesn't need a separate verification pass.
+        /// </summary>
+        private bool useCrcReads;
+
         public bool VerifyFile
         {
             get; set;
@@ -95,6 +115,9 @@ namespace PcmHacking
 
                 logger.AddUserMessage("kernel uploaded to PCM succesfully. Requesting data...");
 
+                await this.vehicle.SendToolPresentNotification();
+                await this.vehicle.SetKernelTurnaround(cancellationToken);
+
                 // Which flash chip?
                 await this.vehicle.SendToolPresentNotification();
                 UInt32 chipId = await this.vehicle.QueryFlashChipId(cancellationToken);
@@ -103,12 +126,29 @@ namespace PcmHacking
 
                 await this.vehicle.SetDeviceTimeout(TimeoutScenario.ReadMemoryBlock);
 
+                // Checking each block's CRC as it is read is as good as verifying the file
+                // afterward, and much faster. Older kernels can't do that.
+                this.useCrcReads = this.VerifyFile && await this.KernelSupportsCrcReads(cancellationToken);
+                if (this.useCrcReads)
+                {
+                    // Streamed and compressed blocks have no CRC, so those are not used.
+                    this.logger.AddUserMessage("Reading each block with a CRC. Streaming and compressed reads are turned off.");
+                }
+
                 byte[] image = new byte[flashChip.Size];
                 int retryCount = 0;
                 int startAddress = 0;
                 int endAddress = (int)flashChip.Size;
                 int bytesRemaining = (int)flashChip.Size;
                 int blockSize = this.vehicle.DeviceMaxReceiveSize - 10 - 2; // allow space for the header and block checksum
+                if (this.useCrcReads)
+                {
+                    blockSize -= 4;
+                }
+
+                // Find out which blocks are blank (or otherwise uniform) so we don't have to read them.
+                int chunkSize = blockSize;
+                byte?[] blankMap = await this.QueryBlankMap(chunkSize, endAddress / chunkSize, cancellationToken);
 
                 DateTime startTime = DateTime.MaxValue;
                 while (startAddress < endAddress)
@@ -118,6 +158,19 @@ namespace PcmHacking
                         return Response.Create(ResponseStatus.Cancelled, (Stream)null);
                     }
 
+                    int chunkIndex = startAddress / chunkSize;
+                    if ((chunkIndex < blankMap.Length) && blankMap[chunkIndex].HasValue)
+                    {
+                        byte fill = blankMap[chunkIndex].Value;
+                        for (int index = 0; index < chunkSize; index++)
+                        {
+                            image[startAddress + index] = fill;
+                        }
+
+                        startAddress += chunkSize;
+                        continue;
+                    }
+
                     // The read kernel needs a short message here for reasons unknown. Without it, it will RX 2 messages then drop one.
                     await this.vehicle.ForceSendToolPresentNotification();
 
@@ -137,6 +190,46 @@ namespace PcmHacking
                         startTime = DateTime.Now;
                     }
 
+                    // Stream consecutive blocks that need to be read, up to the window size.
+                    int windowLength = 0;
+                    while ((windowLength < blockSize * StreamWindowBlocks) && (startAddress + windowLength < endAddress))
+                    {
+                        int windowChunk = (startAddress + windowLength) / chunkSize;
+                        if ((windowChunk < blankMap.Length) && blankMap[windowChunk].HasValue)
+                        {
+                            break;
+                        }
+
+                        windowLength += Math.Min(blockSize, endAddress - (startAddress + windowLength));
+                    }
+
+                    // Streamed blocks don't carry a CRC.
+                    if (!this.streamingDisabled && !this.useCrcReads && (windowLength > blockSize))
+                    {
+                        Response<bool> streamResponse = await TryStreamBlocks(
+                            image,
+                            blockSize,
+                            startAddress,
+                            windowLength,
+                            startTime,
+                            cancellationToken);
+                        if (streamResponse.Status != ResponseStatus.Success)
+                        {
+                            this.logger.AddUserMessage(
+                                string.Format(
+                                    "Unable to read block from {0} to {1}",
+                                    startAddress,
+                                    (startAddress + windowLength) - 1));
+                            return new Response<Stream>(ResponseStatus.Error, null);
+                        }
+
+                        startAddress += windowLength;
+                        retryCount += streamResponse.RetryCount;
+
+                        logger.StatusUpdateRetryCount((retryCount > 0) ? retryCount.ToString() + ((retryCount > 1) ? " Retries" : " Retry") : string.Empty);
+                        continue;
+                    }
+
                     Response<bool> readResponse = await TryReadBlock(
                         image, 
                         blockSize, 
@@ -164,21 +257,36 @@ namespace PcmHacking
 
                 if (VerifyFile)
                 {
-                    logger.AddUserMessage("Starting verification...");
+                    IEnumerable<MemoryRange> verifyRanges = flashChip.MemoryRanges;
+                    if (this.useCrcReads)
+                    {
+                        // The blocks that were read have been checked already, but the ones
+                        // that the blank map skipped have not.
+                        logger.AddUserMessage("Every block that was read was checked against a CRC from the PCM.");
+                        verifyRanges = GetBlankRanges(blankMap, chunkSize, flashChip.MemoryRanges);
+                    }
 
-                    CKernelVerifier verifier = new CKernelVerifier(
-                        image,
-                        flashChip.MemoryRanges,
-                        this.vehicle,
-                        this.protocol,
-                        this.logger);
+                    bool verified = true;
+                    if (verifyRanges.Any())
+                    {
+                        logger.AddUserMessage(this.useCrcReads ? "Verifying the blocks that were skipped..." : "Starting verification...");
 
-                    logger.StatusUpdateReset();
+                        CKernelVerifier verifier = new CKernelVerifier(
+                            image,
+                            verifyRanges,
+                            this.vehicle,
+                            this.protocol,
+                            this.logger);
 
-                    if (await verifier.CompareRanges(
-                        image,
-                        BlockType.All,
-                        cancellationToken))
+                        logger.StatusUpdateReset();
+
+                        verified = await verifier.CompareRanges(
+                            image,
+                            BlockType.All,
+                            cancellationToken);
+                    }
+
+                    if (verified)
                     {
                         logger.AddUserMessage("The contents of the file match the contents of the PCM.");
                     }
@@ -190,6 +298,7 @@ namespace PcmHacking
                     }
                 }
 
+                await this.vehicle.ReportKernelCounters(cancellationToken);
                 await this.vehicle.Cleanup(); // Not sure why this does not get called in the finally block on successfull read?
 
                 MemoryStream stream = new MemoryStream(image);
@@ -209,6 +318,214 @@ namespace PcmHacking
             }
         }
 
+        /// <summary>
+        /// Ask the kernel which chunks of flash contain a single repeated byte.
+        /// </summary>
+        /// <remarks>
+        /// Each query is limited by the size of the reply the device can receive,
+        /// and by how long the kernel will take to scan the range. If a query
+        /// fails, the remaining chunks are simply read the normal way.
+        /// </remarks>
+        private async Task<byte?[]> QueryBlankMap(int chunkSize, int chunkCount, CancellationToken cancellationToken)
+        {
+            byte?[] result = new byte?[chunkCount];
+
+            // 12 header bytes, 1 checksum byte, and up to 9 bits per chunk.
+            int maxChunksPerReply = ((this.vehicle.DeviceMaxReceiveSize - 13) * 8) / 9;
+            int maxChunksPerScan = Math.Max(1, MaxBlankMapScanSize / chunkSize);
+            int chunksPerQuery = Math.Min(maxChunksPerReply, maxChunksPerScan);
+            int blankCount = 0;
+
+            for (int firstChunk = 0; firstChunk < chunkCount; firstChunk += chunksPerQuery)
+            {
+                if (cancellationToken.IsCancellationRequested)
+                {
+                    break;
+                }
+
+                int count = Math.Min(chunksPerQuery, chunkCount - firstChunk);
+                UInt32 address = (UInt32)(firstChunk * chunkSize);
+
+                await this.vehicle.SendToolPresentNotification();
+                Query<byte?[]> query = this.vehicle.CreateQuery(
+                    () => this.protocol.CreateBlankMapQuery(address, chunkSize, count),
+                    (message) => this.protocol.ParseBlankMap(message, address, chunkSize, count),
+                    cancellationToken);
+                Response<byte?[]> response = await query.Execute();
+                if (response.Status != ResponseStatus.Success)
+                {
+                    this.logger.AddDebugMessage("Blank map query failed: " + response.Status);
+                    break;
+                }
+
+                Array.Copy(response.Value, 0, result, firstChunk, count);
+                blankCount += response.Value.Count(value => value.HasValue);
+            }
+
+            if (blankCount > 0)
+            {
+                this.logger.AddUserMessage(
+                    string.Format(
+                        "Skipping {0} blank blocks ({1} bytes).",
+                        blankCount,
+                        blankCount * chunkSize));
+            }
+
+            return result;
+        }
+
+        /// <summary>
+        /// Get the ranges of flash that were filled in from the blank map instead of being read.
+        /// </summary>
+        /// <remarks>
+        /// Neighboring chunks are combined, so that the kernel has as few ranges to CRC as possible.
+        /// Each range gets the type of the flash block that it starts in, for the verifier's report.
+        /// </remarks>
+        private static List<MemoryRange> GetBlankRanges(byte?[] blankMap, int chunkSize, IEnumerable<MemoryRange> flashRanges)
+        {
+            List<MemoryRange> result = new List<MemoryRange>();
+            for (int chunk = 0; chunk < blankMap.Length; chunk++)
+            {
+                if (!blankMap[chunk].HasValue)
+                {
+                    continue;
+                }
+
+                int first = chunk;
+                while ((chunk + 1 < blankMap.Length) && blankMap[chunk + 1].HasValue)
+                {
+                    chunk++;
+                }
+
+                UInt32 address = (UInt32)(first * chunkSize);
+                UInt32 size = (UInt32)((chunk + 1 - first) * chunkSize);
+                MemoryRange flashRange = flashRanges.FirstOrDefault(range => (address >= range.Address) && (address < range.Address + range.Size));
+                result.Add(new MemoryRange(address, size, (flashRange == null) ? BlockType.All : flashRange.Type));
+            }
+
+            return result;
+        }
+
+        /// <summary>
+        /// Find out whether the kernel can send a CRC with each block.
+        /// </summary>
+        private async Task<bool> KernelSupportsCrcReads(CancellationToken cancellationToken)
+        {
+            const int probeLength = 16;
+            Response<byte[]> response = await this.vehicle.ReadMemory(
+                () => this.protocol.CreateCrcReadRequest(0, probeLength),
+                (payloadMessage) => this.protocol.ParseCrcPayload(payloadMessage, probeLength, 0),
+                cancellationToken);
+
+            if (response.Status != ResponseStatus.Success)
+            {
+                this.logger.AddDebugMessage("Kernel does not support CRC reads: " + response.Status);
+                this.vehicle.ClearDeviceMessageQueue();
+                return false;
+            }
+
+            return true;
+        }
+
+        /// <summary>
+        /// Read several consecutive blocks of PCM memory with a single request.
+        /// </summary>
+        /// <remarks>
+        /// Blocks that are lost or corrupted are read again one at a time, so a 
+        /// bad block only costs a retry of that block.
+        /// </remarks>
+        private async Task<Response<bool>> TryStreamBlocks(
+            byte[] image,
+            int blockSize,
+            int startAddress,
+            int length,
+            DateTime startTime,
+            CancellationToken cancellationToken)
+        {
+            this.logger.AddDebugMessage(string.Format("Streaming from {0} / 0x{0:X}, length {1} / 0x{1:X}", startAddress, length));
+
+            int blockCount = (length + blockSize - 1) / blockSize;
+            bool[] received = new bool[blockCount];
+            int receivedCount = 0;
+
+            if (await this.vehicle.SendMessage(this.protocol.CreateStreamReadRequest(startAddress, blockSize, length)))
+            {
+                // Allow for a few unrelated messages mixed in with the blocks.
+                for (int attempt = 0; (attempt < blockCount + 2) && (receivedCount < blockCount); attempt++)
+                {
+                    if (cancellationToken.IsCancellationRequested)
+                    {
+                        return Response.Create(ResponseStatus.Cancelled, false);
+                    }
+
+                    Message payloadMessage = await this.vehicle.ReceiveMessage();
+                    if (payloadMessage == null)
+                    {
+                        break;
+                    }
+
+                    int address;
+                    if (!this.protocol.TryGetPayloadAddress(payloadMessage, out address))
+                    {
+                        continue;
+                    }
+
+                    int offset = address - startAddress;
+                    if ((offset < 0) || (offset >= length) || (offset % blockSize != 0) || received[offset / blockSize])
+                    {
+                        continue;
+                    }
+
+                    int thisBlockSize = Math.Min(blockSize, length - offset);
+                    Response<byte[]> payloadResponse = this.protocol.ParsePayload(payloadMessage, thisBlockSize, address);
+                    if ((payloadResponse.Status != ResponseStatus.Success) || (payloadResponse.Value.Length != thisBlockSize))
+                    {
+                        this.logger.AddDebugMessage("Unable to process streamed block: " + payloadResponse.Status);
+                        continue;
+                    }
+
+                    Buffer.BlockCopy(payloadResponse.Value, 0, image, address, thisBlockSize);
+                    received[offset / blockSize] = true;
+                    receivedCount++;
+
+                    this.ReportProgress(image, address, thisBlockSize, startTime);
+                }
+            }
+
+            // Kernels without streaming support treat the request as a normal read of the first block.
+            if ((receivedCount == 1) && received[0])
+            {
+                this.logger.AddDebugMessage("Kernel does not support streaming reads.");
+                this.streamingDisabled = true;
+            }
+
+            int retryCount = 0;
+            for (int index = 0; index < blockCount; index++)
+            {
+                if (received[index])
+                {
+                    continue;
+                }
+
+                int address = startAddress + (index * blockSize);
+                Response<bool> readResponse = await this.TryReadBlock(
+                    image,
+                    Math.Min(blockSize, startAddress + length - address),
+                    address,
+                    startTime,
+                    cancellationToken);
+                if (readResponse.Status != ResponseStatus.Success)
+                {
+                    return Response.Create(readResponse.Status, false, retryCount);
+                }
+
+                retryCount += 1 + readResponse.RetryCount;
+            }
+
+            this.vehicle.ClearDeviceMessageQueue();
+            return Response.Create(ResponseStatus.Success, true, retryCount);
+        }
+
         /// <summary>
         /// Try to read a block of PCM memory.
         /// </summary>
@@ -229,10 +546,23 @@ namespace PcmHacking
                     break;
                 }
 
-                Response<byte[]> readResponse = await this.vehicle.ReadMemory(
-                    () => this.protocol.CreateReadRequest(startAddress, length),
-                    (payloadMessage) => this.protocol.ParsePayload(payloadMessage, length, startAddress),
-                    cancellationToken);
+                // The kernel will run-length encode the block if that makes it smaller.
+                // CRC reads are never encoded, but the block is checked against the CRC.
+                Response<byte[]> readResponse;
+                if (this.useCrcReads)
+                {
+                    readResponse = await this.vehicle.ReadMemory(
+                        () => this.protocol.CreateCrcReadRequest(startAddress, length),
+                        (payloadMessage) => this.protocol.ParseCrcPayload(payloadMessage, length, startAddress),
+                        cancellationToken);
+                }
+                else
+                {
+                    readResponse = await this.vehicle.ReadMemory(
+                        () => this.protocol.CreateCompressedReadRequest(startAddress, length),
+                        (payloadMessage) => this.protocol.ParsePayload(payloadMessage, length, startAddress),
+                        cancellationToken);
+                }
 
                 if(readResponse.Status != ResponseStatus.Success)
                 {
@@ -253,33 +583,40 @@ namespace PcmHacking
                 }
 
                 Buffer.BlockCopy(payload, 0, image, startAddress, payload.Length);
+                this.ReportProgress(image, startAddress, payload.Length, startTime);
 
-                TimeSpan elapsed = DateTime.Now - startTime;
-                string timeRemaining = string.Empty;
+                return Response.Create(ResponseStatus.Success, true, retryCount);
+            }
 
-                UInt32 bytesPerSecond = 0;
-                UInt32 bytesRemaining = 0;
+            return Response.Create(ResponseStatus.Error, false, retryCount);
+        }
 
-                bytesPerSecond = (UInt32)(startAddress / elapsed.TotalSeconds);
-                bytesRemaining = (UInt32)(image.Length - startAddress);
+        /// <summary>
+        /// Update the progress display after reading a block.
+        /// </summary>
+        private void ReportProgress(byte[] image, int startAddress, int length, DateTime startTime)
+        {
+            TimeSpan elapsed = DateTime.Now - startTime;
+            string timeRemaining = string.Empty;
 
-                // Don't divide by zero.
-                if (bytesPerSecond > 0)
-                {
-                    UInt32 secondsRemaining = (UInt32)(bytesRemaining / bytesPerSecond);
-                    timeRemaining = TimeSpan.FromSeconds(secondsRemaining).ToString("mm\\:ss");
-                }
+            UInt32 bytesPerSecond = 0;
+            UInt32 bytesRemaining = 0;
 
-                logger.StatusUpdateActivity($"Reading {payload.Length} bytes from 0x{startAddress:X6}");
-                logger.StatusUpdatePercentDone((startAddress * 100 / image.Length > 0) ? $"{startAddress * 100 / image.Length}%" : string.Empty);
-                logger.StatusUpdateTimeRemaining($"T-{timeRemaining}");
-                logger.StatusUpdateKbps((bytesPerSecond > 0) ? $"{(double)bytesPerSecond * 8.00 / 1000.00:0.00} Kbps" : string.Empty);
-                logger.StatusUpdateProgressBar((double)(startAddress + payload.Length) / image.Length, true);
+            bytesPerSecond = (UInt32)(startAddress / elapsed.TotalSeconds);
+            bytesRemaining = (UInt32)(image.Length - startAddress);
 
-                return Response.Create(ResponseStatus.Success, true, retryCount);
+            // Don't divide by zero.
+            if (bytesPerSecond > 0)
+            {
+                UInt32 secondsRemaining = (UInt32)(bytesRemaining / bytesPerSecond);
+                timeRemaining = TimeSpan.FromSeconds(secondsRemaining).ToString("mm\\:ss");
             }
 
-            return Response.Create(ResponseStatus.Error, false, retryCount);
+            logger.StatusUpdateActivity($"Reading {length} bytes from 0x{startAddress:X6}");
+            logger.StatusUpdatePercentDone((startAddress * 100 / image.Length > 0) ? $"{startAddress * 100 / image.Length}%" : string.Empty);
+            logger.StatusUpdateTimeRemaining($"T-{timeRemaining}");
+            logger.StatusUpdateKbps((bytesPerSecond > 0) ? $"{(double)bytesPerSecond * 8.00 / 1000.00:0.00} Kbps" : string.Empty);
+            logger.StatusUpdateProgressBar((double)(startAddress + length) / image.Length, true);
         }
     }
 }
@@ -16,6 +16,11 @@ namespace PcmHacking
         private readonly Protocol protocol;
         private readonly ILogger logger;
 
+        /// <summary>
+        /// This must match CrcBatchMaxRanges in the kernel.
+        /// </summary>
+        private const int MaxRangesPerBatch = 24;
+
         public CKernelVerifier(byte[] image, IEnumerable<MemoryRange> ranges, Vehicle vehicle, Protocol protocol, ILogger logger)
         {
             this.image = image;
@@ -30,11 +35,7 @@ namespace PcmHacking
         /// </summary>
         private void GetCrcFromImage()
         {
-            Crc crc = new Crc();
-            foreach (MemoryRange range in this.ranges)
-            {
-                range.DesiredCrc = crc.GetCrc(this.image, range.Address, range.Size);
-            }
+            new Crc().GetCrcs(this.image, this.ranges);
         }
 
         /// <summary>
@@ -49,27 +50,28 @@ namespace PcmHacking
             logger.AddUserMessage("Calculating CRCs from file.");
             this.GetCrcFromImage();
 
-            // The kernel will remember (and return) the CRC value of the last block it 
-            // was asked about, which leads to misleading results if you only rewrite 
-            // a single block. So we send a a bogus query to reset the last-used CRC 
-            // value in the kernel.
-            //
-            // The first time we do this, the PCM will initialize the lookup table
-            // required by the CRC algorithm, which takes about 20 seconds. Warn the
-            // user, because the app appears to be hung while it waits for the response
-            // to this message.
-            logger.AddUserMessage("Initializing CRC algorithm on PCM, this will take a minute...");
-
-            await this.vehicle.SendToolPresentNotification();
-            Query<UInt32> crcReset = this.vehicle.CreateQuery<uint>(
-                () => this.protocol.CreateCrcQuery(0, 0),
-                (message) => this.protocol.ParseCrc(message, 0, 0),
-                cancellationToken);
-            await crcReset.Execute();
+            await this.vehicle.SetDeviceTimeout(TimeoutScenario.ReadCrc);
 
             logger.AddUserMessage("Requesting CRCs from PCM.");
+            List<MemoryRange> neededRanges = this.ranges.Where(range => (range.Type & blockTypes) != 0).ToList();
+            bool haveBatchCrcs = await this.TryGetBatchCrcs(neededRanges, cancellationToken);
+
+            if (!haveBatchCrcs)
+            {
+                // The kernel will remember (and return) the CRC value of the last block it 
+                // was asked about, which leads to misleading results if you only rewrite 
+                // a single block. So we send a a bogus query to reset the last-used CRC 
+                // value in the kernel.
+                logger.AddUserMessage("Batch CRC query failed, requesting one range at a time.");
+
+                await this.vehicle.SendToolPresentNotification();
+                Query<UInt32> crcReset = this.vehicle.CreateQuery<uint>(
+                    () => this.protocol.CreateCrcQuery(0, 0),
+                    (message) => this.protocol.ParseCrc(message, 0, 0),
+                    cancellationToken);
+                await crcReset.Execute();
+            }
 
-            await this.vehicle.SetDeviceTimeout(TimeoutScenario.ReadCrc);
             bool successForAllRanges = true;
 
             logger.AddUserMessage("\tRange\t\tFile CRC\t\tPCM CRC\tVerdict\tPurpose");
@@ -91,26 +93,110 @@ namespace PcmHacking
                     continue;
                 }
 
-                await this.vehicle.SendToolPresentNotification();
-                this.vehicle.ClearDeviceMessageQueue();
-                bool success = false;
-                UInt32 crc = 0;
-                
-                // Each poll of the pcm causes it to CRC 16kb of segment data.
-                // When the segment sum is available it is returned.
+                if (!haveBatchCrcs)
+                {
+                    Response<UInt32> crcResponse = await this.GetCrcFromPcm(range, cancellationToken);
+                    if (crcResponse.Status != ResponseStatus.Success)
+                    {
+                        this.logger.AddUserMessage("Unable to get CRC for memory range " + range.Address.ToString("X8") + " / " + range.Size.ToString("X8"));
+                        successForAllRanges = false;
+                        continue;
+                    }
+
+                    range.ActualCrc = crcResponse.Value;
+                }
+
+                this.logger.AddUserMessage(
+                    string.Format(
+                        formatString,
+                        range.Address,
+                        range.Address + (range.Size - 1),
+                        range.DesiredCrc,
+                        range.ActualCrc,
+                        range.DesiredCrc == range.ActualCrc ? "Same" : "Different",
+                        range.Type));
+            }
+
+            logger.StatusUpdateActivity(string.Empty);
+
+            await this.vehicle.SendToolPresentNotification();
+
+            foreach (MemoryRange range in this.ranges)
+            {
+                if ((range.Type & blockTypes) == 0)
+                {
+                    continue;
+                }
+
+                if (range.ActualCrc != range.DesiredCrc)
+                {
+                    return false;
+                }
+            }
+
+            this.vehicle.ClearDeviceMessageQueue();
+
+            return successForAllRanges;
+        }
+
+        /// <summary>
+        /// Split a range into blocks and find the blocks whose CRC in the PCM differs from the file.
+        /// </summary>
+        /// <returns>
+        /// The blocks that differ, or null if the CRCs could not be read.
+        /// </returns>
+        public async Task<List<MemoryRange>> FindChangedBlocks(MemoryRange range, int blockSize, CancellationToken cancellationToken)
+        {
+            List<MemoryRange> blocks = new List<MemoryRange>();
+            for (UInt32 offset = 0; offset < range.Size; offset += (UInt32)blockSize)
+            {
+                blocks.Add(new MemoryRange(range.Address + offset, Math.Min((UInt32)blockSize, range.Size - offset), range.Type));
+            }
+
+            new Crc().GetCrcs(this.image, blocks);
+
+            await this.vehicle.SetDeviceTimeout(TimeoutScenario.ReadCrc);
+            if (!await this.TryGetBatchCrcs(blocks, cancellationToken))
+            {
+                return null;
+            }
+
+            return blocks.Where(block => block.ActualCrc != block.DesiredCrc).ToList();
+        }
+
+        /// <summary>
+        /// Get the CRCs for all of the given ranges, using as few requests as the device allows.
+        /// </summary>
+        private async Task<bool> TryGetBatchCrcs(IList<MemoryRange> ranges, CancellationToken cancellationToken)
+        {
+            // 7 bytes of header and 6 bytes per range in the request, 6 bytes of header and 4 bytes per range in the reply.
+            int rangesPerBatch = Math.Min(
+                MaxRangesPerBatch,
+                Math.Min((this.vehicle.DeviceMaxFlashWriteSendSize - 7) / 6, (this.vehicle.DeviceMaxReceiveSize - 7) / 4));
+
+            for (int first = 0; first < ranges.Count; first += rangesPerBatch)
+            {
+                List<MemoryRange> batch = ranges.Skip(first).Take(rangesPerBatch).ToList();
+
+                // Each poll of the pcm causes it to CRC 8kb of segment data, so allow
+                // enough polls for every segment, with some left over for retries.
+                long totalSize = batch.Sum(range => (long)range.Size);
+                int maxPolls = (int)(totalSize / 8192) + batch.Count + 20;
                 int retryDelay = 50;
-                Message query = this.protocol.CreateCrcQuery(range.Address, range.Size);
-                for (int segment = 0; segment < 20; segment++)
+                bool restart = true;
+                bool success = false;
+
+                for (int poll = 0; poll < maxPolls; poll++)
                 {
-                    logger.StatusUpdateActivity($"Processing CRC for range {range.Address:X6}-{range.Address + (range.Size - 1):X6}, segment {segment + 1}");
+                    logger.StatusUpdateActivity($"Processing CRC for {batch.Count} ranges, poll {poll + 1}");
 
                     if (cancellationToken.IsCancellationRequested)
                     {
-                        break;
+                        return false;
                     }
 
                     await this.vehicle.SendToolPresentNotification();
-                    if (!await this.vehicle.SendMessage(query))
+                    if (!await this.vehicle.SendMessage(this.protocol.CreateBatchCrcQuery(batch, restart)))
                     {
                         continue;
                     }
@@ -122,15 +208,33 @@ namespace PcmHacking
                         continue;
                     }
 
-                    Response<UInt32> crcResponse = this.protocol.ParseCrc(response, range.Address, range.Size);
+                    if (this.protocol.IsBatchCrcInProgress(response))
+                    {
+                        // The kernel got the request, so don't make it start over next time.
+                        // It keeps working between requests, so there's no hurry to ask again.
+                        restart = false;
+                        await Task.Delay(retryDelay);
+                        continue;
+                    }
+
+                    Response<UInt32[]> crcResponse = this.protocol.ParseBatchCrc(response, batch.Count);
+                    if (crcResponse.Status == ResponseStatus.Refused)
+                    {
+                        return false;
+                    }
+
                     if (crcResponse.Status != ResponseStatus.Success)
                     {
                         await Task.Delay(retryDelay);
                         continue;
                     }
 
+                    for (int index = 0; index < batch.Count; index++)
+                    {
+                        batch[index].ActualCrc = crcResponse.Value[index];
+                    }
+
                     success = true;
-                    crc = crcResponse.Value;
                     break;
                 }
 
@@ -138,44 +242,61 @@ namespace PcmHacking
 
                 if (!success)
                 {
-                    this.logger.AddUserMessage("Unable to get CRC for memory range " + range.Address.ToString("X8") + " / " + range.Size.ToString("X8"));
-                    successForAllRanges = false;
-                    continue;
+                    return false;
                 }
-
-                range.ActualCrc = crc;
-
-                this.logger.AddUserMessage(
-                    string.Format(
-                        formatString,
-                        range.Address,
-                        range.Address + (range.Size - 1),
-                        range.DesiredCrc,
-                        range.ActualCrc,
-                        range.DesiredCrc == range.ActualCrc ? "Same" : "Different",
-                        range.Type));
             }
 
-            logger.StatusUpdateActivity(string.Empty);
+            return true;
+        }
 
+        /// <summary>
+        /// Get the CRC for a single range.
+        /// </summary>
+        private async Task<Response<UInt32>> GetCrcFromPcm(MemoryRange range, CancellationToken cancellationToken)
+        {
             await this.vehicle.SendToolPresentNotification();
+            this.vehicle.ClearDeviceMessageQueue();
+            Response<UInt32> result = Response.Create(ResponseStatus.Error, (UInt32)0);
 
-            foreach (MemoryRange range in this.ranges)
+            // Each poll of the pcm causes it to CRC 16kb of segment data.
+            // When the segment sum is available it is returned.
+            int retryDelay = 50;
+            Message query = this.protocol.CreateCrcQuery(range.Address, range.Size);
+            for (int segment = 0; segment < 20; segment++)
             {
-                if ((range.Type & blockTypes) == 0)
+                logger.StatusUpdateActivity($"Processing CRC for range {range.Address:X6}-{range.Address + (range.Size - 1):X6}, segment {segment + 1}");
+
+                if (cancellationToken.IsCancellationRequested)
+                {
+                    break;
+                }
+
+                await this.vehicle.SendToolPresentNotification();
+                if (!await this.vehicle.SendMessage(query))
                 {
                     continue;
                 }
 
-                if (range.ActualCrc != range.DesiredCrc)
+                Message response = await this.vehicle.ReceiveMessage();
+                if (response == null)
                 {
-                    return false;
+                    await Task.Delay(retryDelay);
+                    continue;
+                }
+
+                Response<UInt32> crcResponse = this.protocol.ParseCrc(response, range.Address, range.Size);
+                if (crcResponse.Status != ResponseStatus.Success)
+                {
+                    await Task.Delay(retryDelay);
+                    continue;
                 }
+
+                result = crcResponse;
+                break;
             }
 
             this.vehicle.ClearDeviceMessageQueue();
-
-            return successForAllRanges;
+            return result;
         }
     }
 }
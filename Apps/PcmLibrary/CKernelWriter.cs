@@ -30,6 +30,12 @@ namespace PcmHacking
         private readonly WriteType writeType;
         private readonly ILogger logger;
 
+        // See EraseMaxBlocks in write-kernel.c.
+        private const int MaxRangesPerErase = 20;
+
+        // Set when the kernel doesn't understand batch erase requests.
+        private bool useBlockingErase;
+
         public CKernelWriter(Vehicle vehicle, PcmInfo pcmInfo, Protocol protocol, WriteType writeType, ILogger logger)
         {
             this.vehicle = vehicle;
@@ -99,6 +105,9 @@ namespace PcmHacking
                     logger.AddUserMessage("Kernel uploaded to PCM succesfully.");
                 }
 
+                await this.vehicle.SendToolPresentNotification();
+                await this.vehicle.SetKernelTurnaround(cancellationToken);
+
                 // Confirm operating system match
                 await this.vehicle.SendToolPresentNotification();
                 await this.vehicle.SetDeviceTimeout(TimeoutScenario.ReadProperty);
@@ -125,6 +134,7 @@ namespace PcmHacking
                 // TODO: app should check kernel version (not just "is present") and reload only if version is lower than version in kernel file.
                 if (success)
                 {
+                    await this.vehicle.ReportKernelCounters(cancellationToken);
                     await this.vehicle.Cleanup();
                 }
 
@@ -284,31 +294,62 @@ namespace PcmHacking
                 DateTime startTime = DateTime.Now;
                 UInt32 totalSize = this.GetTotalSize(flashChip, relevantBlocks);
                 UInt32 bytesRemaining = totalSize;
+
+                // Find out which ranges need to be erased, then erase them all
+                // at once. The checks need to read flash, so they come first.
+                List<MemoryRange> rangesToWrite = new List<MemoryRange>();
+                List<MemoryRange> rangesToErase = new List<MemoryRange>();
+                Dictionary<MemoryRange, bool[]> blocksToProgram = new Dictionary<MemoryRange, bool[]>();
                 foreach (MemoryRange range in flashChip.MemoryRanges)
                 {
-                    // We'll send a tool-present message during the erase request.
                     if (!this.ShouldProcess(range, relevantBlocks))
                     {
                         continue;
                     }
 
-                    this.logger.AddUserMessage(
-                        string.Format(
-                            "Processing range {0:X6}-{1:X6}",
-                            range.Address,
-                            range.Address + (range.Size - 1)));
-
+                    rangesToWrite.Add(range);
                     if (this.writeType == WriteType.TestWrite)
                     {
-                        this.logger.AddUserMessage("Pretending to erase.");
+                        continue;
+                    }
+
+                    bool[] blocksToWrite = await this.FindBlocksToProgram(verifier, range, image, cancellationToken);
+                    if (blocksToWrite != null)
+                    {
+                        this.logger.AddUserMessage(
+                            string.Format(
+                                "Range {0:X6}-{1:X6}: no erase needed, {2} of {3} blocks have changed.",
+                                range.Address,
+                                range.Address + (range.Size - 1),
+                                blocksToWrite.Count(block => block),
+                                blocksToWrite.Length));
+                        blocksToProgram[range] = blocksToWrite;
                     }
                     else
                     {
-                        if (!await this.EraseMemoryRange(range, cancellationToken))
-                        {
-                            return false;
-                        }
+                        rangesToErase.Add(range);
                     }
+                }
+
+                if (this.writeType == WriteType.TestWrite)
+                {
+                    this.logger.AddUserMessage("Pretending to erase.");
+                }
+                else if (!await this.EraseMemoryRanges(rangesToErase, cancellationToken))
+                {
+                    return false;
+                }
+
+                foreach (MemoryRange range in rangesToWrite)
+                {
+                    this.logger.AddUserMessage(
+                        string.Format(
+                            "Processing range {0:X6}-{1:X6}",
+                            range.Address,
+                            range.Address + (range.Size - 1)));
+
+                    bool[] blocksToWrite;
+                    blocksToProgram.TryGetValue(range, out blocksToWrite);
 
                     if (this.writeType == WriteType.TestWrite)
                     {
@@ -323,6 +364,7 @@ namespace PcmHacking
                         range,
                         image,
                         this.writeType == WriteType.TestWrite,
+                        blocksToWrite,
                         startTime,
                         totalSize,
                         bytesRemaining,
@@ -363,13 +405,9 @@ namespace PcmHacking
                 this.logger.AddUserMessage("Erasing Calibration to force recovery mode.");
                 this.logger.AddUserMessage("");
 
-                foreach(MemoryRange range in flashChip.MemoryRanges)
-                {
-                    if (range.Type == BlockType.Calibration)
-                    {
-                        await this.EraseMemoryRange(range, cancellationToken);
-                    }
-                }
+                await this.EraseMemoryRanges(
+                    flashChip.MemoryRanges.Where(range => range.Type == BlockType.Calibration).ToList(),
+                    cancellationToken);
             }
 
             if (cancellationToken.IsCancellationRequested)
@@ -423,12 +461,136 @@ namespace PcmHacking
         }
 
         /// <summary>
-        /// Erase a block in the flash memory.
+        /// Size of the data in each mode 36 message.
         /// </summary>
-        private async Task<bool> EraseMemoryRange(MemoryRange range, CancellationToken cancellationToken)
+        private int DevicePayloadSize
+        {
+            get
+            {
+                return this.vehicle.DeviceMaxFlashWriteSendSize - 12; // Headers use 10 bytes, sum uses 2 bytes.
+            }
+        }
+
+        /// <summary>
+        /// Find out whether a range can be updated without erasing it first.
+        /// </summary>
+        /// <remarks>
+        /// Blocks with matching CRCs are skipped. The others are sent to the kernel, 
+        /// which compares them with the flash contents. If every changed block only 
+        /// needs bits to change from 1 to 0, the range can be written as-is.
+        /// </remarks>
+        /// <returns>
+        /// One entry per block, true for blocks that must be written, or null if
+        /// the range must be erased.
+        /// </returns>
+        private async Task<bool[]> FindBlocksToProgram(CKernelVerifier verifier, MemoryRange range, byte[] image, CancellationToken cancellationToken)
         {
-            this.logger.AddUserMessage("Erasing.");
+            int blockSize = this.DevicePayloadSize;
+            List<MemoryRange> changedBlocks = await verifier.FindChangedBlocks(range, blockSize, cancellationToken);
+            if ((changedBlocks == null) || (changedBlocks.Count == 0))
+            {
+                return null;
+            }
 
+            bool[] result = new bool[(range.Size + blockSize - 1) / blockSize];
+            await this.vehicle.SetDeviceTimeout(TimeoutScenario.WriteMemoryBlock);
+            foreach (MemoryRange block in changedBlocks)
+            {
+                if (cancellationToken.IsCancellationRequested)
+                {
+                    return null;
+                }
+
+                logger.StatusUpdateActivity($"Comparing {block.Size} bytes at 0x{block.Address:X6}");
+                await this.vehicle.SendToolPresentNotification();
+
+                Query<BlockDiffResult> diffQuery = this.vehicle.CreateQuery<BlockDiffResult>(
+                    () => this.protocol.CreateBlockDiffQuery(image, block.Address, (int)block.Size),
+                    (message) => this.protocol.ParseBlockDiff(message, block.Address, (int)block.Size),
+                    cancellationToken);
+
+                Response<BlockDiffResult> diffResponse = await diffQuery.Execute();
+                if (diffResponse.Status != ResponseStatus.Success)
+                {
+                    this.logger.AddDebugMessage("Block diff query failed: " + diffResponse.Status.ToString());
+                    return null;
+                }
+
+                if (diffResponse.Value == BlockDiffResult.Erase)
+                {
+                    return null;
+                }
+
+                if (diffResponse.Value == BlockDiffResult.Program)
+                {
+                    result[(block.Address - range.Address) / blockSize] = true;
+                }
+            }
+
+            logger.StatusUpdateActivity(string.Empty);
+
+            // The CRCs said something changed, so don't trust a result that says nothing did.
+            if (!result.Any(block => block))
+            {
+                return null;
+            }
+
+            return result;
+        }
+
+        /// <summary>
+        /// Erase blocks in the flash memory, with as few requests as the kernel allows.
+        /// </summary>
+        private async Task<bool> EraseMemoryRanges(IList<MemoryRange> ranges, CancellationToken cancellationToken)
+        {
+            if (ranges.Count == 0)
+            {
+                return true;
+            }
+
+            this.logger.AddUserMessage(ranges.Count == 1 ? "Erasing." : $"Erasing {ranges.Count} blocks.");
+
+            // 6 bytes of header and 3 bytes per block in the request.
+            int rangesPerBatch = Math.Min(MaxRangesPerErase, (this.vehicle.DeviceMaxFlashWriteSendSize - 6) / 3);
+
+            for (int first = 0; first < ranges.Count; first += rangesPerBatch)
+            {
+                List<MemoryRange> batch = ranges.Skip(first).Take(rangesPerBatch).ToList();
+
+                if (!this.useBlockingErase)
+                {
+                    bool? erased = await this.EraseMemoryRangesInBackground(batch, cancellationToken);
+                    if (erased.HasValue)
+                    {
+                        if (!erased.Value)
+                        {
+                            return false;
+                        }
+
+                        continue;
+                    }
+
+                    this.logger.AddDebugMessage("Batch erase is not available, using blocking erase.");
+                    this.useBlockingErase = true;
+                }
+
+                foreach (MemoryRange range in batch)
+                {
+                    if (!await this.EraseMemoryRange(range, cancellationToken))
+                    {
+                        return false;
+                    }
+                }
+            }
+
+            return true;
+        }
+
+        /// <summary>
+        /// Erase a block in the flash memory, one request per block.
+        /// </summary>
+        private async Task<bool> EraseMemoryRange(MemoryRange range, CancellationToken cancellationToken)
+        {
             await this.vehicle.SetDeviceTimeout(TimeoutScenario.EraseMemoryBlock);
             Query<byte> eraseRequest = this.vehicle.CreateQuery<byte>(
                  () => this.protocol.CreateFlashEraseBlockRequest(range.Address),
@@ -455,20 +617,110 @@ namespace PcmHacking
             return true;
         }
 
+        /// <summary>
+        /// Start a batch erase, then poll the kernel until it's done. The
+        /// kernel keeps answering while the chip erases, so each poll only
+        /// needs a short timeout.
+        /// </summary>
+        /// <returns>
+        /// Whether the erase succeeded, or null if the kernel doesn't support
+        /// batch erase.
+        /// </returns>
+        private async Task<bool?> EraseMemoryRangesInBackground(IList<MemoryRange> ranges, CancellationToken cancellationToken)
+        {
+            // The Intel chip's programming voltage takes a moment to settle before the kernel replies.
+            await this.vehicle.SetDeviceTimeout(TimeoutScenario.EraseMemoryBlock);
+            Response<BatchEraseStatus> startResponse = await this.vehicle.CreateQuery<BatchEraseStatus>(
+                () => this.protocol.CreateBatchEraseRequest(ranges),
+                this.protocol.ParseBatchErase,
+                cancellationToken).Execute();
+
+            if (startResponse.Status != ResponseStatus.Success)
+            {
+                this.logger.AddDebugMessage("Batch erase request failed: " + startResponse.Status.ToString());
+                return null;
+            }
+
+            // Erasing a block takes a few seconds at most, this allows for a lot more.
+            int maxPolls = 300 * ranges.Count;
+            const int retryDelay = 100;
+            BatchEraseStatus eraseStatus = startResponse.Value;
+
+            await this.vehicle.SetDeviceTimeout(TimeoutScenario.ReadProperty);
+            for (int poll = 0; (poll < maxPolls) && (eraseStatus.State == EraseJobState.Busy); poll++)
+            {
+                if (cancellationToken.IsCancellationRequested)
+                {
+                    return false;
+                }
+
+                await Task.Delay(retryDelay);
+
+                Response<BatchEraseStatus> statusResponse = await this.vehicle.CreateQuery<BatchEraseStatus>(
+                    this.protocol.CreateBatchEraseStatusQuery,
+                    this.protocol.ParseBatchErase,
+                    cancellationToken).Execute();
+
+                if (statusResponse.Status == ResponseStatus.Success)
+                {
+                    eraseStatus = statusResponse.Value;
+                    int done = eraseStatus.Results.Count(result => result != 0xFF);
+                    logger.StatusUpdateActivity($"Erasing, {done} of {ranges.Count} blocks done");
+                }
+            }
+
+            logger.StatusUpdateActivity(string.Empty);
+
+            if ((eraseStatus.State != EraseJobState.Done) || (eraseStatus.Results.Length != ranges.Count))
+            {
+                this.logger.AddUserMessage("Unable to erase flash memory: the kernel did not finish erasing.");
+                this.RequestDebugLogs(cancellationToken);
+                return false;
+            }
+
+            for (int index = 0; index < ranges.Count; index++)
+            {
+                if (eraseStatus.Results[index] != 0x00)
+                {
+                    this.logger.AddUserMessage(
+                        string.Format(
+                            "Unable to erase flash memory at {0:X6}. Code: {1:X2}",
+                            ranges[index].Address,
+                            eraseStatus.Results[index]));
+                    this.RequestDebugLogs(cancellationToken);
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
         /// <summary>
         /// Copy a single memory range to the PCM.
         /// </summary>
+        /// <param name="blocksToWrite">
+        /// If not null, only the blocks marked true are written.
+        /// </param>
         private async Task<Response<bool>> WriteMemoryRange(
             MemoryRange range,
             byte[] image,
             bool justTestWrite,
+            bool[] blocksToWrite,
             DateTime startTime,
             UInt32 totalSize,
             UInt32 bytesRemaining,
             CancellationToken cancellationToken)
         {
             int retryCount = 0;
-            int devicePayloadSize = vehicle.DeviceMaxFlashWriteSendSize - 12; // Headers use 10 bytes, sum uses 2 bytes.
+            int devicePayloadSize = this.DevicePayloadSize;
+            List<WrittenBlock> badBlocks = new List<WrittenBlock>();
+            Dictionary<int, int> blockRetries = new Dictionary<int, int>();
+            int lastBlockIndex = (int)((range.Size - 1) / devicePayloadSize);
+            if (blocksToWrite != null)
+            {
+                lastBlockIndex = Array.LastIndexOf(blocksToWrite, true);
+            }
+
             for (int index = 0; index < range.Size; index += devicePayloadSize)
             {
                 if (cancellationToken.IsCancellationRequested)
@@ -476,11 +728,17 @@ namespace PcmHacking
                     return Response.Create(ResponseStatus.Cancelled, false, retryCount);
                 }
 
-                await this.vehicle.SendToolPresentNotification();
-
                 int startAddress = (int)(range.Address + index);
                 UInt32 thisPayloadSize = (UInt32) Math.Min(devicePayloadSize, (int)range.Size - index);
 
+                if ((blocksToWrite != null) && !blocksToWrite[index / devicePayloadSize])
+                {
+                    bytesRemaining -= thisPayloadSize;
+                    continue;
+                }
+
+                await this.vehicle.SendToolPresentNotification();
+
                 logger.AddDebugMessage(
                     string.Format(
                         "Sending payload with offset 0x{0:X4}, start address 0x{1:X6}, length 0x{2:X4}.",
@@ -488,12 +746,26 @@ namespace PcmHacking
                         startAddress,
                         thisPayloadSize));
 
+                // All but the last block of the range are pipelined, so the kernel can 
+                // program each block while the next one is on the wire. The last block
+                // is not, so its reply also confirms that the whole range was written.
+                bool lastBlock = index / devicePayloadSize == lastBlockIndex;
+                BlockCopyType copyType;
+                if (lastBlock)
+                {
+                    copyType = justTestWrite ? BlockCopyType.TestWrite : BlockCopyType.Copy;
+                }
+                else
+                {
+                    copyType = justTestWrite ? BlockCopyType.PipelinedTestWrite : BlockCopyType.PipelinedCopy;
+                }
+
                 Message payloadMessage = protocol.CreateBlockMessage(
                     image,
                     startAddress,
                     (int)thisPayloadSize,
                     startAddress,
-                    justTestWrite ? BlockCopyType.TestWrite : BlockCopyType.Copy);
+                    copyType);
 
                 string timeRemaining = string.Empty;
 
@@ -519,7 +791,7 @@ namespace PcmHacking
                 await this.vehicle.SetDeviceTimeout(TimeoutScenario.WriteMemoryBlock);
 
                 // WritePayload contains a retry loop, so if it fails, we don't need to retry at this layer.
-                Response<bool> response = await this.vehicle.WritePayload(payloadMessage, cancellationToken);
+                Response<bool> response = await this.SendBlock(payloadMessage, image, badBlocks, cancellationToken);
                 if (response.Status != ResponseStatus.Success)
                 {
                     return Response.Create(ResponseStatus.Error, false, response.RetryCount);
@@ -527,11 +799,82 @@ namespace PcmHacking
 
                 bytesRemaining -= thisPayloadSize;
                 retryCount += response.RetryCount;
+
+                // The kernel reads back each block after programming it. If one 
+                // doesn't match, program it again now. That can only clear bits, 
+                // so if it still doesn't match, the range needs to be erased, and
+                // the caller will do that after it verifies the range.
+                while (badBlocks.Count > 0)
+                {
+                    WrittenBlock badBlock = badBlocks[0];
+                    badBlocks.RemoveAt(0);
+
+                    int retries;
+                    blockRetries.TryGetValue(badBlock.Address, out retries);
+                    if (retries >= MaxBlockRetries)
+                    {
+                        this.logger.AddUserMessage(string.Format("Block at 0x{0:X6} still does not match.", badBlock.Address));
+                        return Response.Create(ResponseStatus.Error, false, retryCount);
+                    }
+
+                    blockRetries[badBlock.Address] = retries + 1;
+                    retryCount++;
+
+                    this.logger.AddUserMessage(string.Format("Block at 0x{0:X6} does not match, writing it again.", badBlock.Address));
+                    Message retryMessage = protocol.CreateBlockMessage(
+                        image,
+                        badBlock.Address,
+                        badBlock.Length,
+                        badBlock.Address,
+                        BlockCopyType.Copy);
+
+                    response = await this.SendBlock(retryMessage, image, badBlocks, cancellationToken);
+                    if (response.Status != ResponseStatus.Success)
+                    {
+                        return Response.Create(ResponseStatus.Error, false, retryCount + response.RetryCount);
+                    }
+
+                    retryCount += response.RetryCount;
+                }
             }
 
             return Response.Create(ResponseStatus.Success, true, retryCount);
         }
 
+        /// <summary>
+        /// How many times to re-send a block whose CRC doesn't match after it was written.
+        /// </summary>
+        private const int MaxBlockRetries = 3;
+
+        /// <summary>
+        /// Send a mode 36 block, and check the CRCs of any blocks that the reply says were programmed.
+        /// </summary>
+        /// <param name="badBlocks">Blocks that don't match the image are added to this list.</param>
+        private async Task<Response<bool>> SendBlock(Message message, byte[] image, List<WrittenBlock> badBlocks, CancellationToken cancellationToken)
+        {
+            Crc crc = new Crc();
+            return await this.vehicle.WritePayload(
+                message,
+                cancellationToken,
+                reply =>
+                {
+                    Response<bool> result = this.protocol.ParseUploadResponse(reply);
+                    if (result.Status == ResponseStatus.Success)
+                    {
+                        foreach (WrittenBlock block in this.protocol.ParseWrittenBlocks(reply))
+                        {
+                            if ((block.Address + block.Length > image.Length) ||
+                                (crc.GetCrc(image, (UInt32)block.Address, (UInt32)block.Length) != block.Crc))
+                            {
+                                badBlocks.Add(block);
+                            }
+                        }
+                    }
+
+                    return result;
+                });
+        }
+
         /// <summary>
         /// Ask the user for diagnostic information, unless they cancelled.
         private void RequestDebugLogs(CancellationToken cancellationToken)
@@ -53,6 +53,12 @@ namespace PcmHacking
     /// </summary>
     public abstract class Device : IDisposable
     {
+        /// <summary>
+        /// The kernel's turnaround delay when it starts. This must match 
+        /// ElmTurnaroundMicroseconds in the kernel.
+        /// </summary>
+        public const int DefaultKernelTurnaroundMicroseconds = 400;
+
         /// <summary>
         /// Max transmit size.
         /// </summary>
@@ -131,6 +137,16 @@ namespace PcmHacking
         /// </summary>
         public bool Supports4X { get; protected set; }
 
+        /// <summary>
+        /// How long the kernel should wait before replying to a request, 
+        /// to give the device time to switch from sending to receiving.
+        /// </summary>
+        /// <remarks>
+        /// The default suits the AllPro and ScanTool. Devices that can receive
+        /// immediately after sending should set this to zero.
+        /// </remarks>
+        public int KernelTurnaroundMicroseconds { get; protected set; }
+
         /// <summary>
         /// Number of messages recevied so far.
         /// </summary>
@@ -162,6 +178,7 @@ namespace PcmHacking
             this.MaxSendSize = 100;
             this.MaxReceiveSize = 100;
             this.Supports4X = false;
+            this.KernelTurnaroundMicroseconds = DefaultKernelTurnaroundMicroseconds;
             this.Speed = VpwSpeed.Standard;
         }
 
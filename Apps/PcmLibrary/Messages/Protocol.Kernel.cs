@@ -4,6 +4,99 @@ using System.Text;
 
 namespace PcmHacking
 {
+    /// <summary>
+    /// Result of comparing a block of data with the current flash contents.
+    /// </summary>
+    public enum BlockDiffResult
+    {
+        // The flash already contains the data.
+        Identical = 0x00,
+
+        // The data only needs bits to change from 1 to 0, so it can be written without erasing.
+        Program = 0x01,
+
+        // The block must be erased before the data can be written.
+        Erase = 0x02,
+    };
+
+    /// <summary>
+    /// Performance counters reported by the kernel, in the order that the
+    /// kernel sends them. See PerfCounter in common.h.
+    /// </summary>
+    public enum KernelCounter
+    {
+        Messages = 0,
+        ReceiveIdle,
+        ReceiveOverflows,
+        ReceiveErrors,
+        TransmitStalls,
+        FlashWords,
+        FlashPolls,
+        ErasePolls,
+        SleepMicroseconds,
+    };
+
+    /// <summary>
+    /// Where a background erase is up to. See HandleBatchEraseRequest in write-kernel.c.
+    /// </summary>
+    public enum EraseJobState
+    {
+        // No erase has been started.
+        Idle = 0x00,
+
+        // The chip is still erasing.
+        Busy = 0x01,
+
+        // The erase is done, and the result code is valid.
+        Done = 0x02,
+    };
+
+    /// <summary>
+    /// The kernel's reply to a batch erase request or status query.
+    /// </summary>
+    public class BatchEraseStatus
+    {
+        public EraseJobState State { get; private set; }
+
+        /// <summary>
+        /// One per block, in the order they were requested. Zero for success,
+        /// 0xFF if the block hasn't been erased yet, anything else is an error
+        /// code from the flash chip.
+        /// </summary>
+        public byte[] Results { get; private set; }
+
+        public BatchEraseStatus(EraseJobState state, byte[] results)
+        {
+            this.State = state;
+            this.Results = results;
+        }
+    }
+
+    /// <summary>
+    /// The test kernel's summary after a throughput test.
+    /// </summary>
+    public class ThroughputTestSummary
+    {
+        public int FramesSent { get; private set; }
+
+        /// <summary>
+        /// Polls while the DLC transmit FIFO was full, while the frames were going out.
+        /// </summary>
+        public UInt32 TransmitStalls { get; private set; }
+
+        public UInt32 ReceiveOverflows { get; private set; }
+
+        public UInt32 ReceiveErrors { get; private set; }
+
+        public ThroughputTestSummary(int framesSent, UInt32 transmitStalls, UInt32 receiveOverflows, UInt32 receiveErrors)
+        {
+            this.FramesSent = framesSent;
+            this.TransmitStalls = transmitStalls;
+            this.ReceiveOverflows = receiveOverflows;
+            this.ReceiveErrors = receiveErrors;
+        }
+    }
+
     /// <summary>
     /// Mode 3D was apparently not used for anything, so it's being taken
     /// for communications with the kernel.
@@ -127,6 +220,489 @@ namespace PcmHacking
             return Response.Create(ResponseStatus.Success, (UInt32)crc);
         }
 
+        /// <summary>
+        /// Create a request to get the CRCs of several memory ranges.
+        /// </summary>
+        /// <remarks>
+        /// The kernel processes one slice of the batch per request, so the same
+        /// request must be sent until the results arrive. Set restart on the first
+        /// request to discard results from an earlier batch of the same ranges.
+        /// </remarks>
+        public Message CreateBatchCrcQuery(IList<MemoryRange> ranges, bool restart)
+        {
+            byte[] requestBytes = new byte[7 + (ranges.Count * 6)];
+            requestBytes[0] = 0x6C;
+            requestBytes[1] = 0x10;
+            requestBytes[2] = 0xF0;
+            requestBytes[3] = 0x3D;
+            requestBytes[4] = 0x08;
+            requestBytes[5] = (byte)(restart ? 1 : 0);
+            requestBytes[6] = (byte)ranges.Count;
+
+            for (int index = 0; index < ranges.Count; index++)
+            {
+                int offset = 7 + (index * 6);
+                requestBytes[offset + 0] = unchecked((byte)(ranges[index].Size >> 16));
+                requestBytes[offset + 1] = unchecked((byte)(ranges[index].Size >> 8));
+                requestBytes[offset + 2] = unchecked((byte)ranges[index].Size);
+                requestBytes[offset + 3] = unchecked((byte)(ranges[index].Address >> 16));
+                requestBytes[offset + 4] = unchecked((byte)(ranges[index].Address >> 8));
+                requestBytes[offset + 5] = unchecked((byte)ranges[index].Address);
+            }
+
+            return new Message(requestBytes);
+        }
+
+        /// <summary>
+        /// Parse the response to a batch CRC query.
+        /// </summary>
+        public Response<UInt32[]> ParseBatchCrc(Message responseMessage, int count)
+        {
+            ResponseStatus status;
+            byte[] expected = new byte[] { 0x6C, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x08, (byte)count };
+            if (!TryVerifyInitialBytes(responseMessage, expected, out status))
+            {
+                byte[] refused = { 0x6C, DeviceId.Tool, DeviceId.Pcm, 0x7F, 0x3D, 0x08 };
+                if (TryVerifyInitialBytes(responseMessage, refused, out status))
+                {
+                    return Response.Create(ResponseStatus.Refused, (UInt32[])null);
+                }
+
+                return Response.Create(status, (UInt32[])null);
+            }
+
+            byte[] responseBytes = responseMessage.GetBytes();
+            if (responseBytes.Length < expected.Length + (count * 4))
+            {
+                return Response.Create(ResponseStatus.Truncated, (UInt32[])null);
+            }
+
+            UInt32[] result = new UInt32[count];
+            for (int index = 0; index < count; index++)
+            {
+                int offset = expected.Length + (index * 4);
+                result[index] = (UInt32)(
+                    (responseBytes[offset] << 24) |
+                    (responseBytes[offset + 1] << 16) |
+                    (responseBytes[offset + 2] << 8) |
+                    responseBytes[offset + 3]);
+            }
+
+            return Response.Create(ResponseStatus.Success, result);
+        }
+
+        /// <summary>
+        /// Indicates whether the kernel is still working on a batch CRC query.
+        /// </summary>
+        public bool IsBatchCrcInProgress(Message responseMessage)
+        {
+            ResponseStatus status;
+            byte[] expected = new byte[] { 0x6C, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0xFF, 0x08 };
+            return TryVerifyInitialBytes(responseMessage, expected, out status);
+        }
+
+        /// <summary>
+        /// Create a request to find out which chunks of a memory range contain a single repeated byte.
+        /// </summary>
+        public Message CreateBlankMapQuery(UInt32 address, int chunkSize, int chunkCount)
+        {
+            return new Message(new byte[]
+            {
+                0x6C,
+                0x10,
+                0xF0,
+                0x3D,
+                0x07,
+                unchecked((byte)(chunkSize >> 8)),
+                unchecked((byte)chunkSize),
+                unchecked((byte)(chunkCount >> 8)),
+                unchecked((byte)chunkCount),
+                unchecked((byte)(address >> 16)),
+                unchecked((byte)(address >> 8)),
+                unchecked((byte)address),
+            });
+        }
+
+        /// <summary>
+        /// Parse the response to a blank-map query.
+        /// </summary>
+        /// <returns>
+        /// One entry per chunk. The entry is the chunk's fill value if every
+        /// byte in the chunk is the same, or null if the chunk must be read.
+        /// </returns>
+        public Response<byte?[]> ParseBlankMap(Message responseMessage, UInt32 address, int chunkSize, int chunkCount)
+        {
+            ResponseStatus status;
+            byte[] expected = new byte[]
+            {
+                0x6C,
+                DeviceId.Tool,
+                DeviceId.Pcm,
+                0x7D,
+                0x07,
+                unchecked((byte)(chunkSize >> 8)),
+                unchecked((byte)chunkSize),
+                unchecked((byte)(chunkCount >> 8)),
+                unchecked((byte)chunkCount),
+                unchecked((byte)(address >> 16)),
+                unchecked((byte)(address >> 8)),
+                unchecked((byte)address),
+            };
+
+            if (!TryVerifyInitialBytes(responseMessage, expected, out status))
+            {
+                byte[] refused = { 0x6C, DeviceId.Tool, DeviceId.Pcm, 0x7F, 0x3D, 0x07 };
+                if (TryVerifyInitialBytes(responseMessage, refused, out status))
+                {
+                    return Response.Create(ResponseStatus.Refused, (byte?[])null);
+                }
+
+                return Response.Create(status, (byte?[])null);
+            }
+
+            byte[] responseBytes = responseMessage.GetBytes();
+            int bitmapOffset = expected.Length;
+            int valueOffset = bitmapOffset + ((chunkCount + 7) / 8);
+            if (responseBytes.Length < valueOffset)
+            {
+                return Response.Create(ResponseStatus.Truncated, (byte?[])null);
+            }
+
+            byte?[] result = new byte?[chunkCount];
+            for (int index = 0; index < chunkCount; index++)
+            {
+                if ((responseBytes[bitmapOffset + (index / 8)] & (0x80 >> (index % 8))) == 0)
+                {
+                    continue;
+                }
+
+                if (valueOffset >= responseBytes.Length)
+                {
+                    return Response.Create(ResponseStatus.Truncated, (byte?[])null);
+                }
+
+                result[index] = responseBytes[valueOffset++];
+            }
+
+            return Response.Create(ResponseStatus.Success, result);
+        }
+
+        /// <summary>
+        /// Create a request to compare part of an image with the current flash contents.
+        /// </summary>
+        public Message CreateBlockDiffQuery(byte[] image, UInt32 address, int length)
+        {
+            byte[] requestBytes = new byte[10 + length];
+            requestBytes[0] = 0x6C;
+            requestBytes[1] = 0x10;
+            requestBytes[2] = 0xF0;
+            requestBytes[3] = 0x3D;
+            requestBytes[4] = 0x09;
+            requestBytes[5] = unchecked((byte)(length >> 8));
+            requestBytes[6] = unchecked((byte)length);
+            requestBytes[7] = unchecked((byte)(address >> 16));
+            requestBytes[8] = unchecked((byte)(address >> 8));
+            requestBytes[9] = unchecked((byte)address);
+            Buffer.BlockCopy(image, (int)address, requestBytes, 10, length);
+            return new Message(requestBytes);
+        }
+
+        /// <summary>
+        /// Parse the response to a block diff query.
+        /// </summary>
+        public Response<BlockDiffResult> ParseBlockDiff(Message responseMessage, UInt32 address, int length)
+        {
+            ResponseStatus status;
+            byte[] expected = new byte[]
+            {
+                0x6C,
+                DeviceId.Tool,
+                DeviceId.Pcm,
+                0x7D,
+                0x09,
+                unchecked((byte)(length >> 8)),
+                unchecked((byte)length),
+                unchecked((byte)(address >> 16)),
+                unchecked((byte)(address >> 8)),
+                unchecked((byte)address),
+            };
+
+            if (!TryVerifyInitialBytes(responseMessage, expected, out status))
+            {
+                byte[] refused = { 0x6C, DeviceId.Tool, DeviceId.Pcm, 0x7F, 0x3D, 0x09 };
+                if (TryVerifyInitialBytes(responseMessage, refused, out status))
+                {
+                    return Response.Create(ResponseStatus.Refused, BlockDiffResult.Erase);
+                }
+
+                return Response.Create(status, BlockDiffResult.Erase);
+            }
+
+            byte[] responseBytes = responseMessage.GetBytes();
+            if (responseBytes.Length < expected.Length + 1)
+            {
+                return Response.Create(ResponseStatus.Truncated, BlockDiffResult.Erase);
+            }
+
+            byte result = responseBytes[expected.Length];
+            if (result > (byte)BlockDiffResult.Erase)
+            {
+                return Response.Create(ResponseStatus.UnexpectedResponse, BlockDiffResult.Erase);
+            }
+
+            return Response.Create(ResponseStatus.Success, (BlockDiffResult)result);
+        }
+
+        /// <summary>
+        /// Create a request to set how long the kernel waits before replying to each request.
+        /// </summary>
+        public Message CreateTurnaroundDelayRequest(int microseconds)
+        {
+            return new Message(new byte[]
+            {
+                0x6C,
+                0x10,
+                0xF0,
+                0x3D,
+                0x0A,
+                unchecked((byte)(microseconds >> 8)),
+                unchecked((byte)microseconds),
+            });
+        }
+
+        /// <summary>
+        /// Find out whether the kernel accepted the new turnaround delay.
+        /// </summary>
+        public Response<bool> ParseTurnaroundDelay(Message responseMessage, int microseconds)
+        {
+            ResponseStatus status;
+            byte[] expected = new byte[]
+            {
+                0x6C,
+                DeviceId.Tool,
+                DeviceId.Pcm,
+                0x7D,
+                0x0A,
+                unchecked((byte)(microseconds >> 8)),
+                unchecked((byte)microseconds),
+            };
+
+            if (!TryVerifyInitialBytes(responseMessage, expected, out status))
+            {
+                byte[] refused = { 0x6C, DeviceId.Tool, DeviceId.Pcm, 0x7F, 0x3D, 0x0A };
+                if (TryVerifyInitialBytes(responseMessage, refused, out status))
+                {
+                    return Response.Create(ResponseStatus.Refused, false);
+                }
+
+                return Response.Create(status, false);
+            }
+
+            return Response.Create(ResponseStatus.Success, true);
+        }
+
+        /// <summary>
+        /// Create a request for the kernel's performance counters.
+        /// </summary>
+        public Message CreatePerfCounterQuery()
+        {
+            return new Message(new byte[] { 0x6C, 0x10, 0xF0, 0x3D, 0x0B });
+        }
+
+        /// <summary>
+        /// Get the performance counters from the kernel's reply. Newer kernels
+        /// may send more counters than KernelCounter knows about.
+        /// </summary>
+        public Response<UInt32[]> ParsePerfCounters(Message responseMessage)
+        {
+            ResponseStatus status;
+            byte[] expected = new byte[] { 0x6C, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x0B };
+            if (!TryVerifyInitialBytes(responseMessage, expected, out status))
+            {
+                return Response.Create(status, new UInt32[0]);
+            }
+
+            byte[] responseBytes = responseMessage.GetBytes();
+            if (responseBytes.Length < expected.Length + 1)
+            {
+                return Response.Create(ResponseStatus.Truncated, new UInt32[0]);
+            }
+
+            int count = responseBytes[expected.Length];
+            int start = expected.Length + 1;
+            if (responseBytes.Length < start + (count * 4))
+            {
+                return Response.Create(ResponseStatus.Truncated, new UInt32[0]);
+            }
+
+            UInt32[] counters = new UInt32[count];
+            for (int index = 0; index < count; index++)
+            {
+                int offset = start + (index * 4);
+                counters[index] =
+                    (UInt32)(responseBytes[offset] << 24) |
+                    (UInt32)(responseBytes[offset + 1] << 16) |
+                    (UInt32)(responseBytes[offset + 2] << 8) |
+                    responseBytes[offset + 3];
+            }
+
+            return Response.Create(ResponseStatus.Success, counters);
+        }
+
+        /// <summary>
+        /// Frame header size for the throughput test: 6C F0 10 7D 0E and a 2-byte sequence number.
+        /// </summary>
+        public const int ThroughputFrameHeaderSize = 7;
+
+        /// <summary>
+        /// Ask the test kernel to send a number of frames back to back.
+        /// </summary>
+        /// <remarks>
+        /// Only test-kernel.c understands this.
+        /// </remarks>
+        public Message CreateThroughputTestRequest(int payloadSize, int count)
+        {
+            return new Message(new byte[]
+            {
+                0x6C, DeviceId.Pcm, DeviceId.Tool, 0x3D, 0x0E,
+                unchecked((byte)(payloadSize >> 8)),
+                unchecked((byte)payloadSize),
+                unchecked((byte)(count >> 8)),
+                unchecked((byte)count),
+            });
+        }
+
+        /// <summary>
+        /// Get the sequence number from a throughput test frame.
+        /// </summary>
+        /// <remarks>
+        /// Frames with the wrong size or data get Error, so the caller can count them as corrupt.
+        /// </remarks>
+        public Response<int> ParseThroughputFrame(Message message, int payloadSize)
+        {
+            ResponseStatus status;
+            byte[] expected = new byte[] { 0x6C, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x0E };
+            if (!TryVerifyInitialBytes(message, expected, out status))
+            {
+                return Response.Create(status, 0);
+            }
+
+            byte[] actual = message.GetBytes();
+            if (actual.Length < ThroughputFrameHeaderSize + payloadSize)
+            {
+                return Response.Create(ResponseStatus.Truncated, 0);
+            }
+
+            int sequence = (actual[5] << 8) | actual[6];
+            for (int index = 0; index < payloadSize; index++)
+            {
+                if (actual[ThroughputFrameHeaderSize + index] != (byte)(sequence + index))
+                {
+                    return Response.Create(ResponseStatus.Error, sequence);
+                }
+            }
+
+            return Response.Create(ResponseStatus.Success, sequence);
+        }
+
+        /// <summary>
+        /// Parse the summary that the test kernel sends after the last throughput test frame.
+        /// </summary>
+        public Response<ThroughputTestSummary> ParseThroughputSummary(Message message)
+        {
+            ResponseStatus status;
+            byte[] expected = new byte[] { 0x6C, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x0F };
+            if (!TryVerifyInitialBytes(message, expected, out status))
+            {
+                return Response.Create(status, (ThroughputTestSummary)null);
+            }
+
+            byte[] actual = message.GetBytes();
+            if (actual.Length < 19)
+            {
+                return Response.Create(ResponseStatus.Truncated, (ThroughputTestSummary)null);
+            }
+
+            Func<int, UInt32> getLong = offset => (UInt32)((actual[offset] << 24) | (actual[offset + 1] << 16) | (actual[offset + 2] << 8) | actual[offset + 3]);
+            return Response.Create(
+                ResponseStatus.Success,
+                new ThroughputTestSummary((actual[5] << 8) | actual[6], getLong(7), getLong(11), getLong(15)));
+        }
+
+        /// <summary>
+        /// Ask the kernel to start erasing a list of blocks, and reply right away.
+        /// </summary>
+        public Message CreateBatchEraseRequest(IList<MemoryRange> ranges)
+        {
+            byte[] requestBytes = new byte[6 + (ranges.Count * 3)];
+            requestBytes[0] = 0x6C;
+            requestBytes[1] = 0x10;
+            requestBytes[2] = 0xF0;
+            requestBytes[3] = 0x3D;
+            requestBytes[4] = 0x0D;
+            requestBytes[5] = (byte)ranges.Count;
+
+            for (int index = 0; index < ranges.Count; index++)
+            {
+                int offset = 6 + (index * 3);
+                requestBytes[offset] = unchecked((byte)(ranges[index].Address >> 16));
+                requestBytes[offset + 1] = unchecked((byte)(ranges[index].Address >> 8));
+                requestBytes[offset + 2] = unchecked((byte)ranges[index].Address);
+            }
+
+            return new Message(requestBytes);
+        }
+
+        /// <summary>
+        /// Ask the kernel how a batch erase is going.
+        /// </summary>
+        public Message CreateBatchEraseStatusQuery()
+        {
+            return new Message(new byte[] { 0x6C, 0x10, 0xF0, 0x3D, 0x0D, 0x00 });
+        }
+
+        /// <summary>
+        /// Parse the reply to a batch erase request or status query.
+        /// </summary>
+        public Response<BatchEraseStatus> ParseBatchErase(Message responseMessage)
+        {
+            ResponseStatus status;
+            BatchEraseStatus failed = new BatchEraseStatus(EraseJobState.Idle, new byte[0]);
+            byte[] expected = new byte[] { 0x6C, DeviceId.Tool, DeviceId.Pcm, 0x7D, 0x0D };
+            if (!TryVerifyInitialBytes(responseMessage, expected, out status))
+            {
+                byte[] refused = { 0x6C, DeviceId.Tool, DeviceId.Pcm, 0x7F, 0x3D, 0x0D };
+                if (TryVerifyInitialBytes(responseMessage, refused, out status))
+                {
+                    return Response.Create(ResponseStatus.Refused, failed);
+                }
+
+                return Response.Create(status, failed);
+            }
+
+            byte[] responseBytes = responseMessage.GetBytes();
+            if (responseBytes.Length < expected.Length + 2)
+            {
+                return Response.Create(ResponseStatus.Truncated, failed);
+            }
+
+            byte state = responseBytes[5];
+            if (state > (byte)EraseJobState.Done)
+            {
+                return Response.Create(ResponseStatus.UnexpectedResponse, failed);
+            }
+
+            int count = responseBytes[6];
+            if (responseBytes.Length < 7 + count)
+            {
+                return Response.Create(ResponseStatus.Truncated, failed);
+            }
+
+            byte[] results = new byte[count];
+            Buffer.BlockCopy(responseBytes, 7, results, 0, count);
+            return Response.Create(ResponseStatus.Success, new BatchEraseStatus((EraseJobState)state, results));
+        }
+
         /// <summary>
         /// Ask the kernel to erase a block of flash memory.
         /// </summary>
@@ -14,8 +14,35 @@ namespace PcmHacking
 
         // Test copy to flash, but do not unlock or actually write.
         TestWrite = 0x44,
+
+        // Copy to flash, but reply as soon as the block is received. The kernel
+        // programs the block while receiving the next one, and reports any error
+        // in the reply to the next block.
+        PipelinedCopy = 0x02,
+
+        // Pipelined version of TestWrite.
+        PipelinedTestWrite = 0x46,
     };
 
+    /// <summary>
+    /// A flash block that the kernel programmed, with the CRC that it read back.
+    /// </summary>
+    public class WrittenBlock
+    {
+        public int Address { get; private set; }
+
+        public int Length { get; private set; }
+
+        public UInt32 Crc { get; private set; }
+
+        public WrittenBlock(int address, int length, UInt32 crc)
+        {
+            this.Address = address;
+            this.Length = length;
+            this.Crc = crc;
+        }
+    }
+
     public partial class Protocol
     {
         /// <summary>
@@ -91,6 +118,36 @@ namespace PcmHacking
             return this.DoSimpleValidation(message, Priority.Block, Mode.PCMUpload);
         }
 
+        /// <summary>
+        /// Get the flash blocks listed in a successful upload response.
+        /// </summary>
+        /// <remarks>
+        /// The kernel lists each flash block it programmed since its last reply,
+        /// so a pipelined block shows up in the reply to the block after it.
+        /// Replies from RAM copies, test writes and older kernels have none.
+        /// </remarks>
+        public List<WrittenBlock> ParseWrittenBlocks(Message message)
+        {
+            List<WrittenBlock> result = new List<WrittenBlock>();
+            byte[] actual = message.GetBytes();
+            if (actual.Length < 6)
+            {
+                return result;
+            }
+
+            const int entrySize = 9;
+            int count = actual[5];
+            for (int index = 6; (count > 0) && (index + entrySize <= actual.Length); index += entrySize, count--)
+            {
+                int address = (actual[index] << 16) | (actual[index + 1] << 8) | actual[index + 2];
+                int length = (actual[index + 3] << 8) | actual[index + 4];
+                UInt32 crc = (UInt32)((actual[index + 5] << 24) | (actual[index + 6] << 16) | (actual[index + 7] << 8) | actual[index + 8]);
+                result.Add(new WrittenBlock(address, length, crc));
+            }
+
+            return result;
+        }
+
         /// <summary>
         /// Create a request to read an arbitrary address range.
         /// </summary>
@@ -115,6 +172,158 @@ namespace PcmHacking
             }
         }
 
+        /// <summary>
+        /// Create a request to read an arbitrary address range, with run-length encoding.
+        /// </summary>
+        /// <remarks>
+        /// The kernel will reply with an RLE block (submode 02) when that is smaller
+        /// than the raw data, or a normal block (submode 01) when it is not.
+        /// </remarks>
+        public Message CreateCompressedReadRequest(int startAddress, int length)
+        {
+            byte[] request = { 0x6D, DeviceId.Pcm, DeviceId.Tool, 0x35, 0x02, (byte)(length >> 8), (byte)(length & 0xFF), (byte)(startAddress >> 16), (byte)((startAddress >> 8) & 0xFF), (byte)(startAddress & 0xFF) };
+            return new Message(request);
+        }
+
+        /// <summary>
+        /// Create a request to stream an address range as consecutive blocks.
+        /// </summary>
+        /// <remarks>
+        /// The kernel replies with one block for every blockSize bytes in the range, 
+        /// each encoded like the reply to CreateCompressedReadRequest. The length 
+        /// limits how many blocks are sent before the tool has to ask for more.
+        /// </remarks>
+        public Message CreateStreamReadRequest(int startAddress, int blockSize, int length)
+        {
+            byte[] request =
+            {
+                0x6D,
+                DeviceId.Pcm,
+                DeviceId.Tool,
+                0x35,
+                0x03,
+                unchecked((byte)(blockSize >> 8)),
+                unchecked((byte)blockSize),
+                unchecked((byte)(startAddress >> 16)),
+                unchecked((byte)(startAddress >> 8)),
+                unchecked((byte)startAddress),
+                unchecked((byte)(length >> 16)),
+                unchecked((byte)(length >> 8)),
+                unchecked((byte)length),
+            };
+
+            return new Message(request);
+        }
+
+        /// <summary>
+        /// Create a request to read a block along with a CRC of its contents.
+        /// </summary>
+        /// <remarks>
+        /// The kernel computes the CRC of the block while sending it. See HandleReadMode35Crc.
+        /// </remarks>
+        public Message CreateCrcReadRequest(int startAddress, int length)
+        {
+            byte[] request =
+            {
+                0x6D,
+                DeviceId.Pcm,
+                DeviceId.Tool,
+                0x35,
+                0x04,
+                unchecked((byte)(length >> 8)),
+                unchecked((byte)length),
+                unchecked((byte)(startAddress >> 16)),
+                unchecked((byte)(startAddress >> 8)),
+                unchecked((byte)startAddress),
+            };
+
+            return new Message(request);
+        }
+
+        /// <summary>
+        /// Parse the reply to CreateCrcReadRequest.
+        /// </summary>
+        /// <remarks>
+        /// Succeeds only if the block sum is right and the data matches the kernel's CRC.
+        /// Kernels that don't know about CRC reads send a normal block instead, which
+        /// gets UnexpectedResponse.
+        /// </remarks>
+        public Response<byte[]> ParseCrcPayload(Message message, int length, int expectedAddress)
+        {
+            ResponseStatus status;
+            byte[] actual = message.GetBytes();
+            byte[] expected = new byte[] { 0x6D, 0xF0, 0x10, 0x36 };
+            if (!TryVerifyInitialBytes(actual, expected, out status))
+            {
+                return Response.Create(status, new byte[0]);
+            }
+
+            if (actual.Length < 10)
+            {
+                return Response.Create(ResponseStatus.Truncated, new byte[0]);
+            }
+
+            if (actual[4] != 0x04)
+            {
+                return Response.Create(ResponseStatus.UnexpectedResponse, new byte[0]);
+            }
+
+            int dataLength = (actual[5] << 8) + actual[6];
+            int actualAddress = (actual[7] << 16) + (actual[8] << 8) + actual[9];
+            if ((actualAddress != expectedAddress) || (dataLength != length))
+            {
+                return Response.Create(ResponseStatus.Error, new byte[0]);
+            }
+
+            // Header, data, CRC, block sum.
+            if (actual.Length < 10 + dataLength + 4 + 2)
+            {
+                return Response.Create(ResponseStatus.Truncated, new byte[0]);
+            }
+
+            UInt16 sum = 0;
+            for (int index = 4; index < 10 + dataLength + 4; index++)
+            {
+                sum += actual[index];
+            }
+
+            int crcIndex = 10 + dataLength;
+            int payloadSum = (actual[crcIndex + 4] << 8) + actual[crcIndex + 5];
+            if (payloadSum != sum)
+            {
+                return Response.Create(ResponseStatus.Error, new byte[0]);
+            }
+
+            UInt32 kernelCrc = (UInt32)((actual[crcIndex] << 24) | (actual[crcIndex + 1] << 16) | (actual[crcIndex + 2] << 8) | actual[crcIndex + 3]);
+            Crc crc = new Crc();
+            if (crc.GetCrc(actual, 10, (UInt32)dataLength) != kernelCrc)
+            {
+                return Response.Create(ResponseStatus.Error, new byte[0]);
+            }
+
+            byte[] result = new byte[dataLength];
+            Buffer.BlockCopy(actual, 10, result, 0, dataLength);
+            return Response.Create(ResponseStatus.Success, result);
+        }
+
+        /// <summary>
+        /// Get the start address from a read-request payload, without validating the payload.
+        /// </summary>
+        public bool TryGetPayloadAddress(Message message, out int address)
+        {
+            ResponseStatus status;
+            byte[] actual = message.GetBytes();
+            byte[] expected = new byte[] { 0x6D, 0xF0, 0x10, 0x36 };
+            if (!TryVerifyInitialBytes(actual, expected, out status) || (actual.Length < 10))
+            {
+                address = 0;
+                return false;
+            }
+
+            address = (actual[7] << 16) + (actual[8] << 8) + actual[9];
+            return true;
+        }
+
         /// <summary>
         /// Parse the payload of a read request.
         /// </summary>
@@ -172,19 +381,80 @@ namespace PcmHacking
             // RLE block
             else if (actual[4] == 2)
             {
-                // This isnt going to work with existing kernels... need to support variable length.
-                byte value = actual[10];
-                for (int index = 0; index < dataLength; index++)
+                // With RLE encoding, the length field is the length of the encoded data.
+                if (actual.Length - 12 < dataLength)
                 {
-                    result[index] = value;
+                    return Response.Create(ResponseStatus.Truncated, new byte[0]);
                 }
 
-                return Response.Create(ResponseStatus.Error, result);
+                UInt16 ValidSum = VpwUtilities.CalcBlockChecksum(actual);
+                int PayloadSum = (actual[dataLength + 10] << 8) + actual[dataLength + 11];
+                if (PayloadSum != ValidSum)
+                {
+                    return Response.Create(ResponseStatus.Error, new byte[0]);
+                }
+
+                result = new byte[length];
+                if (!TryDecodeRle(actual, 10, dataLength, result))
+                {
+                    return Response.Create(ResponseStatus.Error, new byte[0]);
+                }
+
+                return Response.Create(ResponseStatus.Success, result);
             }
             else
             {
                 return Response.Create(ResponseStatus.Error, result);
             }
         }
+
+        /// <summary>
+        /// Expand run-length encoded data from the kernel.
+        /// </summary>
+        /// <remarks>
+        /// Control bytes 00-7F are followed by (control + 1) literal bytes.
+        /// Control bytes 80-FF are followed by one byte that is repeated 
+        /// (control - 0x80 + 3) times. See RleEncode in common-readwrite.c.
+        /// </remarks>
+        private static bool TryDecodeRle(byte[] encoded, int offset, int encodedLength, byte[] result)
+        {
+            int inIndex = offset;
+            int end = offset + encodedLength;
+            int outIndex = 0;
+
+            while (inIndex < end)
+            {
+                byte control = encoded[inIndex++];
+                if ((control & 0x80) == 0)
+                {
+                    int count = control + 1;
+                    if ((inIndex + count > end) || (outIndex + count > result.Length))
+                    {
+                        return false;
+                    }
+
+                    Buffer.BlockCopy(encoded, inIndex, result, outIndex, count);
+                    inIndex += count;
+                    outIndex += count;
+                }
+                else
+                {
+                    int count = (control & 0x7F) + 3;
+                    if ((inIndex >= end) || (outIndex + count > result.Length))
+                    {
+                        return false;
+                    }
+
+                    byte value = encoded[inIndex++];
+                    for (int index = 0; index < count; index++)
+                    {
+                        result[outIndex++] = value;
+                    }
+                }
+            }
+
+            // Anything other than an exact fit means the data was corrupted.
+            return outIndex == result.Length;
+        }
     }
 }
@@ -1,12 +1,18 @@
 ﻿using System;
 using System.Collections.Generic;
 using System.Text;
+using System.Threading.Tasks;
 
 namespace PcmHacking
 {
     /// <summary>
     /// From https://barrgroup.com/Embedded-Systems/How-To/CRC-Calculation-C-Code
     /// </summary>
+    /// <remarks>
+    /// This gives the same results as crc.c in the kernel, but it works on 8 bytes
+    /// at a time ("slicing-by-8") so that big images and lots of blocks don't take
+    /// long. Kernels/crcmap.cpp uses the same method.
+    /// </remarks>
     public class Crc
     {
         private static UInt32[] crcTable;
@@ -14,11 +20,14 @@ namespace PcmHacking
         private const UInt32 TOPBIT = 0x80000000;
         private const UInt32 POLYNOMIAL = 0x04C11DB7;
 
+        // Ranges smaller than this are not worth starting a thread for.
+        private const UInt32 ParallelThreshold = 64 * 1024;
+
         public Crc()
         {
             if (crcTable == null)
             {
-                crcTable = new UInt32[256];
+                UInt32[] table = new UInt32[8 * 256];
                 UInt32 remainder;
 
                 /*
@@ -52,23 +61,66 @@ namespace PcmHacking
                     /*
                      * Store the result into the table.
                      */
-                    crcTable[dividend] = remainder;
+                    table[dividend] = remainder;
                 }
+
+                // Each of the other tables gives the effect of a byte that is
+                // followed by 1 to 7 more bytes.
+                for (int slice = 1; slice < 8; slice++)
+                {
+                    for (int dividend = 0; dividend < 256; dividend++)
+                    {
+                        remainder = table[((slice - 1) * 256) + dividend];
+                        table[(slice * 256) + dividend] = (remainder << 8) ^ table[remainder >> (WIDTH - 8)];
+                    }
+                }
+
+                // Only publish the table once it is complete, since GetCrcs uses
+                // more than one thread.
+                crcTable = table;
             }
         }
 
         public UInt32 GetCrc(byte[] buffer, UInt32 start, UInt32 length)
         {
-            byte data;
-            UInt32 remainder = 0;
+            return GetCrc(buffer, start, length, 0);
+        }
+
+        /// <summary>
+        /// Continue a CRC from an earlier call, to get the CRC of data that arrives in pieces.
+        /// </summary>
+        public UInt32 GetCrc(byte[] buffer, UInt32 start, UInt32 length, UInt32 remainder)
+        {
+            UInt32[] table = crcTable;
+            UInt32 index = start;
+            UInt32 end = start + length;
+
+            for (; index + 8 <= end; index += 8)
+            {
+                UInt32 high = remainder ^ (UInt32)(
+                    (buffer[index] << 24) |
+                    (buffer[index + 1] << 16) |
+                    (buffer[index + 2] << 8) |
+                    buffer[index + 3]);
+
+                remainder =
+                    table[(7 * 256) + (high >> 24)] ^
+                    table[(6 * 256) + ((high >> 16) & 0xFF)] ^
+                    table[(5 * 256) + ((high >> 8) & 0xFF)] ^
+                    table[(4 * 256) + (high & 0xFF)] ^
+                    table[(3 * 256) + buffer[index + 4]] ^
+                    table[(2 * 256) + buffer[index + 5]] ^
+                    table[(1 * 256) + buffer[index + 6]] ^
+                    table[buffer[index + 7]];
+            }
 
-            for (UInt32 index = start; index < start + length; index++)
+            for (; index < end; index++)
             {
                 /*
                  * Divide the message by the polynomial, a byte at a time.
                  */
-                data = (byte)(buffer[index] ^ (remainder >> (WIDTH - 8)));
-                remainder = crcTable[data] ^ (remainder << 8);
+                byte data = (byte)(buffer[index] ^ (remainder >> (WIDTH - 8)));
+                remainder = table[data] ^ (remainder << 8);
             }
 
             /*
@@ -76,5 +128,34 @@ namespace PcmHacking
              */
             return (remainder);
         }
+
+        /// <summary>
+        /// Set the DesiredCrc of each range from the image. Big lists of ranges
+        /// are split across threads.
+        /// </summary>
+        public void GetCrcs(byte[] image, IEnumerable<MemoryRange> ranges)
+        {
+            List<MemoryRange> list = new List<MemoryRange>(ranges);
+            UInt32 totalSize = 0;
+            foreach (MemoryRange range in list)
+            {
+                totalSize += range.Size;
+            }
+
+            if ((list.Count < 2) || (totalSize < ParallelThreshold))
+            {
+                foreach (MemoryRange range in list)
+                {
+                    range.DesiredCrc = this.GetCrc(image, range.Address, range.Size);
+                }
+
+                return;
+            }
+
+            Parallel.ForEach(list, range =>
+            {
+                range.DesiredCrc = this.GetCrc(image, range.Address, range.Size);
+            });
+        }
     }
 }
@@ -254,6 +254,66 @@ namespace PcmHacking
             return 0;
         }
 
+        /// <summary>
+        /// Tell the kernel how long this device needs between sending a request and receiving the reply.
+        /// </summary>
+        /// <remarks>
+        /// Failure is not fatal, the kernel just keeps using its default delay.
+        /// </remarks>
+        public async Task<bool> SetKernelTurnaround(CancellationToken cancellationToken)
+        {
+            int microseconds = this.device.KernelTurnaroundMicroseconds;
+            if (microseconds == Device.DefaultKernelTurnaroundMicroseconds)
+            {
+                return true;
+            }
+
+            await this.SetDeviceTimeout(TimeoutScenario.ReadProperty);
+            Query<bool> query = this.CreateQuery<bool>(
+                () => this.protocol.CreateTurnaroundDelayRequest(microseconds),
+                (message) => this.protocol.ParseTurnaroundDelay(message, microseconds),
+                cancellationToken);
+
+            Response<bool> response = await query.Execute();
+            if (response.Status != ResponseStatus.Success)
+            {
+                this.logger.AddDebugMessage("Unable to set kernel turnaround delay: " + response.Status.ToString());
+                return false;
+            }
+
+            this.logger.AddDebugMessage("Kernel turnaround delay set to " + microseconds + " microseconds.");
+            return true;
+        }
+
+        /// <summary>
+        /// Show the kernel's performance counters, so we can see where the
+        /// time went. Kernels that don't have counters just won't reply.
+        /// </summary>
+        public async Task ReportKernelCounters(CancellationToken cancellationToken)
+        {
+            await this.SetDeviceTimeout(TimeoutScenario.ReadProperty);
+            Query<UInt32[]> query = this.CreateQuery<UInt32[]>(
+                this.protocol.CreatePerfCounterQuery,
+                this.protocol.ParsePerfCounters,
+                cancellationToken);
+
+            Response<UInt32[]> response = await query.Execute();
+            if (response.Status != ResponseStatus.Success)
+            {
+                this.logger.AddDebugMessage("Unable to get kernel counters: " + response.Status.ToString());
+                return;
+            }
+
+            List<string> descriptions = new List<string>();
+            for (int index = 0; index < response.Value.Length; index++)
+            {
+                string name = Enum.IsDefined(typeof(KernelCounter), index) ? ((KernelCounter)index).ToString() : "Counter" + index;
+                descriptions.Add(name + " " + response.Value[index]);
+            }
+
+            this.logger.AddUserMessage("Kernel counters: " + string.Join(", ", descriptions));
+        }
+
         /// <summary>
         /// Check for a running kernel.
         /// </summary>
@@ -571,8 +631,17 @@ namespace PcmHacking
         /// <summary>
         /// Sends the provided message, with a retry loop. 
         /// </summary>
-        public async Task<Response<bool>> WritePayload(Message message, CancellationToken cancellationToken)
+        /// <param name="responseParser">
+        /// Checks the reply, ParseUploadResponse by default. Callers that want
+        /// the contents of the reply can wrap that to look at it.
+        /// </param>
+        public async Task<Response<bool>> WritePayload(Message message, CancellationToken cancellationToken, Func<Message, Response<bool>> responseParser = null)
         {
+            if (responseParser == null)
+            {
+                responseParser = this.protocol.ParseUploadResponse;
+            }
+
             int retryCount = 0;
             for (; retryCount < MaxSendAttempts; retryCount++)
             {
@@ -591,7 +660,7 @@ namespace PcmHacking
                     continue;
                 }
 
-                if (await this.WaitForSuccess(this.protocol.ParseUploadResponse, cancellationToken))
+                if (await this.WaitForSuccess(responseParser, cancellationToken))
                 {
                     return Response.Create(ResponseStatus.Success, true, retryCount);
                 }
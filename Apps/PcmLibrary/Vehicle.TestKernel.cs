@@ -1,5 +1,6 @@
 ﻿using System;
 using System.Collections.Generic;
+using System.Diagnostics;
 using System.IO;
 using System.Linq;
 using System.Text;
@@ -99,6 +100,14 @@ namespace PcmHacking
                     return false;
                 }
 
+                // The kernel stays at whatever speed the bus is at when it starts,
+                // so the throughput test runs at 4x unless that is turned off.
+                if (this.Enable4xReadWrite && !await this.VehicleSetVPW4x(VpwSpeed.FourX))
+                {
+                    this.logger.AddUserMessage("Unable to switch to 4x.");
+                    return false;
+                }
+
                 if (!await PCMExecute(response.Value, 0xFF8000, cancellationToken))
                 {
                     logger.AddUserMessage("Failed to upload kernel to PCM");
@@ -113,7 +122,8 @@ namespace PcmHacking
                 //await this.InvestigateKernelVersionQueryTiming();
                 //await this.InvestigateCrc(cancellationToken);
                 //await this.InvestigateDataRelayCorruption(cancellationToken);
-                await this.InvestigateFlashChipId();
+                //await this.InvestigateFlashChipId();
+                await this.InvestigateThroughput(cancellationToken);
                 return true;
             }
             catch (Exception exception)
@@ -129,6 +139,139 @@ namespace PcmHacking
             }
         }
 
+        /// <summary>
+        /// Have the test kernel send frames of each size back to back, and report
+        /// how fast they arrive. Use the results to choose DeviceMaxReceiveSize.
+        /// </summary>
+        /// <remarks>
+        /// Run it once with 4x disabled in the settings and once with it enabled
+        /// to get numbers for both speeds.
+        /// </remarks>
+        private async Task InvestigateThroughput(CancellationToken cancellationToken)
+        {
+            const int frameCount = 16;
+            int[] payloadSizes = { 16, 64, 128, 256, 512, 1024, 2048, 4096 };
+
+            this.logger.AddUserMessage(
+                string.Format(
+                    "Throughput test at {0} with {1}, max receive size {2}.",
+                    (this.device.Supports4X && this.Enable4xReadWrite) ? "4x" : "1x",
+                    this.device.ToString(),
+                    this.DeviceMaxReceiveSize));
+
+            await this.device.SetTimeout(TimeoutScenario.ReadMemoryBlock);
+
+            foreach (int payloadSize in payloadSizes)
+            {
+                if (cancellationToken.IsCancellationRequested)
+                {
+                    return;
+                }
+
+                int frameSize = Protocol.ThroughputFrameHeaderSize + payloadSize;
+                if (frameSize > this.DeviceMaxReceiveSize)
+                {
+                    break;
+                }
+
+                int received = 0;
+                int missing = 0;
+                int corrupt = 0;
+                int retries = 0;
+                int lastSequence = -1;
+                ThroughputTestSummary summary = null;
+                Stopwatch stopwatch = new Stopwatch();
+                TimeSpan lastFrameTime = TimeSpan.Zero;
+
+                // Only ask again if nothing came back at all, otherwise the
+                // results would include frames from two different runs.
+                for (; (received == 0) && (summary == null) && (retries < 3); retries++)
+                {
+                    await this.SendToolPresentNotification();
+                    this.device.ClearMessageQueue();
+                    if (!await this.device.SendMessage(this.protocol.CreateThroughputTestRequest(payloadSize, frameCount)))
+                    {
+                        continue;
+                    }
+
+                    for (;;)
+                    {
+                        Message message = await this.device.ReceiveMessage();
+                        if (message == null)
+                        {
+                            break;
+                        }
+
+                        Response<ThroughputTestSummary> summaryResponse = this.protocol.ParseThroughputSummary(message);
+                        if (summaryResponse.Status == ResponseStatus.Success)
+                        {
+                            summary = summaryResponse.Value;
+                            break;
+                        }
+
+                        Response<int> frame = this.protocol.ParseThroughputFrame(message, payloadSize);
+                        if (frame.Status == ResponseStatus.UnexpectedResponse)
+                        {
+                            continue;
+                        }
+
+                        if (frame.Status != ResponseStatus.Success)
+                        {
+                            corrupt++;
+                            continue;
+                        }
+
+                        // Time from the first frame, so the request and the
+                        // kernel's turnaround delay aren't counted.
+                        if (received == 0)
+                        {
+                            stopwatch.Start();
+                        }
+
+                        missing += Math.Max(0, frame.Value - (lastSequence + 1));
+                        lastSequence = frame.Value;
+                        received++;
+
+                        // Time to the last frame, not to the summary, so a
+                        // lost summary doesn't add the receive timeout.
+                        lastFrameTime = stopwatch.Elapsed;
+                    }
+                }
+
+                // Frames that went missing after the last one that arrived.
+                int sent = (summary != null) ? summary.FramesSent : frameCount;
+                missing += Math.Max(0, sent - (lastSequence + 1));
+
+                double seconds = lastFrameTime.TotalSeconds;
+                double bytesPerSecond = (received > 1) && (seconds > 0) ? ((received - 1) * frameSize) / seconds : 0;
+
+                this.logger.AddUserMessage(
+                    string.Format(
+                        "{0,4} bytes: {1,6:0} bytes/sec, {2} of {3} frames, {4} missing, {5} corrupt, {6} retries.",
+                        payloadSize,
+                        bytesPerSecond,
+                        received,
+                        sent,
+                        missing,
+                        corrupt,
+                        retries - 1));
+
+                if (summary != null)
+                {
+                    this.logger.AddDebugMessage(
+                        string.Format(
+                            "Kernel: {0} transmit stalls, {1} receive overflows, {2} receive errors.",
+                            summary.TransmitStalls,
+                            summary.ReceiveOverflows,
+                            summary.ReceiveErrors));
+                }
+                else
+                {
+                    this.logger.AddUserMessage("No summary from the kernel.");
+                }
+            }
+        }
+
         /// <summary>
         /// Send a series of increasingly longer messages. They should be echoed back with
         /// only the mode byte changing from 3E to 7E.
@@ -0,0 +1,336 @@
+﻿using System;
+using System.Collections.Generic;
+using PcmHacking;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+
+namespace Tests
+{
+    [TestClass]
+    public class KernelProtocolTests
+    {
+        [TestMethod]
+        public void ParseNormalPayload()
+        {
+            Protocol protocol = new Protocol();
+            byte[] block = VpwUtilities.AddBlockChecksum(new byte[] { 0x6D, 0xF0, 0x10, 0x36, 0x01, 0x00, 0x04, 0x01, 0x23, 0x45, 0x11, 0x22, 0x33, 0x44, 0x00, 0x00 });
+
+            Response<byte[]> response = protocol.ParsePayload(new Message(block), 4, 0x012345);
+
+            Assert.AreEqual(ResponseStatus.Success, response.Status, "Status");
+            Assert.AreEqual("11 22 33 44", response.Value.ToHex(), "Payload");
+        }
+
+        [TestMethod]
+        public void ParseRlePayload()
+        {
+            Protocol protocol = new Protocol();
+
+            // Two literal bytes, then 0xFF repeated 5 times, then one literal byte.
+            byte[] block = VpwUtilities.AddBlockChecksum(new byte[] { 0x6D, 0xF0, 0x10, 0x36, 0x02, 0x00, 0x07, 0x00, 0x10, 0x00, 0x01, 0xAA, 0xBB, 0x82, 0xFF, 0x00, 0xCC, 0x00, 0x00 });
+
+            Response<byte[]> response = protocol.ParsePayload(new Message(block), 8, 0x001000);
+
+            Assert.AreEqual(ResponseStatus.Success, response.Status, "Status");
+            Assert.AreEqual("AA BB FF FF FF FF FF CC", response.Value.ToHex(), "Payload");
+        }
+
+        [TestMethod]
+        public void ParseRlePayloadWithWrongLength()
+        {
+            Protocol protocol = new Protocol();
+
+            // 0xFF repeated 130 times, but the tool asked for 128 bytes.
+            byte[] block = VpwUtilities.AddBlockChecksum(new byte[] { 0x6D, 0xF0, 0x10, 0x36, 0x02, 0x00, 0x02, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0x00, 0x00 });
+
+            Response<byte[]> response = protocol.ParsePayload(new Message(block), 128, 0x000000);
+
+            Assert.AreEqual(ResponseStatus.Error, response.Status, "Status");
+        }
+
+        [TestMethod]
+        public void ParseRlePayloadWithBadChecksum()
+        {
+            Protocol protocol = new Protocol();
+            byte[] block = VpwUtilities.AddBlockChecksum(new byte[] { 0x6D, 0xF0, 0x10, 0x36, 0x02, 0x00, 0x02, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0x00, 0x00 });
+            block[block.Length - 1]++;
+
+            Response<byte[]> response = protocol.ParsePayload(new Message(block), 130, 0x000000);
+
+            Assert.AreEqual(ResponseStatus.Error, response.Status, "Status");
+        }
+
+        [TestMethod]
+        public void CrcRead()
+        {
+            Protocol protocol = new Protocol();
+            Message request = protocol.CreateCrcReadRequest(0x012345, 4);
+            Assert.AreEqual("6D 10 F0 35 04 00 04 01 23 45", request.GetBytes().ToHex(), "Request");
+
+            byte[] block = new byte[] { 0x6D, 0xF0, 0x10, 0x36, 0x04, 0x00, 0x04, 0x01, 0x23, 0x45, 0x11, 0x22, 0x33, 0x44, 0, 0, 0, 0, 0, 0 };
+            UInt32 crc = new Crc().GetCrc(block, 10, 4);
+            block[14] = (byte)(crc >> 24);
+            block[15] = (byte)(crc >> 16);
+            block[16] = (byte)(crc >> 8);
+            block[17] = (byte)crc;
+            UInt16 sum = 0;
+            for (int index = 4; index < 18; index++)
+            {
+                sum += block[index];
+            }
+            block[18] = (byte)(sum >> 8);
+            block[19] = (byte)sum;
+
+            Response<byte[]> response = protocol.ParseCrcPayload(new Message(block), 4, 0x012345);
+            Assert.AreEqual(ResponseStatus.Success, response.Status, "Status");
+            Assert.AreEqual("11 22 33 44", response.Value.ToHex(), "Payload");
+
+            // Wrong address.
+            Assert.AreEqual(ResponseStatus.Error, protocol.ParseCrcPayload(new Message(block), 4, 0x012346).Status, "Wrong address");
+
+            // A data byte that changed along with the sum, so only the CRC catches it.
+            block[10]++;
+            block[19]++;
+            Assert.AreEqual(ResponseStatus.Error, protocol.ParseCrcPayload(new Message(block), 4, 0x012345).Status, "Bad data");
+
+            // Kernels without CRC reads send a normal block.
+            byte[] normal = VpwUtilities.AddBlockChecksum(new byte[] { 0x6D, 0xF0, 0x10, 0x36, 0x01, 0x00, 0x04, 0x01, 0x23, 0x45, 0x11, 0x22, 0x33, 0x44, 0x00, 0x00 });
+            Assert.AreEqual(ResponseStatus.UnexpectedResponse, protocol.ParseCrcPayload(new Message(normal), 4, 0x012345).Status, "Normal block");
+        }
+
+        [TestMethod]
+        public void WrittenBlocks()
+        {
+            Protocol protocol = new Protocol();
+            Message reply = new Message(new byte[] { 0x6D, 0xF0, 0x10, 0x76, 0x00, 0x02, 0x01, 0x20, 0x00, 0x03, 0xF4, 0x12, 0x34, 0x56, 0x78, 0x01, 0x23, 0xF4, 0x00, 0x10, 0xCA, 0xFE, 0xF0, 0x0D });
+            Assert.AreEqual(ResponseStatus.Success, protocol.ParseUploadResponse(reply).Status, "Status");
+
+            List<WrittenBlock> blocks = protocol.ParseWrittenBlocks(reply);
+            Assert.AreEqual(2, blocks.Count, "Count");
+            Assert.AreEqual(0x012000, blocks[0].Address, "Address 0");
+            Assert.AreEqual(0x3F4, blocks[0].Length, "Length 0");
+            Assert.AreEqual(0x12345678u, blocks[0].Crc, "CRC 0");
+            Assert.AreEqual(0x0123F4, blocks[1].Address, "Address 1");
+            Assert.AreEqual(0x10, blocks[1].Length, "Length 1");
+            Assert.AreEqual(0xCAFEF00Du, blocks[1].Crc, "CRC 1");
+
+            // Older kernels, and pipelined replies with nothing finished yet.
+            Assert.AreEqual(0, protocol.ParseWrittenBlocks(new Message(new byte[] { 0x6D, 0xF0, 0x10, 0x76, 0x02 })).Count, "Old kernel");
+            Assert.AreEqual(0, protocol.ParseWrittenBlocks(new Message(new byte[] { 0x6D, 0xF0, 0x10, 0x76, 0x02, 0x00 })).Count, "None yet");
+        }
+
+        [TestMethod]
+        public void ThroughputTest()
+        {
+            Protocol protocol = new Protocol();
+            Assert.AreEqual("6C 10 F0 3D 0E 01 00 00 10", protocol.CreateThroughputTestRequest(256, 16).GetBytes().ToHex(), "Request");
+
+            byte[] frame = new byte[] { 0x6C, 0xF0, 0x10, 0x7D, 0x0E, 0x01, 0x02, 0x02, 0x03, 0x04 };
+            Response<int> response = protocol.ParseThroughputFrame(new Message(frame), 3);
+            Assert.AreEqual(ResponseStatus.Success, response.Status, "Frame status");
+            Assert.AreEqual(0x0102, response.Value, "Sequence");
+
+            frame[8] = 0xFF;
+            Assert.AreEqual(ResponseStatus.Error, protocol.ParseThroughputFrame(new Message(frame), 3).Status, "Corrupt frame");
+            Assert.AreEqual(ResponseStatus.Truncated, protocol.ParseThroughputFrame(new Message(frame), 4).Status, "Short frame");
+
+            byte[] summary = new byte[] { 0x6C, 0xF0, 0x10, 0x7D, 0x0F, 0x00, 0x10, 0x00, 0x00, 0x12, 0x34, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x02 };
+            Response<ThroughputTestSummary> summaryResponse = protocol.ParseThroughputSummary(new Message(summary));
+            Assert.AreEqual(ResponseStatus.Success, summaryResponse.Status, "Summary status");
+            Assert.AreEqual(16, summaryResponse.Value.FramesSent, "Frames sent");
+            Assert.AreEqual(0x1234u, summaryResponse.Value.TransmitStalls, "Stalls");
+            Assert.AreEqual(1u, summaryResponse.Value.ReceiveOverflows, "Overflows");
+            Assert.AreEqual(2u, summaryResponse.Value.ReceiveErrors, "Errors");
+            Assert.AreEqual(ResponseStatus.UnexpectedResponse, protocol.ParseThroughputSummary(new Message(frame)).Status, "Frame is not a summary");
+        }
+
+        [TestMethod]
+        public void CreateBatchCrcQuery()
+        {
+            Protocol protocol = new Protocol();
+            MemoryRange[] ranges = new MemoryRange[]
+            {
+                new MemoryRange(0x020000, 0x20000, BlockType.OperatingSystem),
+                new MemoryRange(0x004000, 0x02000, BlockType.Parameter),
+            };
+
+            Message request = protocol.CreateBatchCrcQuery(ranges, true);
+
+            Assert.AreEqual("6C 10 F0 3D 08 01 02 02 00 00 02 00 00 00 20 00 00 40 00", request.GetBytes().ToHex(), "Request");
+        }
+
+        [TestMethod]
+        public void ParseBatchCrc()
+        {
+            Protocol protocol = new Protocol();
+            byte[] reply = new byte[] { 0x6C, 0xF0, 0x10, 0x7D, 0x08, 0x02, 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC, 0xDE, 0xF0 };
+
+            Response<UInt32[]> response = protocol.ParseBatchCrc(new Message(reply), 2);
+
+            Assert.AreEqual(ResponseStatus.Success, response.Status, "Status");
+            Assert.AreEqual(0x12345678u, response.Value[0], "First CRC");
+            Assert.AreEqual(0x9ABCDEF0u, response.Value[1], "Second CRC");
+        }
+
+        [TestMethod]
+        public void ParseBatchCrcInProgress()
+        {
+            Protocol protocol = new Protocol();
+            Message reply = new Message(new byte[] { 0x6C, 0xF0, 0x10, 0x7D, 0xFF, 0x08, 0x01 });
+
+            Assert.IsTrue(protocol.IsBatchCrcInProgress(reply), "In progress");
+            Assert.AreNotEqual(ResponseStatus.Success, protocol.ParseBatchCrc(reply, 2).Status, "Status");
+        }
+
+        [TestMethod]
+        public void ParseBlankMap()
+        {
+            Protocol protocol = new Protocol();
+
+            // Ten chunks of 0x1000 bytes. Chunks 0, 2, and 9 are uniform.
+            byte[] reply = new byte[] { 0x6C, 0xF0, 0x10, 0x7D, 0x07, 0x10, 0x00, 0x00, 0x0A, 0x02, 0x00, 0x00, 0xA0, 0x40, 0xFF, 0x00, 0xFF };
+
+            Response<byte?[]> response = protocol.ParseBlankMap(new Message(reply), 0x020000, 0x1000, 10);
+
+            Assert.AreEqual(ResponseStatus.Success, response.Status, "Status");
+            Assert.AreEqual(10, response.Value.Length, "Length");
+            Assert.AreEqual((byte)0xFF, response.Value[0], "Chunk 0");
+            Assert.IsNull(response.Value[1], "Chunk 1");
+            Assert.AreEqual((byte)0x00, response.Value[2], "Chunk 2");
+            Assert.IsNull(response.Value[8], "Chunk 8");
+            Assert.AreEqual((byte)0xFF, response.Value[9], "Chunk 9");
+        }
+
+        [TestMethod]
+        public void ParseBlankMapTruncated()
+        {
+            Protocol protocol = new Protocol();
+
+            // The bitmap says two chunks are uniform, but only one value follows.
+            byte[] reply = new byte[] { 0x6C, 0xF0, 0x10, 0x7D, 0x07, 0x10, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0xC0, 0xFF };
+
+            Response<byte?[]> response = protocol.ParseBlankMap(new Message(reply), 0x000000, 0x1000, 2);
+
+            Assert.AreEqual(ResponseStatus.Truncated, response.Status, "Status");
+        }
+
+        [TestMethod]
+        public void CreateBlockDiffQuery()
+        {
+            Protocol protocol = new Protocol();
+            byte[] image = new byte[] { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55 };
+
+            Message request = protocol.CreateBlockDiffQuery(image, 2, 3);
+
+            Assert.AreEqual("6C 10 F0 3D 09 00 03 00 00 02 22 33 44", request.GetBytes().ToHex(), "Request");
+        }
+
+        [TestMethod]
+        public void ParseBlockDiff()
+        {
+            Protocol protocol = new Protocol();
+            byte[] reply = new byte[] { 0x6C, 0xF0, 0x10, 0x7D, 0x09, 0x04, 0x00, 0x01, 0x20, 0x00, 0x01 };
+
+            Response<BlockDiffResult> response = protocol.ParseBlockDiff(new Message(reply), 0x012000, 0x400);
+
+            Assert.AreEqual(ResponseStatus.Success, response.Status, "Status");
+            Assert.AreEqual(BlockDiffResult.Program, response.Value, "Result");
+
+            // A reply for a different block must not be accepted.
+            response = protocol.ParseBlockDiff(new Message(reply), 0x012400, 0x400);
+            Assert.AreNotEqual(ResponseStatus.Success, response.Status, "Other block");
+        }
+
+        [TestMethod]
+        public void CreateStreamReadRequest()
+        {
+            Protocol protocol = new Protocol();
+
+            Message request = protocol.CreateStreamReadRequest(0x012000, 0x1000, 0x8000);
+
+            Assert.AreEqual("6D 10 F0 35 03 10 00 01 20 00 00 80 00", request.GetBytes().ToHex(), "Request");
+        }
+
+        [TestMethod]
+        public void TryGetPayloadAddress()
+        {
+            Protocol protocol = new Protocol();
+            int address;
+
+            Message block = new Message(new byte[] { 0x6D, 0xF0, 0x10, 0x36, 0x02, 0x00, 0x02, 0x01, 0x23, 0x00, 0x81, 0xFF, 0x01, 0x83 });
+            Assert.IsTrue(protocol.TryGetPayloadAddress(block, out address), "Block");
+            Assert.AreEqual(0x012300, address, "Address");
+
+            Message other = new Message(new byte[] { 0x6C, 0xF0, 0x10, 0x7D, 0x0A, 0x01, 0x2C, 0x00, 0x00, 0x00 });
+            Assert.IsFalse(protocol.TryGetPayloadAddress(other, out address), "Not a block");
+        }
+
+        [TestMethod]
+        public void TurnaroundDelay()
+        {
+            Protocol protocol = new Protocol();
+
+            Message request = protocol.CreateTurnaroundDelayRequest(300);
+            Assert.AreEqual("6C 10 F0 3D 0A 01 2C", request.GetBytes().ToHex(), "Request");
+
+            Message reply = new Message(new byte[] { 0x6C, 0xF0, 0x10, 0x7D, 0x0A, 0x01, 0x2C });
+            Assert.AreEqual(ResponseStatus.Success, protocol.ParseTurnaroundDelay(reply, 300).Status, "Accepted");
+            Assert.AreNotEqual(ResponseStatus.Success, protocol.ParseTurnaroundDelay(reply, 0).Status, "Wrong delay");
+
+            Message refused = new Message(new byte[] { 0x6C, 0xF0, 0x10, 0x7F, 0x3D, 0x0A, 0x00, 0x05 });
+            Assert.AreEqual(ResponseStatus.Refused, protocol.ParseTurnaroundDelay(refused, 300).Status, "Refused");
+        }
+
+        [TestMethod]
+        public void PerfCounters()
+        {
+            Protocol protocol = new Protocol();
+
+            Message request = protocol.CreatePerfCounterQuery();
+            Assert.AreEqual("6C 10 F0 3D 0B", request.GetBytes().ToHex(), "Request");
+
+            Message reply = new Message(new byte[] { 0x6C, 0xF0, 0x10, 0x7D, 0x0B, 0x02, 0x00, 0x00, 0x01, 0x00, 0x12, 0x34, 0x56, 0x78 });
+            Response<UInt32[]> response = protocol.ParsePerfCounters(reply);
+            Assert.AreEqual(ResponseStatus.Success, response.Status, "Status");
+            Assert.AreEqual(2, response.Value.Length, "Count");
+            Assert.AreEqual(0x100u, response.Value[(int)KernelCounter.Messages], "Messages");
+            Assert.AreEqual(0x12345678u, response.Value[(int)KernelCounter.ReceiveIdle], "Receive idle");
+
+            Message truncated = new Message(new byte[] { 0x6C, 0xF0, 0x10, 0x7D, 0x0B, 0x02, 0x00, 0x00, 0x01, 0x00 });
+            Assert.AreEqual(ResponseStatus.Truncated, protocol.ParsePerfCounters(truncated).Status, "Truncated");
+        }
+
+        [TestMethod]
+        public void BatchErase()
+        {
+            Protocol protocol = new Protocol();
+            MemoryRange[] ranges = new MemoryRange[]
+            {
+                new MemoryRange(0x020000, 0x10000, BlockType.OperatingSystem),
+                new MemoryRange(0x030000, 0x10000, BlockType.OperatingSystem),
+            };
+
+            Message request = protocol.CreateBatchEraseRequest(ranges);
+            Assert.AreEqual("6C 10 F0 3D 0D 02 02 00 00 03 00 00", request.GetBytes().ToHex(), "Request");
+
+            Message query = protocol.CreateBatchEraseStatusQuery();
+            Assert.AreEqual("6C 10 F0 3D 0D 00", query.GetBytes().ToHex(), "Query");
+
+            Message busy = new Message(new byte[] { 0x6C, 0xF0, 0x10, 0x7D, 0x0D, 0x01, 0x02, 0x00, 0xFF });
+            Response<BatchEraseStatus> response = protocol.ParseBatchErase(busy);
+            Assert.AreEqual(ResponseStatus.Success, response.Status, "Busy status");
+            Assert.AreEqual(EraseJobState.Busy, response.Value.State, "Busy state");
+            Assert.AreEqual("00 FF", response.Value.Results.ToHex(), "Busy results");
+
+            Message done = new Message(new byte[] { 0x6C, 0xF0, 0x10, 0x7D, 0x0D, 0x02, 0x02, 0x00, 0xB0 });
+            response = protocol.ParseBatchErase(done);
+            Assert.AreEqual(EraseJobState.Done, response.Value.State, "Done state");
+            Assert.AreEqual(0xB0, response.Value.Results[1], "Result");
+
+            Message refused = new Message(new byte[] { 0x6C, 0xF0, 0x10, 0x7F, 0x3D, 0x0D, 0x15, 0x14 });
+            Assert.AreEqual(ResponseStatus.Refused, protocol.ParseBatchErase(refused).Status, "Refused");
+
+            Message truncated = new Message(new byte[] { 0x6C, 0xF0, 0x10, 0x7D, 0x0D, 0x02, 0x02, 0x00 });
+            Assert.AreEqual(ResponseStatus.Truncated, protocol.ParseBatchErase(truncated).Status, "Truncated");
+        }
+    }
+}
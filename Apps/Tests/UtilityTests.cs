@@ -1,4 +1,5 @@
 using System;
+using System.Text;
 using PcmHacking;
 using Microsoft.VisualStudio.TestTools.UnitTesting;
 
@@ -25,6 +26,36 @@ namespace Tests
             Assert.AreEqual("00 01", new byte[] { 0x00, 0x01, 0x99, 0xAA, 0xFF }.ToHex(2), "Five bytes, count=2");
         }
 
+        [TestMethod]
+        public void CrcSlicing()
+        {
+            // Check value for CRC-32/MPEG-2, but starting from zero like the kernel.
+            byte[] check = Encoding.ASCII.GetBytes("123456789");
+            Crc crc = new Crc();
+            Assert.AreEqual(0x89A1897Fu, crc.GetCrc(check, 0, (UInt32)check.Length), "Check value");
+
+            // The 8-byte steps must give the same result as a byte at a time, for any alignment.
+            byte[] data = new byte[100];
+            for (int index = 0; index < data.Length; index++)
+            {
+                data[index] = (byte)((index * 37) + 11);
+            }
+
+            for (UInt32 start = 0; start < 9; start++)
+            {
+                for (UInt32 length = 0; length < 40; length++)
+                {
+                    UInt32 expected = 0;
+                    for (UInt32 index = start; index < start + length; index++)
+                    {
+                        expected = crc.GetCrc(data, index, 1, expected);
+                    }
+
+                    Assert.AreEqual(expected, crc.GetCrc(data, start, length), string.Format("Start {0}, length {1}", start, length));
+                }
+            }
+        }
+
         [TestMethod]
         public void CompareArrays()
         {
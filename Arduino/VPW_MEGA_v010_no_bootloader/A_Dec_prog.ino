@@ -1,9 +1,12 @@
 const long Read_From_Address = 0x0; // address to start reading from in the EEPROM
 const long Read_To_Address = 0x7FFFF; //suggestions 0x7FFFF the end address for 512k chip.  0xFFFFF the end address for 1M chip.
-const long Read_Length = 0x1000; //read length used in incrementing,  0800= 2048 bytes/read, 0x1000 = 4096 bytes/read Maximum;
+const long Read_Length = 0x0800; //read length used in incrementing,  0x0800 = 2048 bytes/read, 0x1000 = 4096 bytes/read Maximum.  Over 0x0BF3 the reader ring only holds one block, see READER_RING_SIZE
 
 const boolean Supress_Non_BIN = false; //True means will only print .bin once read has started (also supresses CRC)
 const boolean Print_CRC = true; //True means will print check sum
+const boolean Binary_Frames = false; //True sends each .bin packet as a binary frame (see Send_Binary_Frame) instead of hex.  Use unframe.exe to turn the capture into a .bin
+const long Binary_Baud = 500000; //serial speed when Binary_Frames is true.  500000 and 1000000 are exact on a 16MHz Mega
+const boolean Use_VPW_4x = false; //True asks the PCM to switch the bus to 4x before reading (A0/A1 handshake), goes back to 1x at the end
 
 word Key=0xA5EF;//Must set the key before uploading right now
 
@@ -31,6 +34,9 @@ long Seed_Wait=200;//variable due to 10 sec after 2nd try
 long time_Seed;
 
 long Current_Address = 0; //address being read at the time
+unsigned long Read_Sent_Time; //when the request for Current_Address went out
+byte Read_Retries = 0; //times the request for Current_Address has been sent again
+const byte Read_Max_Retries = 3;
 
 const byte Request_Seed[] ={0x6c,0x10,0xF0,0x27,0x01};
 byte Send_key[] ={0x6c,0x10,0xF0,0x27,0x02, 0, 0}; //not a constant as we update the key in the program
@@ -70,6 +76,9 @@ const byte CMD_Read_Block2 []=       {0x6C, 0x10, 0xF0, 0x3C, 0x21}; //6C 10 F0
 
 const byte CMD_Disable_Transmission []=  {0x6C, 0xFE, 0xF0, 0x28, 0x00};
 
+const byte CMD_High_Speed_Prepare []=    {0x6C, 0xFE, 0xF0, 0xA0}; //every module answers 6C F0 xx E0 if it can go 4x, 6C F0 xx 7F if not
+const byte CMD_High_Speed []=            {0x6C, 0xFE, 0xF0, 0xA1}; //everyone switches to 4x
+
 
 
 long Sending_Timer;
@@ -21,6 +21,7 @@ volatile uint8_t *direction_TX;
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <util/crc16.h>
 #include <inttypes.h>
 
 //#include "../libnerdkits/delay.h"
@@ -30,10 +31,21 @@ volatile uint8_t *direction_TX;
 boolean state;
 byte test[]={0xAA,0xAA,0xAA,0xAA,0xAA,0xAA};
 boolean resend_flag;
-#define T_64US 0x7F
-#define T_128US 0xFF
-#define T_200US 0x18F
-#define T_200US_2 (T_200US - 256)
+// Bus timing.  Set_VPW_Speed() switches these between 1x and 4x, only change them with the bus idle.
+// Writer, Timer2 compare values.  0.5us per count at CLK/8.
+volatile uint8_t T_Short = 0x7F;   //64us at 1x, 16us at 4x
+volatile uint8_t T_Long = 0xFF;    //128us at 1x, 32us at 4x
+volatile uint16_t T_Frame = 0x18F; //start and end of frame. 200us at 1x, 50us at 4x
+volatile uint8_t writer_prescaler = (1<<CS21); //CLK/8 at both speeds
+// Reader, Timer1 counts.  4us per count at 1x (CLK/64), 0.5us at 4x (CLK/8).
+volatile uint8_t R_Glitch = 0x08;      //shorter than this is noise. 32us at 1x
+volatile uint8_t R_Short = 0x1C;       //shorter than this is a short bit. 112us at 1x
+volatile uint8_t R_Bit = 0x2E;         //shorter than this is a bit. 184us at 1x
+volatile uint8_t R_SOF = 0x41;         //shorter than this is a start of frame. 260us at 1x
+volatile uint8_t R_EOF = 0x31;         //idle this long is the end of frame. 196us at 1x
+volatile uint16_t R_Timeout = 0x61A7;  //give up on a frame. 100ms at 1x, 30ms at 4x (the most Timer1 can count at CLK/8)
+volatile uint8_t reader_prescaler = (1<<CS11) | (1<<CS10); //CLK/64
+boolean VPW_4x = false;
 
 volatile uint8_t writer_started = 0;
 volatile uint8_t writer_extra = 0;
@@ -44,21 +56,66 @@ unsigned char* writer_data = NULL;
 volatile uint16_t writer_counter;
 volatile uint8_t writer_bit_counter;
 volatile uint8_t writer_collision;
-unsigned char writerCRC;
+const unsigned char* writer_message = NULL; //start of the message, writer_data is changed to send the crc
+bool writer_message_progmem;
+volatile unsigned char writerCRC; //built up by the timer interupt as bytes are sent
 bool calcCRC;
 bool writeProgMem;
+
+// VPW crc (polynomial 0x1D, starts at 0xFF, inverted at the end), one byte at a time.
+// Table in program memory so the interupts can keep up with the bus.
+#define CRC8_UPDATE(crc, b) pgm_read_byte_near(&crc8_table[(uint8_t)((crc) ^ (b))])
+#define CRC8_GOOD 0xC4 //what CRC8_UPDATE gives after a whole packet, crc byte included, if the crc was right
+const uint8_t crc8_table[256] PROGMEM = {
+  0x00, 0x1D, 0x3A, 0x27, 0x74, 0x69, 0x4E, 0x53, 0xE8, 0xF5, 0xD2, 0xCF, 0x9C, 0x81, 0xA6, 0xBB,
+  0xCD, 0xD0, 0xF7, 0xEA, 0xB9, 0xA4, 0x83, 0x9E, 0x25, 0x38, 0x1F, 0x02, 0x51, 0x4C, 0x6B, 0x76,
+  0x87, 0x9A, 0xBD, 0xA0, 0xF3, 0xEE, 0xC9, 0xD4, 0x6F, 0x72, 0x55, 0x48, 0x1B, 0x06, 0x21, 0x3C,
+  0x4A, 0x57, 0x70, 0x6D, 0x3E, 0x23, 0x04, 0x19, 0xA2, 0xBF, 0x98, 0x85, 0xD6, 0xCB, 0xEC, 0xF1,
+  0x13, 0x0E, 0x29, 0x34, 0x67, 0x7A, 0x5D, 0x40, 0xFB, 0xE6, 0xC1, 0xDC, 0x8F, 0x92, 0xB5, 0xA8,
+  0xDE, 0xC3, 0xE4, 0xF9, 0xAA, 0xB7, 0x90, 0x8D, 0x36, 0x2B, 0x0C, 0x11, 0x42, 0x5F, 0x78, 0x65,
+  0x94, 0x89, 0xAE, 0xB3, 0xE0, 0xFD, 0xDA, 0xC7, 0x7C, 0x61, 0x46, 0x5B, 0x08, 0x15, 0x32, 0x2F,
+  0x59, 0x44, 0x63, 0x7E, 0x2D, 0x30, 0x17, 0x0A, 0xB1, 0xAC, 0x8B, 0x96, 0xC5, 0xD8, 0xFF, 0xE2,
+  0x26, 0x3B, 0x1C, 0x01, 0x52, 0x4F, 0x68, 0x75, 0xCE, 0xD3, 0xF4, 0xE9, 0xBA, 0xA7, 0x80, 0x9D,
+  0xEB, 0xF6, 0xD1, 0xCC, 0x9F, 0x82, 0xA5, 0xB8, 0x03, 0x1E, 0x39, 0x24, 0x77, 0x6A, 0x4D, 0x50,
+  0xA1, 0xBC, 0x9B, 0x86, 0xD5, 0xC8, 0xEF, 0xF2, 0x49, 0x54, 0x73, 0x6E, 0x3D, 0x20, 0x07, 0x1A,
+  0x6C, 0x71, 0x56, 0x4B, 0x18, 0x05, 0x22, 0x3F, 0x84, 0x99, 0xBE, 0xA3, 0xF0, 0xED, 0xCA, 0xD7,
+  0x35, 0x28, 0x0F, 0x12, 0x41, 0x5C, 0x7B, 0x66, 0xDD, 0xC0, 0xE7, 0xFA, 0xA9, 0xB4, 0x93, 0x8E,
+  0xF8, 0xE5, 0xC2, 0xDF, 0x8C, 0x91, 0xB6, 0xAB, 0x10, 0x0D, 0x2A, 0x37, 0x64, 0x79, 0x5E, 0x43,
+  0xB2, 0xAF, 0x88, 0x95, 0xC6, 0xDB, 0xFC, 0xE1, 0x5A, 0x47, 0x60, 0x7D, 0x2E, 0x33, 0x14, 0x09,
+  0x7F, 0x62, 0x45, 0x58, 0x0B, 0x16, 0x31, 0x2C, 0x97, 0x8A, 0xAD, 0xB0, 0xE3, 0xFE, 0xD9, 0xC4
+};
 //const zeroForWrite=0;
 
+// Received packets go into a ring, so that the reader can keep receiving while loop() is still
+// printing the last packet. The reader ISRs fill it, loop() takes packets out with Take_Packet().
+// A read block comes back as a packet of Read_Length plus 13 bytes (header, sum and crc).  The ring
+// can hold two 2048 byte blocks, so the next one can arrive while the last one is printed.  It can
+// only hold one 4096 byte block: two would need 8218 bytes, and the Mega only has 8k of RAM.
+#define READER_RING_SIZE 6144
+const boolean Read_Ahead = 2 * (Read_Length + 13) <= READER_RING_SIZE; //see Next_Read_Block()
+#define PACKET_SLOTS 8
+volatile unsigned char reader_data[READER_RING_SIZE];
+volatile uint16_t reader_start = 0; //where the packet being received starts in reader_data
+volatile uint16_t reader_write = 0; //where the next byte goes in reader_data
+volatile uint16_t reader_space = 0; //how many bytes the packet being received can use
 volatile uint16_t reader_size = 0;
-volatile unsigned char reader_data[4200];// size of buffer to store data read until we send it to the serial monitor
+volatile uint8_t reader_crc = 0xFF; //crc of the packet being received so far
 volatile uint8_t reader_pin_last=0;
 volatile char reader_byte=0;
 volatile uint8_t reader_byte_counter=0;
 
 volatile uint8_t reader_started = 0;
+volatile uint16_t packet_start[PACKET_SLOTS]; //one slot per finished packet, only the ISR changes these
+volatile uint16_t packet_length[PACKET_SLOTS];
+volatile uint8_t packet_head = 0; //the next slot the ISR fills
+volatile uint8_t packet_tail = 0; //the next slot loop() takes, only loop() changes this
+volatile uint8_t packets_dropped = 0; //packets that arrived when the ring was full
+volatile uint8_t packets_bad = 0; //packets dropped because the crc was wrong
+
+//the packet loop() is working on, see Take_Packet()
 volatile unsigned char packet_data[15];
-volatile uint8_t packet_waiting;
 volatile uint16_t packet_size;
+uint16_t current_packet_start;
 
 
 
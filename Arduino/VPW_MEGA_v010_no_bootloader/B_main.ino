@@ -26,7 +26,7 @@ writer_init();
  
 
   //set up serial port for debugging with data to PC screen
-  Serial.begin(115200);  
+  Serial.begin(Binary_Frames ? Binary_Baud : 115200);  
   Serial.println(VERSION);
  
 
@@ -66,31 +66,16 @@ if(Akn == 1&&millis()-Sending_Timer2>1000){ //sending timer millis()-Sending_Tim
  //++++++++++++++++++++  Start reading memory segments +++++++++++++++++++++
  else if (Have_Key == 8)
  {
-   if(Current_Address==Read_From_Address)Serial.println("reading bin data.  Wait.....");
-    //see if the packet size needs to be changed
-    long End_Address = Current_Address+Read_Length; //calculate the end address of this read.
-    if(End_Address>Read_To_Address){ //if the end of our read is past end of the needed data
-         long Read_Length_New = (Read_To_Address - Current_Address)+1; //addjust read length for the end
-         CMD_Request_Read[5]=highByte(Read_Length_New); //Set the Request_Read message to have the Read_Length Specified (1,000 bytes, 4000 bytes 
-         CMD_Request_Read[6]=lowByte(Read_Length_New);
-         End_Address = Current_Address+Read_Length_New;
-          }
-   send_VPW(CMD_Request_Read,sizeof(CMD_Request_Read));
-   //Serial.print("address: ");Serial.println(Current_Address,HEX); 
-   //CMD_Request_Read
-   //setup for NEXT read.
-     Current_Address += Read_Length;  //update address to read from
-     if(Current_Address>Read_To_Address) {Have_Key=9;} //if exceeding read address set to 10 to jump out.Serial.println("exiting read");
-     else{
-       CMD_Request_Read[7]=(Current_Address>>16)&0xFF; //high byte
-       CMD_Request_Read[8]=(Current_Address>>8)&0xFF; //mid byte
-       CMD_Request_Read[9]=(Current_Address)&0xFF; //low byte
-        }
-
-  // else Have_Key--; //reduce by one to keep us at 8 until we get all the data read. (go over the address end address)
+   if(Use_VPW_4x && !VPW_4x) Switch_To_4x();
+   Serial.println("reading bin data.  Wait.....");
+   Send_Read_Request(); //the rest are sent as each block comes in, see Next_Read_Block()
+   //Have_Key is 9 while reading.  Next_Read_Block() sets it to 10 after the last block
  } 
  else if (Have_Key == 10){Serial.println();Serial.print("************ Finished. Read:");Serial.print(Read_To_Address+1);Serial.print(" bytes.  Finished address: ");Serial.println(Read_To_Address,HEX);
-       send_VPW(CMD_Normal_Mode,sizeof(CMD_Normal_Mode));}  //CMD_Request_Read //CMD_Normal_Mode
+       if(packets_dropped){Serial.print("Packets dropped because the ring was full: ");Serial.println(packets_dropped);}
+       if(packets_bad){Serial.print("Packets dropped because of a bad crc: ");Serial.println(packets_bad);}
+       send_VPW(CMD_Normal_Mode,sizeof(CMD_Normal_Mode));  //CMD_Request_Read //CMD_Normal_Mode
+       if(VPW_4x) Set_VPW_Speed(false);} //modules go back to 1x on their own when they reset
  Have_Key++; 
 Sending_Timer2=millis();
 
@@ -107,19 +92,46 @@ Sending_Timer2=millis();
 
 
 
-  if(packet_waiting) // if there was a message and it was recieved propperly
+  //+++++++++++++++++++ lost block, ask again +++++++++++++++++++
+  if(Have_Key == 9 && millis()-Read_Sent_Time > (VPW_4x ? 2000 : 6000)) //a 4096 byte block takes about 3.3 seconds at 1x
   {
-    packet_waiting = 0;
+    if(Read_Retries < Read_Max_Retries)
+    {
+      Read_Retries++;
+      Serial.println();Serial.print("No reply, asking again for address: ");Serial.println(Current_Address,HEX);
+      Send_Read_Request();
+    }
+    else
+    {
+      Serial.println();Serial.print("Giving up at address: ");Serial.println(Current_Address,HEX);
+      Have_Key = 10;
+      Akn = 1;
+    }
+  }
+
+  if(Take_Packet()) // if there was a message and it was recieved propperly
+  {
+    boolean read_next = false; //ask for the next block once this one is released
     if(packet_size>15) //Only print the large messages.  Small messages are printed using Print_MSG() other places
     {
+      if(Have_Key == 9 && Is_Requested_Block())
+      {
+        // if the ring can hold two blocks, ask for the next one before printing this one, the PCM can send it while the serial port is busy
+        if(Read_Ahead) Next_Read_Block();
+        else read_next = true;
+      }
      
+      if(Binary_Frames)
+      {
+        Send_Binary_Frame(packet_size); //the whole packet, unframe.exe uses the header to place the data
+      }
+      else
+      {
       int size = packet_size-reader_End_Cut;
       Serial.println(); //blank line to seperate the .bin reads
       for(int x=reader_Begin_Byte;x<size;x++) //loop to output the message
       {
-        byte b;
-        if(x<15)b=packet_data[x];//completed message for small messages
-        else    b=reader_data[x];//large data moved over to reader data so it's not overwritten by next message.
+        byte b=Packet_Byte(x); //the packet stays in the ring until Release_Packet(), so the next one can't overwrite it
        // if(x<0||x>=size)continue; //  the first 10 are the command.  Last 3 are the check sum.  To skip use if(x<10||x>=size-3)
         if(b<=0x0F) Serial.print("0"); //if a single character add a leading zero.
         Serial.print(b,HEX); //print the data to the screen
@@ -128,6 +140,7 @@ Sending_Timer2=millis();
       }
       Serial.println();
       Serial.println();
+      }
     }
     else
     {
@@ -151,12 +164,81 @@ if(Have_Key < 11) VPW_Decode();
 //  else   VPW_Decode2(); //if we are into the writing sequence then use decode2 (less printing)
     VPW_Message="0 0 0 0"; //clear so doesn't reprint
     }
+    Release_Packet();
+    if(read_next) Next_Read_Block();
   }//end if message recieved
   
 }// End of Main Void
 
 
 
+//***************************************************************************
+// Ask for the block at Current_Address, cut short if it goes past Read_To_Address.
+void Send_Read_Request()
+{
+  long Read_Length_New = Read_Length;
+  if(Current_Address+Read_Length>Read_To_Address) Read_Length_New = (Read_To_Address - Current_Address)+1; //addjust read length for the end
+  CMD_Request_Read[5]=highByte(Read_Length_New);
+  CMD_Request_Read[6]=lowByte(Read_Length_New);
+  CMD_Request_Read[7]=(Current_Address>>16)&0xFF; //high byte
+  CMD_Request_Read[8]=(Current_Address>>8)&0xFF; //mid byte
+  CMD_Request_Read[9]=(Current_Address)&0xFF; //low byte
+  send_VPW(CMD_Request_Read,sizeof(CMD_Request_Read));
+  Read_Sent_Time=millis();
+}
+
+// The block at Current_Address is in, move on to the next one right away.
+void Next_Read_Block()
+{
+  Current_Address += Read_Length;  //update address to read from
+  Read_Retries = 0;
+  if(Current_Address>Read_To_Address) //if exceeding read address go to 10 to finish
+  {
+    Have_Key = 10;
+    Akn = 1;
+  }
+  else Send_Read_Request();
+}
+
+// True if the packet from Take_Packet() is the mode 36 block for Current_Address, all there and with a good sum.
+// The VPW crc was already checked by the reader.
+boolean Is_Requested_Block()
+{
+  if(packet_size < 13 || packet_data[3] != 0x36 || packet_data[4] != 0x01) return false;
+  long address = ((long)packet_data[7]<<16) | ((long)packet_data[8]<<8) | packet_data[9];
+  if(address != Current_Address) return false;
+  word length = word(packet_data[5],packet_data[6]);
+  if(packet_size < length + 13) return false;
+
+  word sum = 0;
+  for(word x=4;x<length+10;x++) sum += Packet_Byte(x); //same as VpwUtilities.CalcBlockChecksum
+  return sum == word(Packet_Byte(length+10),Packet_Byte(length+11));
+}
+
+//***************************************************************************
+// Binary frame: A5 5A, length (high byte first), the packet, then the
+// CRC-16/XMODEM of the length and packet bytes (high byte first).
+// Text from the rest of the program can end up between frames, unframe.exe
+// skips anything that isn't a frame.
+void Send_Binary_Frame(int size)
+{
+  word crc = 0;
+  byte header[] = {0xA5, 0x5A, highByte(size), lowByte(size)};
+  Serial.write(header, sizeof(header));
+  crc = _crc_xmodem_update(crc, header[2]);
+  crc = _crc_xmodem_update(crc, header[3]);
+
+  for(int x=0;x<size;x++)
+  {
+    byte b=Packet_Byte(x);
+    crc = _crc_xmodem_update(crc, b);
+    Serial.write(b);
+  }
+
+  Serial.write(highByte(crc));
+  Serial.write(lowByte(crc));
+}
+
 //***************************************************************************
 
 void Print_MSG()
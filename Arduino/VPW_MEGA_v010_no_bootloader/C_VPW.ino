@@ -47,6 +47,39 @@ void send_VPW_With_CRC_P(const byte* msg,word len)
   writer_send(msg,len,false,true);
 }
 
+// Standard switch to 4x.  Ask every module for permission, give them time to answer,
+// then tell them all to switch and change our own timing.  Stays at 1x if anyone refuses.
+boolean Switch_To_4x()
+{
+  Serial.println("Asking for VPW 4x");
+  send_VPW(CMD_High_Speed_Prepare,sizeof(CMD_High_Speed_Prepare));
+
+  byte granted = 0;
+  byte refused = 0;
+  unsigned long start = millis();
+  while(millis() - start < 500)
+  {
+    if(!Take_Packet()) continue;
+    if(packet_size >= 4 && packet_data[1] == 0xF0)
+    {
+      if(packet_data[3] == 0xE0) granted++;
+      if(packet_data[3] == 0x7F) refused++;
+    }
+    Release_Packet();
+  }
+
+  if(granted == 0 || refused > 0)
+  {
+    Serial.print("4x refused, staying at 1x.  Granted: ");Serial.print(granted);Serial.print(" Refused: ");Serial.println(refused);
+    return false;
+  }
+
+  send_VPW(CMD_High_Speed,sizeof(CMD_High_Speed));
+  Set_VPW_Speed(true); //waits for CMD_High_Speed to go out first
+  Serial.println("VPW 4x");
+  return true;
+}
+
 
 
 
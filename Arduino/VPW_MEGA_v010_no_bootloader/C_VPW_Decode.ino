@@ -280,10 +280,7 @@ void VPW_Decode()
     if(VPW_data[2]==0xF0||VPW_data[2]==0xF1)
     {
       if(!Supress_Non_BIN) Serial.println("- Tester Present");
-      if(Have_Key==9) {
-        Have_Key=8;
-        Akn = 1;
-      }
+      //blocks are requested as they come in now, see Next_Read_Block()
       if(Have_Key==10) Akn = 1;
     }
     if(!Supress_Non_BIN) Serial.print(" ");
@@ -20,7 +20,7 @@ ISR(TIMER2_COMPA_vect) { //compare match interupt
     *out_TX &= ~bit_TX;	// should be de-asserted anyway.
     writer_started = 0; // stop writing
     TIMSK2 &= ~(1 << OCIE2A); //stop interupt
-    TCCR2B &= ~(1 << CS21); //stop timer
+    TCCR2B &= ~writer_prescaler; //stop timer
     //Serial.println("collision");//debug
     resend_flag = 1;
     writer_collision = 0;
@@ -28,8 +28,7 @@ ISR(TIMER2_COMPA_vect) { //compare match interupt
   }
    if ((!calcCRC&&writer_counter == writer_size)||(calcCRC&&writer_counter == writer_size+1)) { //finnished with message // override in case of end-of-frame
      *out_TX  &= ~bit_TX; //low pin
-    OCR2A = 0xFF;                  //set time for end of frame
-    writer_extra = T_200US_2;
+    writer_frame_time();           //set time for end of frame
    }
   else
   {
@@ -43,38 +42,46 @@ ISR(TIMER2_COMPA_vect) { //compare match interupt
     // bits 0,2,4,6
     *out_TX  &= ~bit_TX; //low pin
     if (this_bit) { // 1 or 0;
-      OCR2A = T_128US; //set time long period
+      OCR2A = T_Long; //set time long period
     }
     else {
-      OCR2A = T_64US;  //set time short period
+      OCR2A = T_Short;  //set time short period
     }
   }
   else { //pin is going to be high
     // bits 1,3,5,7
     *out_TX |= bit_TX; // high pin
     if (this_bit) { //1 or 0
-      OCR2A = T_64US; //short period
+      OCR2A = T_Short; //short period
     }
     else {
-      OCR2A = T_128US; //long period
+      OCR2A = T_Long; //long period
     }
   }
   }
   // update counters
   writer_bit_counter++;
   if (writer_bit_counter == 8) {
+    if(calcCRC&&writer_counter < writer_size) //add the byte just sent to the crc
+    {
+      uint8_t sent;
+      if(writeProgMem) sent = pgm_read_byte_near(writer_data+writer_counter);
+      else  sent = writer_data[writer_counter];
+      writerCRC = CRC8_UPDATE(writerCRC, sent);
+    }
     writer_counter++;
     writer_bit_counter = 0;
     if(calcCRC&&writer_counter == writer_size)
    {
-     writer_data = &writerCRC-writer_counter;// slightly nasty but will make next call to writer data be the crc(breaks reference to the rest of message however
+     writerCRC = ~writerCRC; //finish the crc
+     writer_data = (unsigned char*)&writerCRC-writer_counter;// slightly nasty but will make next call to writer data be the crc(breaks reference to the rest of message however
      writeProgMem = false; //crc not in prog mem
    }
   }
   // when done, disable our own interrupt from firing.
   if (((!calcCRC&&writer_counter == writer_size)||(calcCRC&&writer_counter == writer_size+1)) && (writer_bit_counter == 1)) {
     TIMSK2 &= ~(1 << OCIE2A); // disable interupt
-    TCCR2B &= ~(1 << CS21); //stop timer
+    TCCR2B &= ~writer_prescaler; //stop timer
     *out_TX &= ~bit_TX; //low pin should be low any ways
     writer_started = 0; //stop writing
   }
@@ -83,6 +90,13 @@ ISR(TIMER2_COMPA_vect) { //compare match interupt
 
 
 //########################## Read #######################
+// How much of the ring the packet being received can use: everything from its start up to the
+// oldest packet loop() hasn't released.
+uint16_t reader_free() {
+  if (packet_tail == packet_head) return READER_RING_SIZE;
+  return (packet_start[packet_tail] + READER_RING_SIZE - reader_start) % READER_RING_SIZE;
+}
+
 ISR(PCINT0_vect) { //if pin has changed
   // record timer value
   uint16_t timer_val = TCNT1; //get timer value
@@ -112,7 +126,7 @@ ISR(PCINT0_vect) { //if pin has changed
 
 
   //verify that a transition has happened
-  if (cur_pin_value == reader_pin_last || timer_val < 8)
+  if (cur_pin_value == reader_pin_last || timer_val < R_Glitch)
   {
     return;	// glitched transition; ignore
   }
@@ -121,11 +135,11 @@ ISR(PCINT0_vect) { //if pin has changed
 
   // discriminate based on timer_val
   uint8_t bit_choice;
-  if (timer_val < 0x2E) {	//if length of a bit 0x27= 160.6us Gchanged //was 27
+  if (timer_val < R_Bit) {	//if length of a bit 0x27= 160.6us Gchanged //was 27
     if (!reader_started)
       return;
 
-    if (timer_val < 0x1C) {		// if short period 0x17=95.4us Gchanged //was 17
+    if (timer_val < R_Short) {		// if short period 0x17=95.4us Gchanged //was 17
       // small period (64us)
       bit_choice = cur_pin_value ? 1 : 0; //if pin high 1 if low 0
     }
@@ -142,24 +156,35 @@ ISR(PCINT0_vect) { //if pin has changed
       // DOUBLE YAY! we can has new byte
       //Serial.println("reader_byte");
       
-        reader_data[reader_size] = reader_byte; //put byte in array
+        if (reader_size == reader_space) reader_space = reader_free(); //loop() may have released a packet since the frame started
+        if (reader_size < reader_space) { //if there is room in the ring
+          reader_data[reader_write] = reader_byte; //put byte in array
+          reader_write++;
+          if (reader_write == READER_RING_SIZE) reader_write = 0; //wrap around
+        }
+        else reader_space = 0; //a byte was lost, so the packet is dropped at EOF even if space turns up later
+        reader_crc = CRC8_UPDATE(reader_crc, reader_byte); //check as we go, no need to go over the packet again at EOF
         reader_byte_counter = 0; //clear  bit counter
         reader_byte = 0;  //clear temp byte
-        reader_size++;    //count bytes
+        reader_size++;    //count bytes, even if they didn't fit
         
     }
     return;
   } //end if 160 us
 
-  else if (timer_val < 0x41) {	// if length of start of frame 0x41=264.8us Gchanged
+  else if (timer_val < R_SOF) {	// if length of start of frame 0x41=264.8us Gchanged
     // Start Of Frame (200us)
     if (cur_pin_value == 1 && !reader_started) { // if pin high  and reader has not started
       reader_started = 1; //start reader
       reader_byte_counter = 0; // clear bit counter
       reader_byte = 0; //clear temp byte
       reader_size = 0; //clear byte counter
+      reader_crc = 0xFF;
+      // the new packet goes after the last one.  The space is checked again if the packet needs more
+      reader_start = reader_write;
+      reader_space = reader_free();
       // change timer overflow to 200us
-      OCR1A = 0x31; // set compare match to look for EOF 0x31=200us Gchanged
+      OCR1A = R_EOF; // set compare match to look for EOF 0x31=200us Gchanged
 
     }
     return;
@@ -175,26 +200,33 @@ ISR(TIMER1_COMPA_vect) { //reader compare match
 
   if (reader_started) { // if reader has started
     // indicates End Of Frame OR reader timeout
-    if (OCR1A == 0x61A7) { //if time outg changed
+    if (OCR1A == R_Timeout) { //if time outg changed
       // was timeout
       reader_started = 0; //stop reading
+      reader_write = reader_start; //forget the partial packet
     }
     else { //if EOF
       // was end of frame
       // change timer overflow to 100ms
-      OCR1A = 0x61A7; //compare match to look for overflow 0x61A7=100ms g changed
+      OCR1A = R_Timeout; //compare match to look for overflow 0x61A7=100ms g changed
       reader_started = 0; //stop reading
    
-      unsigned char cksum = crc8buf((unsigned char *)reader_data, (reader_size - 1)); //calculate checksum
-      if (cksum != reader_data[reader_size - 1]) { //if error
+      uint8_t next_head = (packet_head + 1) % PACKET_SLOTS;
+      if (reader_size == 0) { //nothing to keep
+      }
+      else if (reader_crc != CRC8_GOOD) { //if error
+        reader_write = reader_start; //forget it
+        packets_bad++;
+      }
+      else if (reader_size > reader_space || next_head == packet_tail) { //if it didn't fit, or all the slots are full
+        reader_write = reader_start; //forget it
+        packets_dropped++;
       }
-      // copy all  bytes to the packet buffer
-      uint8_t i;
-      for (i = 0; i < 15; i++) {
-        packet_data[i] = reader_data[i]; //copy bytes
+      else { //hand the packet to loop()
+        packet_start[packet_head] = reader_start;
+        packet_length[packet_head] = reader_size;
+        packet_head = next_head; //must be last, this is what loop() looks at
       }
-      packet_size = reader_size;
-      packet_waiting = (reader_size > 0) ? 1 : 0; //if length greater than 0 packet is waiting
       //
       // stop the reader
     }//end else (is EOF)
@@ -26,8 +26,8 @@ direction_RX = portModeRegister(port_RX);
 
 
   // Timer1 setup CLK/64
-  OCR1A = 0x61A7; // will campare value of OCR1A against timer 1 for timeout
-  TCCR1B = (1<<CS11) | (1<<CS10); //CLK/64
+  OCR1A = R_Timeout; // will campare value of OCR1A against timer 1 for timeout
+  TCCR1B = reader_prescaler; //CLK/64
   TCCR1A =0;
     TCCR1C =0;
   // Timer1 enable Output Compare 1 match interrupt
@@ -46,7 +46,8 @@ uint16_t read_ID(uint8_t id){
   uint16_t loopy = 0;
   for(loopy=0; loopy<1000; loopy++) {
     delayMicroseconds(100);
-    if(packet_waiting) {
+    if(Take_Packet()) {
+      Release_Packet(); //only the first 15 bytes are needed
       // see if it's the RPM return packet
       if(packet_data[0]==0x48 && packet_data[1]==0x6b && packet_data[2]==0x10 && packet_data[3]==0x41 && packet_data[4]==id) {
         // got RPM data
@@ -61,28 +62,44 @@ uint16_t read_ID(uint8_t id){
   }
   return READ_TIMEOUT;
 }
+
+//############ packet ring, filled by the reader ISRs #################
+// Take the oldest packet the reader has finished.  Sets packet_size and copies the first 15 bytes
+// to packet_data.  The packet stays in the ring (use Packet_Byte) until Release_Packet().
+boolean Take_Packet()
+{
+  if (packet_tail == packet_head) return false; //nothing waiting
+
+  current_packet_start = packet_start[packet_tail];
+  packet_size = packet_length[packet_tail];
+  for (uint8_t i = 0; i < 15; i++) {
+    packet_data[i] = Packet_Byte(i); //copy bytes
+  }
+  return true;
+}
+
+// Byte x of the packet from Take_Packet().
+byte Packet_Byte(uint16_t x)
+{
+  uint16_t index = current_packet_start + x;
+  if (index >= READER_RING_SIZE) index -= READER_RING_SIZE; //wrap around
+  return reader_data[index];
+}
+
+// Let the reader reuse the space of the packet from Take_Packet().
+void Release_Packet()
+{
+  packet_tail = (packet_tail + 1) % PACKET_SLOTS;
+}
 // This checksum code originally from Bruce Lightner,
 // Circuit Cellar Issue 183, October 2005
 // ftp://ftp.circuitcellar.com/pub/Circuit_Cellar/2005/183/Lightner-183.zip
-unsigned char crc8buf(const unsigned char *buf, uint8_t len) {
-  unsigned char val;
-  unsigned char i;
+unsigned char crc8buf(const unsigned char *buf, uint16_t len) {
   unsigned char chksum;
 
   chksum = 0xff;  // start with all one's
   while (len--) {
-    i = 8;
-    val = *buf++;
-    while (i--) {
-      if (((val ^ chksum) & 0x80) != 0) {
-        chksum ^= 0x0e;
-        chksum = (chksum << 1) | 1;
-      } 
-      else {
-        chksum = chksum << 1;
-      }
-      val = val << 1;
-    }
+    chksum = CRC8_UPDATE(chksum, *buf++);
   }
 
   return ~chksum;
@@ -12,6 +12,8 @@ void writer_send(const unsigned char *buf, uint16_t len,boolean calcCRCFlag,bool
 
   writer_size = len; // plus one is for checksum
   writer_data = (unsigned char*)buf;
+  writer_message = buf;
+  writer_message_progmem = progMem;
 
  
    //Serial.write(writer_data[1]);
@@ -19,10 +21,7 @@ void writer_send(const unsigned char *buf, uint16_t len,boolean calcCRCFlag,bool
   // add the checksum
   calcCRC = calcCRCFlag;
   writeProgMem = progMem;
-  if(calcCRCFlag)
-  {
-    writerCRC = crc8buf(buf, len);
-  }
+  writerCRC = 0xFF; // the timer interupt adds each byte as it goes, so sending starts right away
   writer_counter = 0; //clear counters and flags
   writer_bit_counter = 0;
   writer_collision = 0;
@@ -44,13 +43,12 @@ void writer_send(const unsigned char *buf, uint16_t len,boolean calcCRCFlag,bool
  //send_break();
 //Serial.println("started WRITing");
   // set SOF period, start timer, and enable its interrupt
-  OCR2A = 0xFF; // start of frame time
-  writer_extra = T_200US_2;
+  writer_frame_time(); // start of frame time
   *out_TX |= bit_TX; //high pin
   TCNT2 = 0;                  //clear timer
   TIFR2 |= (1<<OCF2A);	      // clear interrupt flag in case it was already set
   TIMSK2 |= (1<<OCIE2A);       // enable interupt
-  TCCR2B |= (1<<CS21); //CLK/8 //start timer with precaler of 8
+  TCCR2B |= writer_prescaler; //start timer
   //Serial.println(TCCR3B,BIN);
   
 
@@ -59,6 +57,9 @@ void reSend()
 {
    if(writer_started)return; //if already sending forget it
   writer_started = 1;
+  writer_data = (unsigned char*)writer_message; //undo the switch to the crc
+  writeProgMem = writer_message_progmem;
+  writerCRC = 0xFF;
   writer_counter = 0; //clear counters and flags
   writer_bit_counter = 0;
   writer_collision = 0;
@@ -80,16 +81,68 @@ void reSend()
  //send_break();
 //Serial.println("started WRITing");
   // set SOF period, start timer, and enable its interrupt
-  OCR2A = 0xFF; // start of frame time
-  writer_extra = T_200US_2;
+  writer_frame_time(); // start of frame time
   *out_TX |= bit_TX; //high pin
   TCNT2 = 0;                  //clear timer
   TIFR2 |= (1<<OCF2A);        // clear interrupt flag in case it was already set
   TIMSK2 |= (1<<OCIE2A);       // enable interupt
-  TCCR2B |= (1<<CS21); //CLK/8 //start timer with precaler of 8
+  TCCR2B |= writer_prescaler; //start timer
   //Serial.println(TCCR3B,BIN);
 }
 
+// OCR2A only goes to 255, so a longer start or end of frame uses writer_extra for the rest.
+void writer_frame_time()
+{
+  if (T_Frame > 0xFF) {
+    OCR2A = 0xFF;
+    writer_extra = T_Frame - 256;
+  }
+  else {
+    OCR2A = T_Frame;
+    writer_extra = 0;
+  }
+}
+
+// Change the bus speed, once the current packets are done.
+void Set_VPW_Speed(boolean fourX)
+{
+  while(writer_started || reader_started) {} //reader_started clears itself on timeout
+
+  noInterrupts();
+  if(fourX) {
+    T_Short = 0x1F;
+    T_Long = 0x3F;
+    T_Frame = 0x63;
+    writer_prescaler = (1<<CS21);
+    R_Glitch = 0x10;
+    R_Short = 0x38;
+    R_Bit = 0x5C;
+    R_SOF = 0x82;
+    R_EOF = 0x62;
+    R_Timeout = 0xEA5F;
+    reader_prescaler = (1<<CS11); //CLK/8
+  }
+  else {
+    T_Short = 0x7F;
+    T_Long = 0xFF;
+    T_Frame = 0x18F;
+    writer_prescaler = (1<<CS21);
+    R_Glitch = 0x08;
+    R_Short = 0x1C;
+    R_Bit = 0x2E;
+    R_SOF = 0x41;
+    R_EOF = 0x31;
+    R_Timeout = 0x61A7;
+    reader_prescaler = (1<<CS11) | (1<<CS10); //CLK/64
+  }
+  TCCR1B = reader_prescaler;
+  OCR1A = R_Timeout;
+  TCNT1 = 0;
+  interrupts();
+
+  VPW_4x = fourX;
+}
+
 void writer_init() {
    bit_TX = digitalPinToBitMask(output_pin);
   port_TX = digitalPinToPort(output_pin);
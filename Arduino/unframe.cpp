@@ -0,0 +1,163 @@
+// Turn a serial capture from the Arduino VPW reader into a .bin file, when
+// the sketch was built with Binary_Frames = true. See Send_Binary_Frame in
+// B_main.ino for the frame format.
+//
+// unframe <capture file> <output.bin>
+//
+// Build with: g++ -o unframe.exe unframe.cpp
+//
+// Each frame holds one mode 36 packet from the PCM: 10 bytes of header (with
+// the length and address of the data), the data, a 2-byte checksum and the
+// VPW CRC. The data goes into the output at its address, so the output starts
+// at address zero. Anything between frames, like the sketch's text messages,
+// is skipped.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+using namespace std;
+
+#define SyncByte1 0xA5
+#define SyncByte2 0x5A
+#define PacketHeaderSize 10
+#define PacketTrailerSize 3
+
+bool ReadFile(const char *path, vector<unsigned char> &data)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        printf("Unable to open %s\r\n", path);
+        return false;
+    }
+
+    int value;
+    while ((value = fgetc(file)) != EOF)
+    {
+        data.push_back((unsigned char)value);
+    }
+
+    fclose(file);
+    return true;
+}
+
+// CRC-16/XMODEM, the same as _crc_xmodem_update in avr-libc.
+unsigned short CrcUpdate(unsigned short crc, unsigned char data)
+{
+    crc ^= (unsigned short)data << 8;
+    for (int bit = 0; bit < 8; bit++)
+    {
+        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+
+    return crc;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        printf("Usage: unframe <capture file> <output.bin>\r\n");
+        return 1;
+    }
+
+    vector<unsigned char> capture;
+    if (!ReadFile(argv[1], capture))
+    {
+        return 1;
+    }
+
+    vector<unsigned char> image;
+    vector<bool> written;
+    int frames = 0;
+    int badFrames = 0;
+    size_t skipped = 0;
+
+    size_t position = 0;
+    while (position + 4 <= capture.size())
+    {
+        if ((capture[position] != SyncByte1) || (capture[position + 1] != SyncByte2))
+        {
+            position++;
+            skipped++;
+            continue;
+        }
+
+        size_t length = (capture[position + 2] << 8) | capture[position + 3];
+        size_t frameSize = 4 + length + 2;
+        if (position + frameSize > capture.size())
+        {
+            // A frame that was cut off at the end of the capture.
+            badFrames++;
+            break;
+        }
+
+        unsigned short crc = 0;
+        for (size_t index = 2; index < 4 + length; index++)
+        {
+            crc = CrcUpdate(crc, capture[position + index]);
+        }
+
+        const unsigned char *packet = &capture[position + 4];
+        unsigned short expected = (capture[position + 4 + length] << 8) | capture[position + 5 + length];
+        if ((crc != expected) || (length < PacketHeaderSize + PacketTrailerSize) || (packet[3] != 0x36))
+        {
+            // Either serial noise that looked like a sync, or a damaged frame.
+            // Look for the next sync inside it rather than skipping it.
+            position++;
+            skipped++;
+            badFrames++;
+            continue;
+        }
+
+        size_t dataLength = (packet[5] << 8) | packet[6];
+        size_t address = (packet[7] << 16) | (packet[8] << 8) | packet[9];
+        if (dataLength > length - (PacketHeaderSize + PacketTrailerSize))
+        {
+            dataLength = length - (PacketHeaderSize + PacketTrailerSize);
+        }
+
+        if (image.size() < address + dataLength)
+        {
+            image.resize(address + dataLength, 0xFF);
+            written.resize(address + dataLength, false);
+        }
+
+        memcpy(&image[address], &packet[PacketHeaderSize], dataLength);
+        fill(written.begin() + address, written.begin() + address + dataLength, true);
+
+        frames++;
+        position += frameSize;
+    }
+
+    size_t missing = 0;
+    for (size_t index = 0; index < written.size(); index++)
+    {
+        if (!written[index])
+        {
+            missing++;
+        }
+    }
+
+    FILE *output = fopen(argv[2], "wb");
+    if (output == NULL)
+    {
+        printf("Unable to create %s\r\n", argv[2]);
+        return 1;
+    }
+
+    fwrite(image.data(), 1, image.size(), output);
+    fclose(output);
+
+    printf("%d frames, %d bad, %u bytes skipped.\r\n", frames, badFrames, (unsigned)skipped);
+    printf("Wrote %u bytes to %s.\r\n", (unsigned)image.size(), argv[2]);
+
+    if (missing != 0)
+    {
+        printf("%u bytes were never received, they are FF in the output.\r\n", (unsigned)missing);
+        return 1;
+    }
+
+    return badFrames ? 1 : 0;
+}
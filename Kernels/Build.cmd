@@ -30,7 +30,7 @@ goto beginning
 **
 :Usage
   echo.
-  echo   %0 -a^<address^> -c -d -g^<path^> -p^<path^>
+  echo   %0 -a^<address^> -c -d -g^<path^> -m -n -p^<path^>
   echo.
   echo     -a^<address^>
   echo       Set base address for the kernel. (no space, no 0x)
@@ -64,6 +64,14 @@ goto beginning
     echo       Value: False
   )
   echo.
+  echo     -n
+  echo       Set flag to use the 16-entry CRC table (smaller kernel, slower CRC) or not.
+  if defined NIBBLE_CRC (
+    echo       Value: True
+  ) else (
+    echo       Value: False
+  )
+  echo.
   echo     -p^<path^>
   echo       Set path\^<filename^> where to copy kernel.bin. (no space)
   echo       Value: %BIN_LOCATION%
@@ -117,6 +125,9 @@ set DUMP_ELF=
 rem * Set flag to dump kernel Map or not.
 set DUMP_MAP=
 
+rem * Set default to use the 256-entry CRC table.
+set NIBBLE_CRC=
+
 rem * Handle command line options.
 (
   setlocal enabledelayedexpansion
@@ -127,6 +138,7 @@ rem * Handle command line options.
     if /i "!VAR!" == "-d"      set DUMP_ELF=True
     if /i "!VAR:~0,2!" == "-g" set "GCC_LOCATION=!VAR:~2!"
     if /i "!VAR!" == "-m"      set "DUMP_MAP=-Map kernel.map"
+    if /i "!VAR!" == "-n"      set "NIBBLE_CRC=-DCRC_NIBBLE_TABLE"
     if /i "!VAR:~0,2!" == "-p" set "BIN_LOCATION=!VAR:~2!"
     if /i "!VAR!" == "/h"      goto Usage
     if /i "!VAR!" == "-h"      goto Usage
@@ -140,7 +152,7 @@ call :Detrailslash "%GCC_LOCATION%" GCC_LOCATION
 call :Detrailslash "%BIN_LOCATION%" BIN_LOCATION
 
 rem *** All that for this ...
-"%GCC_LOCATION%\m68k-elf-gcc.exe" -c -fomit-frame-pointer -std=gnu99 -mcpu=68332 -O0 main.c write-kernel.c crc.c common.c common-readwrite.c flash-intel.c flash-amd.c
+"%GCC_LOCATION%\m68k-elf-gcc.exe" -c -fomit-frame-pointer -std=gnu99 -mcpu=68332 -O0 %NIBBLE_CRC% main.c write-kernel.c crc.c common.c common-readwrite.c flash-intel.c flash-amd.c
 if %errorlevel% neq 0 goto :EOF
 
 "%GCC_LOCATION%\m68k-elf-ld.exe" --section-start .kernel_code=0x%BASE_ADDRESS% -T kernel.ld %DUMP_MAP% -o kernel.elf main.o write-kernel.o crc.o common.o common-readwrite.o flash-intel.o flash-amd.o
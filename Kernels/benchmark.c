@@ -0,0 +1,528 @@
+///////////////////////////////////////////////////////////////////////////////
+// Run kernel code against the host simulator (see simulator.h), check that it
+// still does the right thing, and report what it cost.
+//
+// "Model ms" and "Accesses" come from the simulator, so they are repeatable
+// and can be compared before and after a change. "Host us" is how long the
+// code took on this machine, which is a rough guide to how much work the CPU
+// does between register accesses.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "common.h"
+#include "flash.h"
+
+#define Repetitions 10
+#define CrcTestSize (64 * 1024)
+#define FlashTestSize 4096
+#define FlashTestAddress 0x20000
+#define PipelinedBlockSize 1024
+
+static unsigned char testData[CrcTestSize];
+
+typedef int (*BenchmarkFunction)();
+
+///////////////////////////////////////////////////////////////////////////////
+// Bit-at-a-time CRC to check crc.c against.
+///////////////////////////////////////////////////////////////////////////////
+static unsigned SlowCrc(const unsigned char *data, int length)
+{
+	unsigned remainder = 0;
+	for (int index = 0; index < length; index++)
+	{
+		remainder ^= (unsigned)data[index] << 24;
+		for (int bit = 0; bit < 8; bit++)
+		{
+			remainder = (remainder & 0x80000000) ? (remainder << 1) ^ 0x04C11DB7 : (remainder << 1);
+		}
+	}
+
+	return remainder;
+}
+
+static int CheckFlash(unsigned address, const unsigned char *data, int length)
+{
+	const unsigned short *words = (const unsigned short *)data;
+	for (int index = 0; index < length / 2; index++)
+	{
+		if (SimulatorFlashPeek(address + (index * 2)) != words[index])
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The benchmarks. Each one returns nonzero if the kernel code worked.
+///////////////////////////////////////////////////////////////////////////////
+static int WriteMessage4k()
+{
+	int length = 4096 + 10;
+	memcpy(MessageBuffer, testData, length);
+	WriteMessage(MessageBuffer, length, Complete);
+
+	const unsigned char *frame;
+	return (SimulatorLastFrame(&frame) == length) && (memcmp(frame, testData, length) == 0);
+}
+
+static int WriteMessage4kCrc()
+{
+	int length = 4096;
+	memcpy(MessageBuffer, testData, 10 + length);
+	writeMessageCrc = 0;
+	WriteMessage(MessageBuffer, 10, Start);
+	WriteMessage(&MessageBuffer[10], length, End|AddSum|AddCrc);
+
+	// Header, data, CRC, and a sum of everything after the mode byte.
+	const unsigned char *frame;
+	if ((SimulatorLastFrame(&frame) != 10 + length + 6) || (memcmp(frame, testData, 10 + length) != 0))
+	{
+		return 0;
+	}
+
+	unsigned crc = SlowCrc(&testData[10], length);
+	const unsigned char *trailer = &frame[10 + length];
+	unsigned sum = 0;
+	for (int index = 4; index < 10 + length + 4; index++)
+	{
+		sum += frame[index];
+	}
+
+	return (trailer[0] == (unsigned char)(crc >> 24)) && (trailer[1] == (unsigned char)(crc >> 16)) &&
+		(trailer[2] == (unsigned char)(crc >> 8)) && (trailer[3] == (unsigned char)crc) &&
+		(trailer[4] == (unsigned char)(sum >> 8)) && (trailer[5] == (unsigned char)sum);
+}
+
+static int ReadMessage4k()
+{
+	int length = 4096 + 10;
+	unsigned char completionCode = 0xFF;
+	unsigned char readState = 0xFF;
+	DlcResetReceiveRing();
+	SimulatorQueueMessage(testData, length);
+	int received = ReadMessage(&completionCode, &readState);
+	return (received == length) && (readState == 1) && (memcmp(MessageBuffer, testData, length) == 0);
+}
+
+// A frame that is too big for the receive ring arrives after a small one
+// while nothing is reading the ring. The big one must be thrown away, the
+// small one kept, and the next message after that must be intact. A frame
+// that arrives while the ring is full is lost without a trace.
+static int ReadMessageRingFull()
+{
+	static const unsigned char toolPresent[] = { 0x8C, 0xFE, 0xF0, 0x3F };
+	unsigned char completionCode = 0xFF;
+	unsigned char readState = 0xFF;
+	int length = 200;
+
+	DlcResetReceiveRing();
+	SimulatorQueueMessage(toolPresent, sizeof(toolPresent));
+	SimulatorQueueMessage(testData, length);
+	SimulatorQueueMessage(toolPresent, sizeof(toolPresent));
+
+	// Long enough for all of it to arrive at 1x.
+	unsigned long long end = simulatorCounters.cycles + (length + 20) * 8 * 96 * SystemClockMhz;
+	while (simulatorCounters.cycles < end)
+	{
+		DlcService();
+	}
+
+	int first = ReadMessage(&completionCode, &readState);
+	if ((first != sizeof(toolPresent)) || (readState != 1))
+	{
+		return 0;
+	}
+
+	int second = ReadMessage(&completionCode, &readState);
+	if ((second != 0) || (readState != 0x0B))
+	{
+		return 0;
+	}
+
+	SimulatorQueueMessage(toolPresent, sizeof(toolPresent));
+	int third = ReadMessage(&completionCode, &readState);
+	return (third == sizeof(toolPresent)) && (readState == 1) &&
+		(memcmp(MessageBuffer, toolPresent, sizeof(toolPresent)) == 0);
+}
+
+// Send a mode 36 request to the kernel the way the tool does, and read it.
+static int Mode36Receive(unsigned char command, unsigned address, const unsigned char *data, int length)
+{
+	static unsigned char request[10 + FlashTestSize + 2];
+	unsigned char header[] = { 0x6D, 0x10, 0xF0, 0x36, command, length >> 8, length & 0xFF,
+		address >> 16, (address >> 8) & 0xFF, address & 0xFF };
+	unsigned char completionCode = 0xFF;
+	unsigned char readState = 0xFF;
+
+	memcpy(request, header, sizeof(header));
+	memcpy(&request[10], data, length);
+	unsigned short sum = 0;
+	for (int index = 4; index < 10 + length; index++)
+	{
+		sum += request[index];
+	}
+
+	request[10 + length] = sum >> 8;
+	request[11 + length] = sum;
+
+	SimulatorQueueMessage(request, 12 + length);
+	return ReadMessage(&completionCode, &readState) == 12 + length;
+}
+
+static int Mode36Request(unsigned char command, unsigned address, const unsigned char *data, int length)
+{
+	if (!Mode36Receive(command, address, data, length))
+	{
+		return 0;
+	}
+
+	HandleWriteMode36();
+	return 1;
+}
+
+// A mode 36 flash write from the tool, through to the kernel's reply with
+// the CRC of what was programmed.
+static int Mode36Flash4k()
+{
+	FlashJobReset();
+	DlcResetReceiveRing();
+	if (!Mode36Request(0x00, FlashTestAddress, testData, FlashTestSize))
+	{
+		return 0;
+	}
+
+	unsigned crc = SlowCrc(testData, FlashTestSize);
+	const unsigned char reply[] = { 0x6D, 0xF0, 0x10, 0x76, 0x00, 0x01,
+		FlashTestAddress >> 16, (FlashTestAddress >> 8) & 0xFF, FlashTestAddress & 0xFF, FlashTestSize >> 8, FlashTestSize & 0xFF,
+		crc >> 24, (crc >> 16) & 0xFF, (crc >> 8) & 0xFF, crc & 0xFF };
+	const unsigned char *frame;
+	return (SimulatorLastFrame(&frame) == sizeof(reply)) && (memcmp(frame, reply, sizeof(reply)) == 0) &&
+		CheckFlash(FlashTestAddress, testData, FlashTestSize);
+}
+
+// Four 1k blocks, the way the tool sent them before pipelining. The tool
+// never sends flash blocks bigger than 1k (see MaxFlashWriteSendSize), so
+// this is what Mode36Pipelined4k is measured against.
+static int Mode36Flash4x1k()
+{
+	FlashJobReset();
+	DlcResetReceiveRing();
+	for (int block = 0; block < FlashTestSize / PipelinedBlockSize; block++)
+	{
+		unsigned offset = block * PipelinedBlockSize;
+		if (!Mode36Request(0x00, FlashTestAddress + offset, &testData[offset], PipelinedBlockSize))
+		{
+			return 0;
+		}
+	}
+
+	const unsigned char reply[] = { 0x6D, 0xF0, 0x10, 0x76, 0x00, 0x01 };
+	const unsigned char *frame;
+	return (SimulatorLastFrame(&frame) == sizeof(reply) + 9) &&
+		(memcmp(frame, reply, sizeof(reply)) == 0) &&
+		CheckFlash(FlashTestAddress, testData, FlashTestSize);
+}
+
+// Four 1k blocks, as the tool sends them: pipelined, with the last one
+// written synchronously so its reply has the result of the whole range. The
+// chip should only be unlocked (or put into unlock bypass mode) once, and each
+// block should be programmed while the next one is on the wire.
+static int Mode36Pipelined4k()
+{
+	int overlapped = 1;
+	FlashJobReset();
+	DlcResetReceiveRing();
+	for (int block = 0; block < FlashTestSize / PipelinedBlockSize; block++)
+	{
+		int last = (block + 1) * PipelinedBlockSize == FlashTestSize;
+		unsigned offset = block * PipelinedBlockSize;
+		if (!Mode36Receive(last ? 0x00 : 0x02, FlashTestAddress + offset, &testData[offset], PipelinedBlockSize))
+		{
+			return 0;
+		}
+
+		if (block > 0)
+		{
+			overlapped &= CheckFlash(FlashTestAddress + offset - PipelinedBlockSize, &testData[offset - PipelinedBlockSize], PipelinedBlockSize);
+		}
+
+		HandleWriteMode36();
+	}
+
+	// The last reply has the block that was programmed in the background
+	// while it arrived, and the one that was programmed after.
+	unsigned address = FlashTestAddress + FlashTestSize - PipelinedBlockSize;
+	unsigned crc = SlowCrc(&testData[FlashTestSize - PipelinedBlockSize], PipelinedBlockSize);
+	const unsigned char reply[] = { 0x6D, 0xF0, 0x10, 0x76, 0x00, 0x02 };
+	const unsigned char last[] = { address >> 16, (address >> 8) & 0xFF, address & 0xFF, PipelinedBlockSize >> 8, PipelinedBlockSize & 0xFF,
+		crc >> 24, (crc >> 16) & 0xFF, (crc >> 8) & 0xFF, crc & 0xFF };
+	const unsigned char *frame;
+	return (SimulatorLastFrame(&frame) == sizeof(reply) + (2 * sizeof(last))) &&
+		(memcmp(frame, reply, sizeof(reply)) == 0) &&
+		(memcmp(&frame[sizeof(reply) + sizeof(last)], last, sizeof(last)) == 0) &&
+		CheckFlash(FlashTestAddress, testData, FlashTestSize) &&
+		(simulatorHardwareIo & 1) == 0 &&
+		overlapped;
+}
+
+static int CrcSlices(int sliceSize)
+{
+	crcReset();
+	crcStart(testData, CrcTestSize);
+	while (!crcIsDone(testData, CrcTestSize))
+	{
+		crcProcessSlice(sliceSize);
+	}
+
+	return crcGetResult() == SlowCrc(testData, CrcTestSize);
+}
+
+static int CrcPollSlices64k()
+{
+	return CrcSlices(CrcPollSliceSize);
+}
+
+static int CrcIdleSlices64k()
+{
+	return CrcSlices(CrcIdleSliceSize);
+}
+
+static int IntelProgram4k()
+{
+	return (Intel_WriteToFlash(FlashTestSize, FlashTestAddress, testData, 0) == 0) &&
+		CheckFlash(FlashTestAddress, testData, FlashTestSize);
+}
+
+// The loop that Intel_WriteToFlash used to have, to measure the current one
+// against: clear status, program setup, the value, and read status for every
+// word, and scratch the watchdog on every poll.
+static int IntelPerWordProgram4k()
+{
+	unsigned short *payloadArray = (unsigned short*)testData;
+	unsigned short *flashArray = (unsigned short*)FlashTestAddress;
+	unsigned short status = 0;
+
+	FlashUnlock(true);
+
+	for (unsigned index = 0; index < FlashTestSize / 2; index++)
+	{
+		unsigned short *address = &(flashArray[index]);
+
+		DlcService();
+
+		FLASH_WRITE(address, 0x5050);
+		FLASH_WRITE(address, 0x4040);
+		FLASH_WRITE(address, payloadArray[index]);
+		FLASH_WRITE(address, 0x7070);
+
+		char success = 0;
+		for (int iterations = 0; iterations < 0x1000; iterations++)
+		{
+			status = FLASH_READ(address);
+			ScratchWatchdog();
+
+			if (status & 0x80)
+			{
+				success = 1;
+				break;
+			}
+		}
+
+		if (!success)
+		{
+			break;
+		}
+	}
+
+	FLASH_WRITE(FlashTestAddress, 0xFFFF);
+	FLASH_WRITE(FlashTestAddress, 0xFFFF);
+	FlashUnlock(false);
+
+	return ((status & 0x98) == 0x80) && CheckFlash(FlashTestAddress, testData, FlashTestSize);
+}
+
+static int IntelErase128k()
+{
+	memset(MessageBuffer, 0, FlashTestSize);
+	Intel_WriteToFlash(FlashTestSize, FlashTestAddress, MessageBuffer, 0);
+	return (Intel_EraseBlock(FlashTestAddress) == 0) && (SimulatorFlashPeek(FlashTestAddress) == 0xFFFF);
+}
+
+static int AmdProgram4k()
+{
+	return (Amd_WriteToFlash(FlashTestSize, FlashTestAddress, testData, 0, 0) == 0) &&
+		CheckFlash(FlashTestAddress, testData, FlashTestSize);
+}
+
+static int AmdBypassProgram4k()
+{
+	return (Amd_WriteToFlash(FlashTestSize, FlashTestAddress, testData, 0, 1) == 0) &&
+		CheckFlash(FlashTestAddress, testData, FlashTestSize);
+}
+
+static int AmdErase64k()
+{
+	memset(MessageBuffer, 0, FlashTestSize);
+	Amd_WriteToFlash(FlashTestSize, FlashTestAddress, MessageBuffer, 0, 1);
+	return (Amd_EraseBlock(FlashTestAddress) == 0) && (SimulatorFlashPeek(FlashTestAddress) == 0xFFFF);
+}
+
+// Erase in the background, the way the write kernel's main loop does, while a
+// message arrives. The message must be intact once the erase is done.
+static int AmdBackgroundErase64k()
+{
+	static const unsigned char toolPresent[] = { 0x8C, 0xFE, 0xF0, 0x3F };
+	unsigned char completionCode = 0xFF;
+	unsigned char readState = 0xFF;
+
+	memset(MessageBuffer, 0, FlashTestSize);
+	Amd_WriteToFlash(FlashTestSize, FlashTestAddress, MessageBuffer, 0, 1);
+
+	DlcResetReceiveRing();
+	Amd_StartErase(FlashTestAddress);
+	SimulatorQueueMessage(toolPresent, sizeof(toolPresent));
+
+	uint8_t status = FlashEraseBusy;
+	for (int iterations = 0; status == FlashEraseBusy; iterations++)
+	{
+		ScratchWatchdog();
+		DlcService();
+		status = Amd_PollErase(FlashTestAddress, iterations >= FlashEraseTimeout);
+	}
+
+	int received = ReadMessage(&completionCode, &readState);
+	return (status == 0) &&
+		(received == sizeof(toolPresent)) &&
+		(memcmp(MessageBuffer, toolPresent, sizeof(toolPresent)) == 0) &&
+		(SimulatorFlashPeek(FlashTestAddress) == 0xFFFF);
+}
+
+// Give the AMD chip several blocks at once, the way a batch erase does.
+static int AmdQueuedErase4x64k()
+{
+	memset(MessageBuffer, 0, FlashTestSize);
+	for (int block = 0; block < 4; block++)
+	{
+		Amd_WriteToFlash(FlashTestSize, FlashTestAddress + (block * 0x10000), MessageBuffer, 0, 1);
+	}
+
+	Amd_StartErase(FlashTestAddress);
+	int queued = 1;
+	while ((queued < 4) && Amd_QueueErase(FlashTestAddress + (queued * 0x10000)))
+	{
+		queued++;
+	}
+
+	uint8_t status = FlashEraseBusy;
+	for (int iterations = 0; status == FlashEraseBusy; iterations++)
+	{
+		ScratchWatchdog();
+		DlcService();
+		status = Amd_PollErase(FlashTestAddress, iterations >= FlashEraseTimeout);
+	}
+
+	int erased = (status == 0) && (queued == 4);
+	for (int block = 0; block < 4; block++)
+	{
+		erased &= SimulatorFlashPeek(FlashTestAddress + (block * 0x10000)) == 0xFFFF;
+	}
+
+	return erased;
+}
+
+typedef struct
+{
+	const char *name;
+	BenchmarkFunction function;
+	unsigned flashId;
+	int fourX;
+} Benchmark;
+
+static const Benchmark benchmarks[] =
+{
+	{ "WriteMessage 4k, 1x", WriteMessage4k, FLASH_ID_INTEL_512, 0 },
+	{ "WriteMessage 4k, 4x", WriteMessage4k, FLASH_ID_INTEL_512, 1 },
+	{ "WriteMessage 4k+CRC, 4x", WriteMessage4kCrc, FLASH_ID_INTEL_512, 1 },
+	{ "ReadMessage 4k, 4x", ReadMessage4k, FLASH_ID_INTEL_512, 1 },
+	{ "ReadMessage, ring full", ReadMessageRingFull, FLASH_ID_INTEL_512, 1 },
+	{ "CRC 64k, poll slices", CrcPollSlices64k, FLASH_ID_INTEL_512, 1 },
+	{ "CRC 64k, idle slices", CrcIdleSlices64k, FLASH_ID_INTEL_512, 1 },
+	{ "Intel program 4k, per word", IntelPerWordProgram4k, FLASH_ID_INTEL_512, 1 },
+	{ "Intel program 4k", IntelProgram4k, FLASH_ID_INTEL_512, 1 },
+	{ "Mode 36 flash 4k, 4x", Mode36Flash4k, FLASH_ID_INTEL_512, 1 },
+	{ "Mode 36 flash 4x1k, 4x", Mode36Flash4x1k, FLASH_ID_INTEL_512, 1 },
+	{ "Mode 36 pipelined 4x1k, 4x", Mode36Pipelined4k, FLASH_ID_INTEL_512, 1 },
+	{ "Intel erase 128k", IntelErase128k, FLASH_ID_INTEL_512, 1 },
+	{ "AMD program 4k", AmdProgram4k, FLASH_ID_AMD_1024, 1 },
+	{ "AMD program 4k, bypass", AmdBypassProgram4k, FLASH_ID_AMD_1024, 1 },
+	{ "AMD mode 36 flash 4x1k", Mode36Flash4x1k, FLASH_ID_AMD_1024, 1 },
+	{ "AMD mode 36 pipelined 4x1k", Mode36Pipelined4k, FLASH_ID_AMD_1024, 1 },
+	{ "AMD erase 64k", AmdErase64k, FLASH_ID_AMD_1024, 1 },
+	{ "AMD erase 64k, background", AmdBackgroundErase64k, FLASH_ID_AMD_1024, 1 },
+	{ "AMD erase 4x64k, queued", AmdQueuedErase4x64k, FLASH_ID_AMD_1024, 1 },
+};
+
+int main()
+{
+	for (int index = 0; index < CrcTestSize; index++)
+	{
+		testData[index] = (unsigned char)((index * 7) ^ (index >> 8));
+	}
+
+	turnaroundMicroseconds = 0;
+	BackgroundTask = 0;
+
+	printf("%-26s %10s %10s %10s %10s %8s %s\n",
+		"Benchmark", "Host us", "Model ms", "Accesses", "Polls", "Scratch", "Result");
+
+	int failures = 0;
+	for (unsigned index = 0; index < sizeof(benchmarks) / sizeof(benchmarks[0]); index++)
+	{
+		const Benchmark *benchmark = &benchmarks[index];
+		double hostSeconds = 0;
+		int success = 1;
+
+		// The counters are from the last repetition, they're the same every time.
+		for (int repetition = 0; repetition < Repetitions; repetition++)
+		{
+			SimulatorReset(benchmark->flashId, benchmark->fourX);
+
+			struct timespec start;
+			struct timespec end;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			success &= benchmark->function();
+			clock_gettime(CLOCK_MONOTONIC, &end);
+
+			hostSeconds += (end.tv_sec - start.tv_sec) + ((end.tv_nsec - start.tv_nsec) / 1e9);
+		}
+
+		if (simulatorCounters.transmitOverruns || simulatorCounters.receiveOverruns || simulatorCounters.flashCommandErrors)
+		{
+			success = 0;
+		}
+
+		printf("%-26s %10.1f %10.2f %10lu %10lu %8lu %s\n",
+			benchmark->name,
+			hostSeconds * 1e6 / Repetitions,
+			simulatorCounters.cycles / (SystemClockMhz * 1000.0),
+			simulatorCounters.registerAccesses,
+			simulatorCounters.statusPolls,
+			simulatorCounters.watchdogScratches,
+			success ? "ok" : "FAILED");
+
+		if (!success)
+		{
+			printf("    transmit overruns %lu, receive overruns %lu, flash command errors %lu\n",
+				simulatorCounters.transmitOverruns,
+				simulatorCounters.receiveOverruns,
+				simulatorCounters.flashCommandErrors);
+			failures++;
+		}
+	}
+
+	return failures ? 1 : 0;
+}
@@ -2,6 +2,27 @@
 // Code to handle read and write messages.
 ///////////////////////////////////////////////////////////////////////////////
 #include "common.h"
+#include "flash.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Send a block of memory as a mode-36 submode-01 message.
+///////////////////////////////////////////////////////////////////////////////
+void SendMemoryBlock(unsigned start, unsigned length)
+{
+	MessageBuffer[0] = 0x6D;
+	MessageBuffer[1] = 0xF0;
+	MessageBuffer[2] = 0x10;
+	MessageBuffer[3] = 0x36;
+	MessageBuffer[4] = 0x01;
+	MessageBuffer[5] = length >> 8;
+	MessageBuffer[6] = length;
+	MessageBuffer[7] = start >> 16;
+	MessageBuffer[8] = start >> 8;
+	MessageBuffer[9] = start;
+
+	WriteMessage(MessageBuffer, 10, Start);
+	WriteMessage((unsigned char*)start, length, End|AddSum);
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 // Process a mode-35 read.
@@ -13,20 +34,366 @@ void HandleReadMode35()
 	// TODO: Validate the start address and length, fail if unreasonable.
 
 	// Send the payload
+	ElmSleep();
+	SendMemoryBlock(start, length);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Run-length encode a block of memory into the given output buffer.
+//
+// Each control byte is followed by either literal data or a single value:
+//   00-7F: copy the next (control + 1) bytes as-is.
+//   80-FF: repeat the next byte (control - 0x80 + RLE_MIN_RUN) times.
+//
+// Returns the encoded length, or zero if the encoded data would not be
+// smaller than the raw data. In that case the caller should send it raw.
+///////////////////////////////////////////////////////////////////////////////
+#define RLE_MIN_RUN 3
+#define RLE_MAX_RUN (0x7F + RLE_MIN_RUN)
+#define RLE_MAX_LITERAL 0x80
+
+unsigned int RleEncode(unsigned char *source, unsigned int length, unsigned char *output)
+{
+	unsigned int in = 0;
+	unsigned int out = 0;
+	unsigned int literalStart = 0;
+	unsigned int lastScratch = 0;
+
+	while (in <= length)
+	{
+		if (in - lastScratch >= 256)
+		{
+			ScratchWatchdog();
+			lastScratch = in;
+		}
+
+		// Find the length of the run that starts here.
+		unsigned int run = 0;
+		if (in < length)
+		{
+			unsigned char value = source[in];
+			run = 1;
+			while ((in + run < length) && (source[in + run] == value) && (run < RLE_MAX_RUN))
+			{
+				run++;
+			}
+		}
+
+		// Short runs are just more literal data.
+		if ((run != 0) && (run < RLE_MIN_RUN))
+		{
+			in += run;
+			continue;
+		}
+
+		// Flush pending literal data, at most 128 bytes per control byte.
+		while (literalStart < in)
+		{
+			unsigned int count = in - literalStart;
+			if (count > RLE_MAX_LITERAL)
+			{
+				count = RLE_MAX_LITERAL;
+			}
+
+			if (out + 1 + count >= length)
+			{
+				return 0;
+			}
+
+			output[out++] = count - 1;
+			for (unsigned int index = 0; index < count; index++)
+			{
+				output[out++] = source[literalStart++];
+			}
+		}
+
+		// End of the block.
+		if (run == 0)
+		{
+			break;
+		}
+
+		if (out + 2 >= length)
+		{
+			return 0;
+		}
+
+		output[out++] = 0x80 | (run - RLE_MIN_RUN);
+		output[out++] = source[in];
+		in += run;
+		literalStart = in;
+	}
+
+	return out;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Send a block of memory with run-length encoding, as a mode-36 submode-02
+// message. The length field contains the length of the encoded data, since
+// the tool already knows the decoded length. If the data doesn't compress,
+// it is sent as a normal submode 01 message instead.
+//
+// Set pause to wait for the turnaround delay before sending. The delay comes
+// after the encoding, since that takes time too.
+///////////////////////////////////////////////////////////////////////////////
+void SendCompressedMemoryBlock(unsigned start, unsigned length, int pause)
+{
+	unsigned encodedLength = 0;
+	if (length <= MessageBufferSize - 12)
+	{
+		encodedLength = RleEncode((unsigned char*)start, length, &MessageBuffer[10]);
+	}
+
+	if (pause)
+	{
+		ElmSleep();
+	}
+
+	if (encodedLength == 0)
+	{
+		SendMemoryBlock(start, length);
+		return;
+	}
+
 	MessageBuffer[0] = 0x6D;
 	MessageBuffer[1] = 0xF0;
 	MessageBuffer[2] = 0x10;
 	MessageBuffer[3] = 0x36;
-	MessageBuffer[4] = 0x01;
-	MessageBuffer[5] = length >> 8;
-	MessageBuffer[6] = length;
+	MessageBuffer[4] = 0x02;
+	MessageBuffer[5] = encodedLength >> 8;
+	MessageBuffer[6] = encodedLength;
 	MessageBuffer[7] = start >> 16;
 	MessageBuffer[8] = start >> 8;
 	MessageBuffer[9] = start;
 
+	WriteMessage(MessageBuffer, 10, Start);
+	WriteMessage(&MessageBuffer[10], encodedLength, End|AddSum);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Process a mode-35 read, with run-length encoding (Mode 35, submode 02).
+///////////////////////////////////////////////////////////////////////////////
+void HandleReadMode35Compressed()
+{
+	unsigned length = (MessageBuffer[5] << 8) + MessageBuffer[6];
+	unsigned start = (MessageBuffer[7] << 16) + (MessageBuffer[8] << 8) + MessageBuffer[9];
+
+	SendCompressedMemoryBlock(start, length, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Stream a range of memory as consecutive blocks (Mode 35, submode 03).
+//
+// Request: 35 03 [block size, 2 bytes] [address, 3 bytes] [length, 3 bytes]
+//
+// Each block is sent as if it had been requested with submode 02, so each
+// one carries its own address and block sum. Only the first block waits for
+// the turnaround delay. The app chooses the length to limit how many blocks
+// are in flight. If the app sends anything while the blocks are going out,
+// for example to ask for a bad block again, the rest of the range is dropped.
+///////////////////////////////////////////////////////////////////////////////
+void HandleReadMode35Stream()
+{
+	unsigned blockSize = (MessageBuffer[5] << 8) + MessageBuffer[6];
+	unsigned start = (MessageBuffer[7] << 16) + (MessageBuffer[8] << 8) + MessageBuffer[9];
+	unsigned length = (MessageBuffer[10] << 16) + (MessageBuffer[11] << 8) + MessageBuffer[12];
+
+	if ((blockSize == 0) || (blockSize > MessageBufferSize - 12))
+	{
+		blockSize = MessageBufferSize - 12;
+	}
+
+	for (unsigned offset = 0; offset < length; offset += blockSize)
+	{
+		if ((offset != 0) && DlcReceivePending())
+		{
+			break;
+		}
+
+		unsigned size = length - offset;
+		if (size > blockSize)
+		{
+			size = blockSize;
+		}
+
+		SendCompressedMemoryBlock(start + offset, size, offset == 0);
+		ScratchWatchdog();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Read a block along with a CRC32 of its contents (Mode 35, submode 04).
+//
+// Request: 35 04 [length, 2 bytes] [address, 3 bytes]
+// Reply:   36 04 [length, 2 bytes] [address, 3 bytes] [data] [CRC, 4 bytes] [sum]
+//
+// The CRC is computed while the data goes out, so this costs no more than a
+// normal read. It covers just this block, so the kernel keeps no state
+// between reads, and the app retries a block by sending the same request
+// again. The block sum includes the CRC.
+///////////////////////////////////////////////////////////////////////////////
+void HandleReadMode35Crc()
+{
+	unsigned length = (MessageBuffer[5] << 8) + MessageBuffer[6];
+	unsigned start = (MessageBuffer[7] << 16) + (MessageBuffer[8] << 8) + MessageBuffer[9];
+	writeMessageCrc = 0;
+
+	MessageBuffer[0] = 0x6D;
+	MessageBuffer[1] = 0xF0;
+	MessageBuffer[2] = 0x10;
+	MessageBuffer[3] = 0x36;
+	MessageBuffer[4] = 0x04;
+	// The length and address are already there, from the request.
+
 	ElmSleep();
 	WriteMessage(MessageBuffer, 10, Start);
-	WriteMessage((char*)start, length, End|AddSum);
+	WriteMessage((unsigned char*)start, length, End|AddSum|AddCrc);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Report which chunks of a memory range contain a single repeated byte, so
+// the app can skip reading them. (Mode 3D, submode 07)
+//
+// Request: 3D 07 [chunk size, 2 bytes] [chunk count, 2 bytes] [address, 3 bytes]
+// Reply:   7D 07 [same 7 bytes] [bitmap] [values]
+//
+// The bitmap has one bit per chunk, MSB first, set if the chunk is uniform.
+// The values list has one byte for each set bit, in chunk order.
+///////////////////////////////////////////////////////////////////////////////
+void HandleBlankMapQuery()
+{
+	unsigned chunkSize = (MessageBuffer[5] << 8) + MessageBuffer[6];
+	unsigned chunkCount = (MessageBuffer[7] << 8) + MessageBuffer[8];
+	unsigned start = (MessageBuffer[9] << 16) + (MessageBuffer[10] << 8) + MessageBuffer[11];
+	unsigned bitmapLength = (chunkCount + 7) / 8;
+
+	if ((chunkSize == 0) || (chunkCount == 0) || (12 + bitmapLength + chunkCount > MessageBufferSize))
+	{
+		MessageBuffer[0] = 0x6C;
+		MessageBuffer[1] = 0xF0;
+		MessageBuffer[2] = 0x10;
+		MessageBuffer[3] = 0x7F;
+		MessageBuffer[4] = 0x3D;
+		MessageBuffer[5] = 0x07;
+
+		ElmSleep();
+		WriteMessage(MessageBuffer, 6, Complete);
+		return;
+	}
+
+	unsigned char *bitmap = &MessageBuffer[12];
+	unsigned char *values = &MessageBuffer[12 + bitmapLength];
+	unsigned uniformCount = 0;
+
+	for (unsigned index = 0; index < bitmapLength; index++)
+	{
+		bitmap[index] = 0;
+	}
+
+	unsigned char *chunk = (unsigned char*)start;
+	for (unsigned chunkIndex = 0; chunkIndex < chunkCount; chunkIndex++, chunk += chunkSize)
+	{
+		unsigned char value = chunk[0];
+		unsigned offset = 1;
+		for (; offset < chunkSize; offset++)
+		{
+			if (chunk[offset] != value)
+			{
+				break;
+			}
+
+			if ((offset & 0xFF) == 0)
+			{
+				ScratchWatchdog();
+			}
+		}
+
+		if (offset == chunkSize)
+		{
+			bitmap[chunkIndex >> 3] |= 0x80 >> (chunkIndex & 7);
+			values[uniformCount++] = value;
+		}
+	}
+
+	MessageBuffer[0] = 0x6C;
+	MessageBuffer[1] = 0xF0;
+	MessageBuffer[2] = 0x10;
+	MessageBuffer[3] = 0x7D;
+	MessageBuffer[4] = 0x07;
+
+	ElmSleep();
+	WriteMessage(MessageBuffer, 12 + bitmapLength + uniformCount, Complete);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Set the pause between receiving a request and sending the reply.
+//
+// Request: 3D 0A [microseconds, 2 bytes]. Reply: 7D 0A [microseconds].
+//
+// The default suits the AllPro and ScanTool. Interfaces that can switch from
+// sending to receiving quickly can ask for a shorter delay, or none.
+//
+// A request without the delay is refused with 7F 3D 0A [received length, 2
+// bytes], and the delay is left as it was.
+///////////////////////////////////////////////////////////////////////////////
+void HandleTurnaroundQuery()
+{
+	// Reply using the old delay, since the tool is expecting that.
+	ElmSleep();
+
+	// Otherwise a bare 3D 0A would apply whatever delay was left in the
+	// buffer by an earlier message.
+	if (!MessageLengthIs(7))
+	{
+		MessageBuffer[0] = 0x6C;
+		MessageBuffer[1] = 0xF0;
+		MessageBuffer[2] = 0x10;
+		MessageBuffer[3] = 0x7F;
+		MessageBuffer[4] = 0x3D;
+		MessageBuffer[5] = 0x0A;
+		MessageBuffer[6] = (char)(readMessageLength >> 8);
+		MessageBuffer[7] = (char)readMessageLength;
+		WriteMessage(MessageBuffer, 8, Complete);
+		return;
+	}
+
+	turnaroundMicroseconds = (MessageBuffer[5] << 8) + MessageBuffer[6];
+
+	MessageBuffer[0] = 0x6C;
+	MessageBuffer[1] = 0xF0;
+	MessageBuffer[2] = 0x10;
+	MessageBuffer[3] = 0x7D;
+	MessageBuffer[4] = 0x0A;
+	WriteMessage(MessageBuffer, 7, Complete);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Report the performance counters. (Mode 3D, submode 0B)
+//
+// The reply has a count, then each counter as a 32-bit value, in the order
+// of the PerfCounter enum.
+///////////////////////////////////////////////////////////////////////////////
+void HandlePerfCounterQuery()
+{
+	ElmSleep();
+
+	MessageBuffer[0] = 0x6C;
+	MessageBuffer[1] = 0xF0;
+	MessageBuffer[2] = 0x10;
+	MessageBuffer[3] = 0x7D;
+	MessageBuffer[4] = 0x0B;
+	MessageBuffer[5] = PerfCounterCount;
+
+	for (int index = 0; index < PerfCounterCount; index++)
+	{
+		uint32_t value = perfCounters[index];
+		MessageBuffer[6 + (index * 4)] = (unsigned char)(value >> 24);
+		MessageBuffer[7 + (index * 4)] = (unsigned char)(value >> 16);
+		MessageBuffer[8 + (index * 4)] = (unsigned char)(value >> 8);
+		MessageBuffer[9 + (index * 4)] = (unsigned char)value;
+	}
+
+	WriteMessage(MessageBuffer, 6 + (PerfCounterCount * 4), Complete);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -35,7 +402,6 @@ void HandleReadMode35()
 void HandleWriteRequestMode34()
 {
 	unsigned length = (MessageBuffer[5] << 8) + MessageBuffer[6];
-	unsigned start = (MessageBuffer[7] << 16) + (MessageBuffer[8] << 8) + MessageBuffer[9];
 
 	if (length > 4096)
 	{
@@ -74,6 +440,60 @@ void SendWriteSuccess(unsigned char code)
 	WriteMessage(MessageBuffer, 5, Complete);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Flash blocks that were programmed since the last mode 36 reply, with the
+// CRC of what the chip holds afterward. The reply to a pipelined block can
+// report the block before it, and the reply to the last block of a range can
+// report both that block and the one before it, so there are two slots.
+///////////////////////////////////////////////////////////////////////////////
+#define WrittenBlockSlots 2
+
+unsigned __attribute((section(".kerneldata"))) writtenBlockAddress[WrittenBlockSlots];
+unsigned __attribute((section(".kerneldata"))) writtenBlockLength[WrittenBlockSlots];
+uint32_t __attribute((section(".kerneldata"))) writtenBlockCrc[WrittenBlockSlots];
+int __attribute((section(".kerneldata"))) writtenBlockCount;
+
+void AddWrittenBlock(unsigned address, unsigned length, uint32_t crc)
+{
+	if (writtenBlockCount < WrittenBlockSlots)
+	{
+		writtenBlockAddress[writtenBlockCount] = address;
+		writtenBlockLength[writtenBlockCount] = length;
+		writtenBlockCrc[writtenBlockCount] = crc;
+		writtenBlockCount++;
+	}
+}
+
+// 6D F0 10 76 code count, then address (3), length (2) and CRC (4) for each
+// block that was programmed since the last reply. Older apps only look at
+// the first 4 bytes.
+void SendWriteSuccessCrc(unsigned char code)
+{
+	MessageBuffer[0] = 0x6D;
+	MessageBuffer[1] = 0xF0;
+	MessageBuffer[2] = 0x10;
+	MessageBuffer[3] = 0x76;
+	MessageBuffer[4] = code;
+	MessageBuffer[5] = writtenBlockCount;
+
+	int length = 6;
+	for (int slot = 0; slot < writtenBlockCount; slot++)
+	{
+		MessageBuffer[length++] = writtenBlockAddress[slot] >> 16;
+		MessageBuffer[length++] = writtenBlockAddress[slot] >> 8;
+		MessageBuffer[length++] = writtenBlockAddress[slot];
+		MessageBuffer[length++] = writtenBlockLength[slot] >> 8;
+		MessageBuffer[length++] = writtenBlockLength[slot];
+		MessageBuffer[length++] = writtenBlockCrc[slot] >> 24;
+		MessageBuffer[length++] = writtenBlockCrc[slot] >> 16;
+		MessageBuffer[length++] = writtenBlockCrc[slot] >> 8;
+		MessageBuffer[length++] = writtenBlockCrc[slot];
+	}
+
+	writtenBlockCount = 0;
+	WriteMessage(MessageBuffer, length, Complete);
+}
+
 void SendWriteFail(unsigned char callerError, unsigned char flashError)
 {
 	MessageBuffer[0] = 0x6D;
@@ -86,6 +506,187 @@ void SendWriteFail(unsigned char callerError, unsigned char flashError)
 	WriteMessage(MessageBuffer, 7, Complete);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Pipelined flash writes.
+//
+// When the tool sets the PipelinedWrite bit in the mode 36 command byte, the
+// payload is copied into programBuffer, the kernel acknowledges the block
+// right away, and the block is programmed a few words at a time while
+// ReadMessage waits for the next block. Any error is reported in the reply
+// to the next message that needs flash, and stays set until the next erase.
+//
+// Programming a 1k block only takes a few milliseconds, so hiding it behind
+// the next block saves little. On Intel chips most of the gain comes from
+// leaving the programming voltage on from one block to the next, instead of
+// waiting 320ms for it around every block. See "make bench".
+///////////////////////////////////////////////////////////////////////////////
+#define PipelinedWrite 0x02
+#define ProgramBufferSize 1024
+#define FlashJobChunkSize 32
+
+// This shares memory with the CRC batch, see kernel.ld.
+unsigned char __attribute((section(".kerneloverlay"))) programBuffer[ProgramBufferSize];
+unsigned __attribute((section(".kerneldata"))) flashJobAddress;
+unsigned __attribute((section(".kerneldata"))) flashJobLength;
+unsigned __attribute((section(".kerneldata"))) flashJobIndex;
+int __attribute((section(".kerneldata"))) flashJobTestWrite;
+unsigned char __attribute((section(".kerneldata"))) flashJobError;
+uint32_t __attribute((section(".kerneldata"))) flashJobCrc;
+
+// Set while the chip is unlocked for programming. The 12v supply takes 160ms
+// to settle each way, so it stays on from one chunk to the next, and from one
+// pipelined block to the next. It is turned off by FlashJobFinish, after a
+// block is written synchronously, and when a failed job is noticed. The DLC
+// isn't serviced while the supply settles, so this is never done by a
+// background step, only while the tool is waiting for a reply.
+int __attribute((section(".kerneldata"))) flashJobUnlocked;
+
+void FlashJobReset()
+{
+	flashJobLength = 0;
+	flashJobIndex = 0;
+	flashJobError = 0;
+	flashJobUnlocked = 0;
+	writtenBlockCount = 0;
+	BackgroundTask = 0;
+}
+
+void FlashJobUnlock(unsigned address)
+{
+	if (!flashJobUnlocked)
+	{
+		FlashWriteStart(address);
+		flashJobUnlocked = 1;
+	}
+}
+
+void FlashJobLock()
+{
+	if (flashJobUnlocked)
+	{
+		FlashWriteEnd();
+		flashJobUnlocked = 0;
+	}
+}
+
+void FlashJobStep()
+{
+	if (flashJobIndex >= flashJobLength)
+	{
+		BackgroundTask = 0;
+		return;
+	}
+
+	unsigned chunkSize = flashJobLength - flashJobIndex;
+	if (chunkSize > FlashJobChunkSize)
+	{
+		chunkSize = FlashJobChunkSize;
+	}
+
+	unsigned char flashError;
+	if (flashJobTestWrite)
+	{
+		flashError = WriteToFlash(
+			chunkSize,
+			flashJobAddress + flashJobIndex,
+			&programBuffer[flashJobIndex],
+			1);
+	}
+	else
+	{
+		flashError = FlashWriteWords(
+			chunkSize,
+			flashJobAddress + flashJobIndex,
+			&programBuffer[flashJobIndex]);
+	}
+
+	if (flashError != 0)
+	{
+		flashJobError = flashError;
+		flashJobIndex = flashJobLength;
+		BackgroundTask = 0;
+		return;
+	}
+
+	// The chip is back in read-array mode, so read back the chunk that was
+	// just programmed while there is nothing to poll.
+	flashJobCrc = crcAdd(flashJobCrc, FLASH_ARRAY(flashJobAddress + flashJobIndex), chunkSize);
+	flashJobIndex += chunkSize;
+
+	if (flashJobIndex >= flashJobLength)
+	{
+		if (!flashJobTestWrite)
+		{
+			AddWrittenBlock(flashJobAddress, flashJobLength, flashJobCrc);
+		}
+
+		BackgroundTask = 0;
+	}
+}
+
+// Program the rest of the current block, but leave the chip unlocked for the
+// next one unless something went wrong.
+void FlashJobComplete()
+{
+	while (flashJobIndex < flashJobLength)
+	{
+		ScratchWatchdog();
+		FlashJobStep();
+		DlcService();
+	}
+
+	if (flashJobError != 0)
+	{
+		FlashJobLock();
+	}
+}
+
+void FlashJobFinish()
+{
+	FlashJobComplete();
+	FlashJobLock();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Copy a mode 36 payload out of the message buffer. The CPU32 can move 32
+// bits at a time between any two even addresses. The watchdog is scratched
+// from a countdown, since the CPU32 divide is too slow for index % N tests.
+///////////////////////////////////////////////////////////////////////////////
+#define CopyBytesPerScratch 1024
+
+void CopyPayload(unsigned char *destination, unsigned char *source, unsigned length)
+{
+	unsigned index = 0;
+	int countdown = CopyBytesPerScratch / 4;
+
+	if ((((unsigned long)destination | (unsigned long)source) & 1) == 0)
+	{
+		uint32_t *to = (uint32_t*)destination;
+		uint32_t *from = (uint32_t*)source;
+		for (unsigned longs = length / 4; longs != 0; longs--)
+		{
+			*to++ = *from++;
+			if (--countdown == 0)
+			{
+				ScratchWatchdog();
+				countdown = CopyBytesPerScratch / 4;
+			}
+		}
+
+		index = length & ~3;
+	}
+
+	for (; index < length; index++)
+	{
+		destination[index] = source[index];
+		if (--countdown == 0)
+		{
+			ScratchWatchdog();
+			countdown = CopyBytesPerScratch;
+		}
+	}
+}
+
 typedef void(*EntryPoint)();
 
 void HandleWriteMode36()
@@ -94,13 +695,8 @@ void HandleWriteMode36()
 	unsigned length = (MessageBuffer[5] << 8) + MessageBuffer[6];
 	unsigned start = (MessageBuffer[7] << 16) + (MessageBuffer[8] << 8) + MessageBuffer[9];
 
-	// Compute checksum
-	unsigned short checksum = 0;
-	for (unsigned int index = 4; index < length + 10 ; index++) // vpw header = 10 bytes offset from payload length
-	{
-		if (index % 1024 == 0) ScratchWatchdog();
-		checksum += MessageBuffer[index];
-	}
+	// ReadMessage already added up the payload while it was arriving.
+	unsigned short checksum = MessageChecksum(length + 10); // vpw header = 10 bytes offset from payload length
 
 	// Validate checksum
 	unsigned short expected = (MessageBuffer[10 + length] << 8) | MessageBuffer[10 + length + 1];
@@ -135,16 +731,18 @@ void HandleWriteMode36()
 		return;
 	}
 
+	// The previous block must be finished before anything else is written.
+	FlashJobComplete();
+	if (flashJobError != 0)
+	{
+		SendWriteFail(0, flashJobError);
+		return;
+	}
+
 	if ((start >= 0xFF8000) && (start + length <= 0xFFCDFF))
 	{
-		// Copy content
-		unsigned int address = 0;
-		for (int index = 0; index < length; index++)
-		{
-			if (index % 50 == 1) ScratchWatchdog();
-			address = start + index;
-			*((unsigned char*)address) = MessageBuffer[10 + index];
-		}
+		FlashJobLock();
+		CopyPayload((unsigned char*)start, &MessageBuffer[10], length);
 
 		// Notify the tool that the write succeeded.
 		SendWriteSuccess(command);
@@ -156,11 +754,56 @@ void HandleWriteMode36()
 			entryPoint();
 		}
 	}
+	else if ((command & PipelinedWrite) && (length <= ProgramBufferSize))
+	{
+		CopyPayload(programBuffer, &MessageBuffer[10], length);
+
+		flashJobAddress = start;
+		flashJobLength = length;
+		flashJobIndex = 0;
+		flashJobCrc = 0;
+		flashJobTestWrite = (command & ~PipelinedWrite) == 0x44;
+		if (!flashJobTestWrite)
+		{
+			FlashJobUnlock(start);
+		}
+
+		BackgroundTask = FlashJobStep;
+
+		// Notify the tool that the block was received. The result of the write
+		// will be reported in the reply to the next block, along with the CRC
+		// of the previous block, which FlashJobFinish completed above.
+		SendWriteSuccessCrc(command);
+	}
 	else
 	{
-		char flashError = WriteToFlash(length, start, &MessageBuffer[10], command == 0x44);
+		int testWrite = (command & ~PipelinedWrite) == 0x44;
+		char flashError;
+		if (testWrite)
+		{
+			flashError = WriteToFlash(length, start, &MessageBuffer[10], 1);
+		}
+		else
+		{
+			// This is usually the last block of a pipelined write, so the
+			// chip may still be unlocked from the previous block.
+			FlashJobUnlock(start);
+			flashError = FlashWriteWords(length, start, &MessageBuffer[10]);
+			FlashJobLock();
+		}
+
+		if (flashError != 0)
+		{
+			SendWriteFail(0, flashError);
+			return;
+		}
+
+		if (!testWrite)
+		{
+			ScratchWatchdog();
+			AddWrittenBlock(start, length, crcAdd(0, FLASH_ARRAY(start), length));
+		}
 
-		if (flashError == 0) SendWriteSuccess(command);
-		else SendWriteFail(0, flashError);
+		SendWriteSuccessCrc(command);
 	}
 }
@@ -19,6 +19,15 @@ unsigned char __attribute((section(".kerneldata"))) MessageBuffer[MessageBufferS
 // well, and then dump this buffer later to find out what was going on.
 unsigned char __attribute((section(".kerneldata"))) BreadcrumbBuffer[BreadcrumbBufferSize];
 
+// Work to do while waiting for incoming messages.
+BackgroundTaskFunction __attribute((section(".kerneldata"))) BackgroundTask;
+
+// Pause before each reply, see ElmSleep.
+unsigned int __attribute((section(".kerneldata"))) turnaroundMicroseconds;
+
+// See PerfCounter.
+uint32_t __attribute((section(".kerneldata"))) perfCounters[PerfCounterCount];
+
 ///////////////////////////////////////////////////////////////////////////////
 // This needs to be called periodically to prevent the PCM from rebooting.
 ///////////////////////////////////////////////////////////////////////////////
@@ -42,62 +51,59 @@ void WasteTime()
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Shared sleep code for multiple scenarios
+// Spin for the given number of passes through a two-instruction loop. The
+// loop is in assembly so that its timing doesn't depend on compiler flags.
 ///////////////////////////////////////////////////////////////////////////////
-void PrivateSleep(int outerLoop, int innerLoop)
+void DelayLoop(unsigned int loops)
 {
-	for (int outer = 0; outer < outerLoop; outer++)
+	if (loops == 0)
 	{
-		for (int inner = 0; inner < innerLoop; inner++)
-		{
-			asm("nop");
-			asm("nop");
-			asm("nop");
-			asm("nop");
-
-			asm("nop");
-			asm("nop");
-			asm("nop");
-			asm("nop");
-		}
-
-		ScratchWatchdog();
+		return;
 	}
+
+#ifdef KERNEL_SIMULATOR
+	SimulatorDelay(loops);
+#else
+	asm volatile(
+		"1: subq.l #1, %0\n\t"
+		"bne.s 1b"
+		: "+d" (loops)
+		:
+		: "cc");
+#endif
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Pause for about half a second. TODO: remove this, replace with either
-// ElmSleep or VariableSleep, as appropriate.
+// Pause for the given number of microseconds, scratching the watchdog every
+// millisecond so that long pauses are safe.
 ///////////////////////////////////////////////////////////////////////////////
-void LongSleepWithWatchdog()
+void MicroSleep(unsigned int microseconds)
 {
-	PrivateSleep(10 * 1000, 5);
+	PerfAdd(PerfSleepMicroseconds, microseconds);
+
+	while (microseconds > 1000)
+	{
+		DelayLoop(1000 * SystemClockMhz / DelayLoopCycles);
+		ScratchWatchdog();
+		microseconds -= 1000;
+	}
+
+	DelayLoop(microseconds * SystemClockMhz / DelayLoopCycles);
+	ScratchWatchdog();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // ELM-based devices need a short pause between transmit and receive, otherwise
-// they will miss the responses from the PCM. This function should be tuned to
-// provide the right delay with AllPro and Scantool devices.
+// they will miss the responses from the PCM. ElmTurnaroundMicroseconds should
+// be tuned to provide the right delay with AllPro and Scantool devices. Other
+// interfaces can set a shorter delay with 3D 0A.
 ///////////////////////////////////////////////////////////////////////////////
 void ElmSleep()
 {
-	// 1,25 worked well for a long series of kernel-version requests with both
-	// the AllPro and Scantool at 1x speed.
-	// CRC responses aren't received by either device. Not sure if timing related.
-	// Have not tested 4x yet. Have not tried smaller delay either.
-	PrivateSleep(1, 50);
-}
-
-///////////////////////////////////////////////////////////////////////////////
-// Sleep for a variable amount of time. This should be close to Dimented24x7's
-// assembly-language implementation.
-// Consider cutting the inner loop down, and increasing the parameter at all
-// call sites. Consecutive message-sends (e.g. in HandleReadMode35) work fine
-// with an inner loop of 100. Haven't tried 50 yet.
-///////////////////////////////////////////////////////////////////////////////
-void VariableSleep(unsigned int iterations)
-{
-	PrivateSleep(iterations, 250);
+	if (turnaroundMicroseconds != 0)
+	{
+		MicroSleep(turnaroundMicroseconds);
+	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -108,12 +114,15 @@ void VariableSleep(unsigned int iterations)
 ///////////////////////////////////////////////////////////////////////////////
 void ClearMessageBuffer()
 {
+	// A countdown rather than index % 500, since the CPU32 divide is slow.
+	int countdown = 1;
 	for (int index = 0; index < MessageBufferSize; index++)
 	{
 		// This is not needed for P01, but P59 will reboot without it.
-		if (index % 500 == 0)
+		if (--countdown == 0)
 		{
 			ScratchWatchdog();
+			countdown = 500;
 		}
 
 		MessageBuffer[index] = 0;
@@ -132,28 +141,59 @@ void ClearBreadcrumbBuffer()
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Send a byte - used by WriteMessage
+// Wait for room in the DLC's transmit FIFO, and return the number of bytes
+// that can be written before checking the status again.
+//
+// The status register only says whether the FIFO is empty, partly full,
+// almost full, or full, so the burst sizes are conservative. While the FIFO
+// is almost full, poll tightly so the next burst goes out as soon as a byte
+// has been sent. The watchdog is scratched on a counter rather than on every
+// poll.
 ///////////////////////////////////////////////////////////////////////////////
-void WriteByte(unsigned char byte)
+#define DlcTransmitBurstEmpty 8
+#define DlcTransmitBurstPartial 2
+#define DlcTransmitMaxPolls 0x4000
+
+unsigned char WaitForTransmitSpace()
 {
-	unsigned char status;
+	unsigned int loopCount = 0;
+	for (;;)
+	{
+		switch (DLC_STATUS & 0x03)
+		{
+		case 0x00:
+			return DlcTransmitBurstEmpty;
 
-	// Status 2 means the transmit buffer is almost full.
-	// In that case, pause until there's room in the buffer.
-	status = DLC_STATUS & 0x03;
+		case 0x01:
+			return DlcTransmitBurstPartial;
+		}
 
-	// TODO: try looping around 0x02 (almost full) rather than 0x03 (full)
-	unsigned char loopCount = 0;
-	while ((status == 0x02 || status == 0x03) && loopCount < 250)
-	{
 		loopCount++;
+		PerfCount(PerfTransmitStalls);
+		if ((loopCount & 0xFF) == 0)
+		{
+			ScratchWatchdog();
+		}
 
-		// With max iterations at 25, we get some 2s and 3s in the loop counter.
-		for (int iterations = 0; iterations < 50; iterations++) WasteTime();
-
-		ScratchWatchdog();
-		status = DLC_STATUS & 0x03;
+		// Don't hang forever if the DLC gets stuck.
+		if (loopCount > DlcTransmitMaxPolls)
+		{
+			return 1;
+		}
 	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Used by WriteMessage when the segment includes AddCrc.
+///////////////////////////////////////////////////////////////////////////////
+uint32_t __attribute((section(".kerneldata"))) writeMessageCrc;
+
+///////////////////////////////////////////////////////////////////////////////
+// Send a byte - used by WriteMessage
+///////////////////////////////////////////////////////////////////////////////
+void WriteByte(unsigned char byte)
+{
+	WaitForTransmitSpace();
 	DLC_TRANSMIT_FIFO = byte;
 }
 
@@ -182,22 +222,63 @@ void WriteMessage(unsigned char *start, unsigned short length, Segment segment)
 
 	unsigned short checksum = StartChecksum();
 
-	// Send a message body
-	unsigned short index;
-	for (index = 0; index < lastIndex; index++)
+	// Send a message body, filling the FIFO in bursts and adding up the
+	// block sum along the way.
+	unsigned short index = 0;
+	unsigned short lastScratch = 0;
+	while (index < lastIndex)
 	{
-		checksum += (unsigned char) start[index];
-		WriteByte(start[index]);
+		unsigned char burst = WaitForTransmitSpace();
+		if (burst > lastIndex - index)
+		{
+			burst = lastIndex - index;
+		}
+
+		unsigned short burstStart = index;
+		for (; burst > 0; burst--)
+		{
+			unsigned char value = start[index++];
+			checksum += value;
+			DLC_TRANSMIT_FIFO = value;
+		}
+
+		// The DLC is sending the burst now, which leaves time for the CRC.
+		if (segment & AddCrc)
+		{
+			writeMessageCrc = crcAdd(writeMessageCrc, &start[burstStart], index - burstStart);
+		}
+
+		if (index - lastScratch >= 256)
+		{
+			ScratchWatchdog();
+			lastScratch = index;
+		}
+	}
+
+	unsigned char last = start[index];
+
+	// transmit a CRC? It follows the payload, and is part of the block sum.
+	if (segment & AddCrc) {
+		writeMessageCrc = crcAdd(writeMessageCrc, &start[index], 1);
+		checksum += last;
+		WriteByte(last);
+		for (int shift = 24; shift > 0; shift -= 8)
+		{
+			unsigned char value = writeMessageCrc >> shift;
+			checksum += value;
+			WriteByte(value);
+		}
+		last = writeMessageCrc;
 	}
 
 	// transmit a a block sum?
 	if (segment & AddSum) {
-		checksum += (unsigned char) start[index]; // complete the sum
-		WriteByte(start[index]);  // send the last payload byte
+		checksum += last; // complete the sum
+		WriteByte(last);  // send the last payload byte
 		WriteByte(checksum >> 8);      // send the first block sum byte
 		lastbyte = checksum;  // load the second block sum byte as the last byte
 	} else {
-		lastbyte = start[index];    // No block sum, last byte as normal
+		lastbyte = last;    // No block sum, last byte as normal
 	}
 
 	if ((segment & End) != 0)
@@ -234,16 +315,157 @@ void WriteMessage(unsigned char *start, unsigned short length, Segment segment)
 	}
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Received bytes wait here until ReadMessage gets to them. Each entry is
+// either a data byte or a completion code, which marks the end of a frame.
+// The size must be a power of two.
+//
+// If bytes are lost because the ring or the FIFO is full, the rest of that
+// frame is dropped, and its completion code is marked so that ReadMessage
+// throws the frame away. Complete frames that are already in the ring are
+// kept. Data bytes always leave one slot free, so there is room for the mark.
+///////////////////////////////////////////////////////////////////////////////
+#define DlcReceiveRingSize 128
+#define DlcRingCompletionCode 0x100
+#define DlcRingFrameDropped 0x200
+
+uint16_t __attribute((section(".kerneldata"))) dlcReceiveRing[DlcReceiveRingSize];
+uint8_t __attribute((section(".kerneldata"))) dlcReceiveHead;
+uint8_t __attribute((section(".kerneldata"))) dlcReceiveTail;
+uint8_t __attribute((section(".kerneldata"))) dlcReceiveDropping;
+uint8_t __attribute((section(".kerneldata"))) dlcReceivePartial;
+
+///////////////////////////////////////////////////////////////////////////////
+// RAM is not cleared when the kernel starts, so this must be called before
+// the first call to ReadMessage.
+///////////////////////////////////////////////////////////////////////////////
+void DlcResetReceiveRing()
+{
+	dlcReceiveHead = 0;
+	dlcReceiveTail = 0;
+	dlcReceiveDropping = 0;
+	dlcReceivePartial = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Move whatever is in the DLC's receive FIFO into the ring buffer.
+//
+// The FIFO only holds a few bytes, so code that keeps the CPU busy for a long
+// time (erasing or programming flash, for example) should call this often.
+// Otherwise incoming messages overflow the FIFO and the tool has to retry.
+//
+// Returns nonzero if the FIFO has overflowed. The frame that was arriving is
+// marked bad, and ReadMessage throws it away when it gets to it.
+///////////////////////////////////////////////////////////////////////////////
+int DlcService()
+{
+	int overflowed = 0;
+	for (;;)
+	{
+		uint16_t entry;
+		switch (DLC_STATUS >> 5)
+		{
+		case 0: // No data to process.
+			return overflowed;
+
+		case 1: // Buffer contains 2-12 data bytes.
+		case 2: // Buffer contains data followed by a completion code.
+		case 4: // Buffer contains just one data byte.
+			entry = DLC_RECEIVE_FIFO;
+			break;
+
+		case 5: // Buffer contains a completion code, followed by more data bytes.
+		case 6: // Buffer contains a completion code, followed by a full frame.
+		case 7: // Buffer contains a completion code only.
+			entry = DlcRingCompletionCode | DLC_RECEIVE_FIFO;
+
+			// Not sure if this is necessary - the code works without it, but it seems
+			// like a good idea according to 5.1.3.2. of the DLC data sheet.
+			DLC_TRANSMIT_COMMAND = 0x02;
+			break;
+
+		default: // Buffer overflow.
+			// Reading the FIFO clears the overflow, and whatever was in it.
+			PerfCount(PerfReceiveOverflows);
+			entry = DLC_RECEIVE_FIFO;
+			dlcReceiveDropping = 1;
+			overflowed = 1;
+			continue;
+		}
+
+		uint8_t used = (dlcReceiveHead - dlcReceiveTail) & (DlcReceiveRingSize - 1);
+		if ((entry & DlcRingCompletionCode) == 0)
+		{
+			if (dlcReceiveDropping || (used >= DlcReceiveRingSize - 2))
+			{
+				// The ring is full. Drop the rest of this frame, and let
+				// the tool retry.
+				dlcReceiveDropping = 1;
+				continue;
+			}
+
+			dlcReceivePartial = 1;
+		}
+		else
+		{
+			int partial = dlcReceivePartial;
+			dlcReceivePartial = 0;
+			if (dlcReceiveDropping)
+			{
+				dlcReceiveDropping = 0;
+				if (!partial)
+				{
+					// None of the frame made it into the ring.
+					continue;
+				}
+
+				entry |= DlcRingFrameDropped;
+			}
+			else if (used == DlcReceiveRingSize - 1)
+			{
+				// An empty frame, which ReadMessage would ignore anyway.
+				continue;
+			}
+		}
+
+		dlcReceiveRing[dlcReceiveHead] = entry;
+		dlcReceiveHead = (dlcReceiveHead + 1) & (DlcReceiveRingSize - 1);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Indicates whether there is incoming data waiting to be read.
+///////////////////////////////////////////////////////////////////////////////
+int DlcReceivePending()
+{
+	return (dlcReceiveHead != dlcReceiveTail) || ((DLC_STATUS & 0xE0) != 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Clear the counters.
+///////////////////////////////////////////////////////////////////////////////
+void PerfReset()
+{
+	for (int index = 0; index < PerfCounterCount; index++)
+	{
+		perfCounters[index] = 0;
+	}
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Read a VPW message into the 'MessageBuffer' buffer.
 ///////////////////////////////////////////////////////////////////////////////
+uint16_t __attribute((section(".kerneldata"))) readMessageChecksum;
+int __attribute((section(".kerneldata"))) readMessageLength;
+
 int ReadMessage(unsigned char *completionCode, unsigned char *readState)
 {
 	ScratchWatchdog();
-	unsigned char status;
 
 	unsigned int iterations = 0;
 	int length = 0;
+	readMessageChecksum = 0;
+	readMessageLength = 0;
 	for (;;)
 	{
 		ScratchWatchdog();
@@ -256,66 +478,104 @@ int ReadMessage(unsigned char *completionCode, unsigned char *readState)
 		}
 
 		// Let us not overflow MessageBuffer.
-		if (length > MessageBufferSize)
+		if (length >= MessageBufferSize)
 		{
+			PerfCount(PerfReceiveErrors);
 			*readState = 0xEE;
+			readMessageLength = length;
 			return length;
 		}
 
-		status = DLC_STATUS >> 5;
-		switch (status)
-		{
-		case 0: // No data to process.
-			break;
-		case 1: // Buffer contains 2-12 data bytes.
-		case 2: // Buffer contains data followed by a completion code.
-		case 4: // Buffer contains just one data byte.
-			do {
-				MessageBuffer[length++] = DLC_RECEIVE_FIFO;
-				status = (DLC_STATUS >> 5);
-			} while ( status == 1 || status == 2 || status == 4 );
-			iterations = 0; // reset the timer every byte received
-			break;
-		case 5: // Buffer contains a completion code, followed by more data bytes.
-		case 6: // Buffer contains a completion code, followed by a full frame.
-		case 7: // Buffer contains a completion code only.
-			*completionCode = DLC_RECEIVE_FIFO;
-
-			// Not sure if this is necessary - the code works without it, but it seems
-			// like a good idea according to 5.1.3.2. of the DLC data sheet.
-			DLC_TRANSMIT_COMMAND = 0x02;
+		DlcService();
 
-			// If we return here when the length is zero, we'll never return
-			// any message data at all. Not sure why.
-			if (length == 0)
+		if (dlcReceiveTail == dlcReceiveHead)
+		{
+			// No data to process, so this is a good time for background work.
+			PerfCount(PerfReceiveIdle);
+			if (BackgroundTask)
 			{
-				break;
+				BackgroundTask();
 			}
 
-			if (*completionCode & 0x30)
+			continue;
+		}
+
+		uint16_t entry = dlcReceiveRing[dlcReceiveTail];
+		dlcReceiveTail = (dlcReceiveTail + 1) & (DlcReceiveRingSize - 1);
+		iterations = 0; // reset the timer every byte received
+
+		if ((entry & DlcRingCompletionCode) == 0)
+		{
+			if (length >= 4)
 			{
-				*readState = 2;
-				return 0;
+				readMessageChecksum += (unsigned char)entry;
 			}
 
-			*readState = 1;
-			return length;
+			MessageBuffer[length++] = entry;
+			continue;
+		}
+
+		*completionCode = entry;
 
-		case 3:  // Buffer overflow. What to do here?
-			// Just throw the message away and hope the tool sends again?
-			while (DLC_STATUS & 0xE0 == 0x60) MessageBuffer[length] = DLC_RECEIVE_FIFO;
+		// If we return here when the length is zero, we'll never return
+		// any message data at all. Not sure why.
+		if (length == 0)
+		{
+			continue;
+		}
+
+		if (entry & DlcRingFrameDropped)
+		{
+			// Part of the message was lost. Just throw the message away and
+			// hope the tool sends again.
 			*readState = 0x0B;
 			return 0;
 		}
+
+		if (*completionCode & 0x30)
+		{
+			PerfCount(PerfReceiveErrors);
+			*readState = 2;
+			return 0;
+		}
+
+		*readState = 1;
+		readMessageLength = length;
+		return length;
+	}
+}
+
+unsigned short MessageChecksum(unsigned end)
+{
+	if (end > MessageBufferSize)
+	{
+		end = MessageBufferSize;
+	}
+	else if (end < 4)
+	{
+		end = 4;
 	}
 
-	// If we reach this point, the loop above probably just hit maxIterations.
-	// Or maybe the tool sent a message bigger than the buffer.
-	// Either way, we have "received" an incomplete message.
-	// Might be better to return zero and hope the tool sends again.
-	// But for debugging we'll just see what we managed to receive.
-	*readState = 0x0A;
-	return length;
+	// Usually this only has to take the block sum bytes back out.
+	unsigned short checksum = readMessageChecksum;
+	unsigned index = (readMessageLength > 4) ? readMessageLength : 4;
+	for (; index > end; index--)
+	{
+		checksum -= MessageBuffer[index - 1];
+	}
+
+	for (; index < end; index++)
+	{
+		checksum += MessageBuffer[index];
+	}
+
+	return checksum;
+}
+
+int MessageLengthIs(int expected)
+{
+	// The DLC may leave the frame's CRC byte at the end.
+	return (readMessageLength == expected) || (readMessageLength == expected + 1);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -346,7 +606,7 @@ void CopyToMessageBuffer(unsigned char* start, unsigned int length, unsigned int
 ///////////////////////////////////////////////////////////////////////////////
 void Reboot(unsigned int value)
 {
-	LongSleepWithWatchdog();
+	MicroSleep(500 * 1000);
 
 	MessageBuffer[0] = 0x6C;
 	MessageBuffer[1] = 0xF0;
@@ -358,7 +618,7 @@ void Reboot(unsigned int value)
 	MessageBuffer[7] = (unsigned char)((value & 0x000000FF) >> 0);
 	WriteMessage(MessageBuffer, 8, Complete);
 
-	LongSleepWithWatchdog();
+	MicroSleep(500 * 1000);
 
 	// If you stop scratching the watchdog, it will kill you.
 	for (;;);
@@ -388,8 +648,8 @@ void SendBreadcrumbs(unsigned char code)
 	unsigned char toolPresent[] = { 0x8C, 0xFE, 0xF0, 0x3F, code };
 	WriteMessage(toolPresent, 5, Start);
 	WriteMessage(BreadcrumbBuffer, breadcrumbs, End);
-	LongSleepWithWatchdog();
-	LongSleepWithWatchdog();
+	MicroSleep(500 * 1000);
+	MicroSleep(500 * 1000);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -30,14 +30,16 @@ typedef int            int32_t;
 // The linker needs to put these buffers after the kernel code, but before the
 // system registers that are at the top of the RAM space.
 //
-// Usable RAM is four 4k blocks starting at FF8000.
-// We reserve 10kb for the kernel, and start global variables at FFA800,
-// leaving room for 6kb of globals. That's a little over 4k for the message
-// buffer, 1k for the CRC table, and a bit less than 1k left over.
+// Usable RAM is four 4k blocks starting at FF8000. The kernel code comes
+// first and the globals follow it. kernel.ld fails the build if the total
+// doesn't fit in the 16kb. The CRC table is constant, so it is part of the
+// kernel image (see crc-table.h) rather than a global.
 //
-// If necessary we could probably overlay the CRC buffer atop the message
-// buffer, since we don't need to start computing the CRC until after we
-// process the incoming message that requested the CRC.
+// Most globals go in .kerneldata. Buffers that are never live at the same
+// time go in .kerneloverlay, where kernel.ld gives each object file's buffers
+// the same address. Today that is the 1kb pipelined-write program buffer and
+// the CRC batch lists, which is what makes room for the program buffer
+// alongside the message buffer and the DLC receive ring.
 //
 // Message buffer is larger than the max payload size (4k for the AVT) plus
 // message header bytes (10 bytes header, 2 bytes checksum).
@@ -67,22 +69,33 @@ void ScratchWatchdog();
 void WasteTime();
 
 ///////////////////////////////////////////////////////////////////////////////
-// All uses of this should be replaced with ElmSleep or VariableSleep.
+// Delays are counted in CPU cycles, so these must match the hardware. The
+// assembly loop in DelayLoop takes 2 cycles for the subtract and 6 for the
+// branch.
 ///////////////////////////////////////////////////////////////////////////////
-void LongSleepWithWatchdog();
+#define SystemClockMhz 20
+#define DelayLoopCycles 8
 
 ///////////////////////////////////////////////////////////////////////////////
-// ELM-based devices need a short pause between transmit and receive, otherwise
-// they will miss the responses from the PCM. This function should be tuned to
-// provide the right delay with AllPro and Scantool devices.
+// Spin for the given number of DelayLoopCycles-long loops.
 ///////////////////////////////////////////////////////////////////////////////
-void ElmSleep();
+void DelayLoop(unsigned int loops);
 
 ///////////////////////////////////////////////////////////////////////////////
-// Sleep for a variable amount of time. This should be close to Dimented24x7's
-// assembly-language implementation.
+// Pause for the given number of microseconds, with the watchdog scratched.
 ///////////////////////////////////////////////////////////////////////////////
-void VariableSleep(unsigned int iterations);
+void MicroSleep(unsigned int microseconds);
+
+///////////////////////////////////////////////////////////////////////////////
+// ELM-based devices need a short pause between transmit and receive, otherwise
+// they will miss the responses from the PCM.
+//
+// The old NOP-loop version of this worked well for a long series of
+// kernel-version requests with both the AllPro and Scantool at 1x speed, and
+// took roughly 400 microseconds.
+///////////////////////////////////////////////////////////////////////////////
+#define ElmTurnaroundMicroseconds 400
+void ElmSleep();
 
 ///////////////////////////////////////////////////////////////////////////////
 // All outgoing messages must be written into this buffer. The WriteMessage
@@ -100,10 +113,24 @@ void ClearBreadcrumbBuffer();
 // Message handlers
 ///////////////////////////////////////////////////////////////////////////////
 void HandleReadMode35();
+void HandleReadMode35Compressed();
+void HandleReadMode35Stream();
+void HandleReadMode35Crc();
+void HandleBlankMapQuery();
+void HandleTurnaroundQuery();
+void HandlePerfCounterQuery();
 void HandleWriteRequestMode34();
 void HandleWriteMode36();
 void SendWriteSuccess(unsigned char code);
 
+///////////////////////////////////////////////////////////////////////////////
+// Pipelined mode 36 flash writes are programmed in the background. Anything
+// that reads or erases flash must call FlashJobFinish first, which also locks
+// the chip if a pipelined write left it unlocked.
+///////////////////////////////////////////////////////////////////////////////
+void FlashJobReset();
+void FlashJobFinish();
+
 ///////////////////////////////////////////////////////////////////////////////
 // Indicates whether the buffer passed to WriteMessage contains the beginning,
 // middle, or end of a message.
@@ -115,9 +142,17 @@ typedef enum
 	Middle = 2,
 	End = 4,
 	AddSum = 8,
+	AddCrc = 16,
 	Complete = Start | End,
 } Segment;
 
+///////////////////////////////////////////////////////////////////////////////
+// With AddCrc, WriteMessage adds each byte to this CRC as it goes out, and
+// sends the CRC after the last byte (before the block sum, if there is one).
+// The caller sets the starting value.
+///////////////////////////////////////////////////////////////////////////////
+extern uint32_t __attribute((section(".kerneldata"))) writeMessageCrc;
+
 ///////////////////////////////////////////////////////////////////////////////
 // Send the given bytes over the VPW bus.
 // The DLC will append the checksum byte, so we don't have to.
@@ -131,6 +166,69 @@ void WriteMessage(unsigned char* start, unsigned short length, Segment segment);
 ///////////////////////////////////////////////////////////////////////////////
 int ReadMessage(unsigned char *completionCode, unsigned char *readState);
 
+///////////////////////////////////////////////////////////////////////////////
+// ReadMessage adds up everything after the mode byte as it arrives, so a
+// handler can check a block sum without another pass over the payload.
+// MessageChecksum gives the sum of MessageBuffer[4] to MessageBuffer[end - 1].
+///////////////////////////////////////////////////////////////////////////////
+extern uint16_t __attribute((section(".kerneldata"))) readMessageChecksum;
+extern int __attribute((section(".kerneldata"))) readMessageLength;
+unsigned short MessageChecksum(unsigned end);
+
+///////////////////////////////////////////////////////////////////////////////
+// Check that the message that ReadMessage returned is as long as its header
+// says it should be, so a handler doesn't use whatever was left over in the
+// buffer from an earlier message.
+///////////////////////////////////////////////////////////////////////////////
+int MessageLengthIs(int expected);
+
+///////////////////////////////////////////////////////////////////////////////
+// If this is set, ReadMessage calls it whenever there is no incoming data to
+// process. It should do a small amount of work and return quickly.
+///////////////////////////////////////////////////////////////////////////////
+typedef void (*BackgroundTaskFunction)();
+EXTERN BackgroundTaskFunction __attribute((section(".kerneldata"))) BackgroundTask;
+
+// How long ElmSleep pauses before each reply. Each kernel must set this to
+// ElmTurnaroundMicroseconds at startup. The app can change it with 3D 0A.
+EXTERN unsigned int __attribute((section(".kerneldata"))) turnaroundMicroseconds;
+
+///////////////////////////////////////////////////////////////////////////////
+// Always-on counters, so we can see where the kernel's time goes. The app
+// reads them with 3D 0B. There's no timer to read, so most of these count
+// loop passes rather than time. Keep the order in sync with KernelCounter in
+// the app, and only add new counters at the end.
+///////////////////////////////////////////////////////////////////////////////
+typedef enum
+{
+	PerfMessages = 0,          // Messages processed.
+	PerfReceiveIdle,           // ReadMessage passes with no data to process.
+	PerfReceiveOverflows,      // DLC receive FIFO overflows.
+	PerfReceiveErrors,         // Messages dropped because of a bad completion code or length.
+	PerfTransmitStalls,        // Polls while the DLC transmit FIFO was almost full or full.
+	PerfFlashWords,            // Words programmed.
+	PerfFlashPolls,            // Status polls while programming.
+	PerfErasePolls,            // Status polls while erasing.
+	PerfSleepMicroseconds,     // Time spent in MicroSleep. Wraps after 71 minutes.
+	PerfCounterCount,
+} PerfCounter;
+
+EXTERN uint32_t __attribute((section(".kerneldata"))) perfCounters[PerfCounterCount];
+
+#define PerfCount(counter) (perfCounters[counter]++)
+#define PerfAdd(counter, amount) (perfCounters[counter] += (amount))
+
+// RAM is not cleared when the kernel starts, so each kernel must call this.
+void PerfReset();
+
+///////////////////////////////////////////////////////////////////////////////
+// Move incoming bytes from the DLC into a ring buffer, so they aren't lost
+// while the CPU is busy. ReadMessage takes messages from that ring buffer.
+///////////////////////////////////////////////////////////////////////////////
+void DlcResetReceiveRing();
+int DlcService();
+int DlcReceivePending();
+
 ///////////////////////////////////////////////////////////////////////////////
 // TODO: REMOVE.
 // Copy the given buffer into the message buffer.
@@ -200,7 +298,32 @@ int crcIsStarted(uint8_t *message, int nBytes);
 int crcIsDone(uint8_t *message, int nBytes);
 void crcStart(uint8_t *message, int nBytes);
 uint32_t crcGetResult();
-void crcProcessSlice();
+
+// Continue a CRC over more bytes, for CRCs that are built up piece by piece.
+uint32_t crcAdd(uint32_t remainder, uint8_t *message, int nBytes);
+
+// Polls from the app process a big slice, since the app is waiting anyway.
+// The main loop processes small slices between messages, so that an incoming
+// message won't overflow the DLC's receive buffer while the CRC is running.
+#define CrcPollSliceSize 8192
+#define CrcIdleSliceSize 256
+void crcProcessSlice(int chunkSize);
+
+// Batch CRC: the ranges are processed in order, one slice at a time.
+#define CrcBatchMaxRanges 24
+extern int __attribute((section(".kerneldata"))) crcBatchCount;
+extern int __attribute((section(".kerneldata"))) crcBatchDone;
+
+void crcBatchReset(void);
+int crcBatchAdd(uint8_t *message, int nBytes);
+int crcBatchMatches(int index, uint8_t *message, int nBytes);
+int crcBatchIsDone();
+uint32_t crcBatchGetResult(int index);
+void crcBatchProcessSlice(int chunkSize);
+
+// Background CRC work for the kernel's main loop.
+int crcIsPending();
+void crcProcessIdleSlice();
 
 ///////////////////////////////////////////////////////////////////////////////
 // Write data to flash memory.
@@ -209,3 +332,12 @@ void crcProcessSlice();
 // there is a flash error.
 ///////////////////////////////////////////////////////////////////////////////
 unsigned char WriteToFlash(const unsigned start, const unsigned length, unsigned char *data, int testWrite);
+
+///////////////////////////////////////////////////////////////////////////////
+// Write data to flash memory in several pieces, with the chip unlocked once.
+// FlashWriteWords has the same return value as WriteToFlash, and leaves the
+// chip in read-array mode. FlashWriteEnd must be called even if it fails.
+///////////////////////////////////////////////////////////////////////////////
+void FlashWriteStart(const unsigned start);
+unsigned char FlashWriteWords(const unsigned length, const unsigned start, unsigned char *data);
+void FlashWriteEnd();
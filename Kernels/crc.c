@@ -1,4 +1,5 @@
 #include "common.h"
+#include "crc-table.h"
 
 /* From https://barrgroup.com/Embedded-Systems/How-To/CRC-Calculation-C-Code
  *
@@ -12,7 +13,20 @@ typedef unsigned char uint8_t;
 #define TOPBIT (1 << (WIDTH - 1))
 #define POLYNOMIAL 0x04C11DB7
 
-crc __attribute((section(".kerneldata"))) crcTable[256];
+// The lookup table is constant, so it goes into .rodata and is uploaded with
+// the kernel. Define CRC_NIBBLE_TABLE to trade some speed for a smaller kernel.
+#ifdef CRC_NIBBLE_TABLE
+const crc crcTable[16] = { CRC_TABLE_16 };
+
+#define CRC_UPDATE(remainder, value) \
+    remainder = crcTable[(remainder >> (WIDTH - 4)) ^ ((value) >> 4)] ^ (remainder << 4); \
+    remainder = crcTable[(remainder >> (WIDTH - 4)) ^ ((value) & 0x0F)] ^ (remainder << 4)
+#else
+const crc crcTable[256] = { CRC_TABLE_256 };
+
+#define CRC_UPDATE(remainder, value) \
+    remainder = crcTable[(value) ^ (remainder >> (WIDTH - 8))] ^ (remainder << 8)
+#endif
 
 // These are not from the original code, they're used to support background CRC computation.
 uint8_t __attribute((section(".kerneldata"))) *crcStartAddress;
@@ -20,51 +34,21 @@ int __attribute((section(".kerneldata"))) crcLength;
 int __attribute((section(".kerneldata"))) crcIndex;
 crc __attribute((section(".kerneldata"))) crcRemainder;
 
+// A list of ranges to process one after another, so the app can get all of
+// the CRCs it needs with a single request. The lists share memory with the
+// pipelined-write program buffer (see kernel.ld), so they are only valid
+// while crcBatchCount is non-zero.
+uint8_t __attribute((section(".kerneloverlay"))) *crcBatchAddress[CrcBatchMaxRanges];
+int __attribute((section(".kerneloverlay"))) crcBatchLength[CrcBatchMaxRanges];
+crc __attribute((section(".kerneloverlay"))) crcBatchResult[CrcBatchMaxRanges];
+int __attribute((section(".kerneldata"))) crcBatchCount;
+int __attribute((section(".kerneldata"))) crcBatchDone;
+
+// The table no longer needs to be computed at startup, so this just clears
+// the state used for background CRC computation.
 void crcInit(void)
 {
-    crcStartAddress = 0;
-    crcLength = 0;
-    crcIndex = 0;
-    crcRemainder = 0;
-
-    crc  remainder;
-
-    /*
-     * Compute the remainder of each possible dividend.
-     */
-    for (int dividend = 0; dividend < 256; ++dividend)
-    {
-        ScratchWatchdog();
-
-        /*
-         * Start with the dividend followed by zeros.
-         */
-        remainder = dividend << (WIDTH - 8);
-
-        /*
-         * Perform modulo-2 division, a bit at a time.
-         */
-        for (uint8_t bit = 8; bit > 0; --bit)
-        {
-            /*
-             * Try to divide the current data bit.
-             */
-            if (remainder & TOPBIT)
-            {
-                remainder = (remainder << 1) ^ POLYNOMIAL;
-            }
-            else
-            {
-                remainder = (remainder << 1);
-            }
-        }
-
-        /*
-         * Store the result into the table.
-         */
-        crcTable[dividend] = remainder;
-    }
-
+    crcReset();
 }   /* crcInit() */
 
 // Used by the erase function to destory any previously calculated CRC
@@ -74,11 +58,12 @@ void crcReset(void)
   crcLength = 0;
   crcIndex = 0;
   crcRemainder = 0;
+  crcBatchCount = 0;
+  crcBatchDone = 0;
 }
 
 crc crcFast(unsigned char *message, int nBytes)
 {
-    uint8_t data;
     crc remainder = 0;
 
 
@@ -92,8 +77,7 @@ crc crcFast(unsigned char *message, int nBytes)
             ScratchWatchdog();
         }
 
-        data = message[byte] ^ (remainder >> (WIDTH - 8));
-        remainder = crcTable[data] ^ (remainder << 8);
+        CRC_UPDATE(remainder, message[byte]);
     }
 
     /*
@@ -148,7 +132,17 @@ crc crcGetResult()
     return crcRemainder;
 }
 
-void crcProcessSlice()
+crc crcAdd(crc remainder, unsigned char *message, int nBytes)
+{
+    for (int index = 0; index < nBytes; index++)
+    {
+        CRC_UPDATE(remainder, message[index]);
+    }
+
+    return remainder;
+}
+
+void crcProcessSlice(int chunkSize)
 {
     if (crcLength == 0)
     {
@@ -156,20 +150,107 @@ void crcProcessSlice()
     }
 
     int limit = crcLength;
-    int chunkSize = 8192;
     if ((crcIndex + chunkSize) < limit)
     {
         limit = crcIndex + chunkSize;
     }
 
-    uint8_t data;
     for( ; crcIndex < limit; crcIndex++)
     {
         if (crcIndex % 256 == 0)
         {
             ScratchWatchdog();
         }
-        data = crcStartAddress[crcIndex] ^ (crcRemainder >> (WIDTH - 8));
-        crcRemainder = crcTable[data] ^ (crcRemainder << 8);
+        CRC_UPDATE(crcRemainder, crcStartAddress[crcIndex]);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void crcBatchReset(void)
+{
+    crcBatchCount = 0;
+    crcBatchDone = 0;
+}
+
+int crcBatchAdd(unsigned char *message, int nBytes)
+{
+    if (crcBatchCount == CrcBatchMaxRanges)
+    {
+        return 0;
+    }
+
+    crcBatchAddress[crcBatchCount] = message;
+    crcBatchLength[crcBatchCount] = nBytes;
+    crcBatchResult[crcBatchCount] = 0;
+    crcBatchCount++;
+    return 1;
+}
+
+int crcBatchMatches(int index, unsigned char *message, int nBytes)
+{
+    if (index >= crcBatchCount)
+    {
+        return 0;
+    }
+
+    return (crcBatchAddress[index] == message) && (crcBatchLength[index] == nBytes);
+}
+
+int crcBatchIsDone()
+{
+    return crcBatchDone == crcBatchCount;
+}
+
+crc crcBatchGetResult(int index)
+{
+    return crcBatchResult[index];
+}
+
+void crcBatchProcessSlice(int chunkSize)
+{
+    if (crcBatchIsDone())
+    {
+        return;
+    }
+
+    uint8_t *message = crcBatchAddress[crcBatchDone];
+    int nBytes = crcBatchLength[crcBatchDone];
+
+    if (!crcIsStarted(message, nBytes))
+    {
+        crcStart(message, nBytes);
+    }
+
+    crcProcessSlice(chunkSize);
+
+    if (crcIsDone(message, nBytes))
+    {
+        crcBatchResult[crcBatchDone] = crcGetResult();
+        crcBatchDone++;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int crcIsPending()
+{
+    if (!crcBatchIsDone())
+    {
+        return 1;
+    }
+
+    return (crcLength != 0) && (crcIndex < crcLength);
+}
+
+void crcProcessIdleSlice()
+{
+    if (!crcBatchIsDone())
+    {
+        crcBatchProcessSlice(CrcIdleSliceSize);
+    }
+    else
+    {
+        crcProcessSlice(CrcIdleSliceSize);
     }
 }
@@ -0,0 +1,248 @@
+// Print the CRC of each block of one or more .bin files, using the same CRC
+// as crc.c in the kernel and Crc.cs in the apps. With a reference file, only
+// the blocks that differ from the reference are printed, so a stack of bins
+// can be compared with a known-good image (or with each other) at once.
+//
+// crcmap [-b <block size>] [-r <reference.bin>] <file.bin> ...
+//
+// The block size is hex, with no 0x. The default is 2000 (8kb), which
+// divides every erase block on the supported flash chips.
+//
+// Build with: g++ -O2 -std=c++11 -pthread -o crcmap.exe crcmap.cpp
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "crc-table.h"
+using namespace std;
+
+#define DefaultBlockSize 0x2000
+
+const unsigned crcTable256[256] = { CRC_TABLE_256 };
+
+// crcSlices[0] is the kernel's table. crcSlices[n] gives the effect of a byte
+// that is followed by n more bytes, so 8 bytes can be done with 8 lookups
+// that don't depend on each other.
+unsigned crcSlices[8][256];
+
+void InitSlices()
+{
+    memcpy(crcSlices[0], crcTable256, sizeof(crcTable256));
+    for (int slice = 1; slice < 8; slice++)
+    {
+        for (int dividend = 0; dividend < 256; dividend++)
+        {
+            unsigned remainder = crcSlices[slice - 1][dividend];
+            crcSlices[slice][dividend] = (remainder << 8) ^ crcSlices[0][remainder >> 24];
+        }
+    }
+}
+
+unsigned CrcAdd(unsigned remainder, const unsigned char *data, size_t length)
+{
+    const unsigned char *end = data + length;
+    for (; data + 8 <= end; data += 8)
+    {
+        unsigned high = remainder ^ ((data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3]);
+        remainder =
+            crcSlices[7][high >> 24] ^
+            crcSlices[6][(high >> 16) & 0xFF] ^
+            crcSlices[5][(high >> 8) & 0xFF] ^
+            crcSlices[4][high & 0xFF] ^
+            crcSlices[3][data[4]] ^
+            crcSlices[2][data[5]] ^
+            crcSlices[1][data[6]] ^
+            crcSlices[0][data[7]];
+    }
+
+    for (; data < end; data++)
+    {
+        remainder = crcSlices[0][*data ^ (remainder >> 24)] ^ (remainder << 8);
+    }
+
+    return remainder;
+}
+
+bool ReadFile(const char *path, vector<unsigned char> &data)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    data.resize(size > 0 ? size : 0);
+    bool success = fread(data.data(), 1, data.size(), file) == data.size();
+    fclose(file);
+    return success;
+}
+
+struct Image
+{
+    const char *path;
+    bool loaded;
+    unsigned crc;
+    vector<unsigned> blocks;
+};
+
+// Read one file and compute its CRCs. The file's contents are only needed
+// while this runs, so a big stack of bins doesn't have to fit in memory.
+void Process(Image &image, size_t blockSize)
+{
+    vector<unsigned char> data;
+    image.loaded = ReadFile(image.path, data);
+    if (!image.loaded)
+    {
+        return;
+    }
+
+    image.crc = CrcAdd(0, data.data(), data.size());
+    for (size_t offset = 0; offset < data.size(); offset += blockSize)
+    {
+        size_t length = min(blockSize, data.size() - offset);
+        image.blocks.push_back(CrcAdd(0, &data[offset], length));
+    }
+}
+
+// Hand out the files to one thread per core.
+void ProcessAll(vector<Image> &images, size_t blockSize)
+{
+    atomic<size_t> next(0);
+    unsigned threadCount = thread::hardware_concurrency();
+    if (threadCount == 0)
+    {
+        threadCount = 1;
+    }
+
+    if (threadCount > images.size())
+    {
+        threadCount = (unsigned)images.size();
+    }
+
+    vector<thread> threads;
+    for (unsigned index = 0; index < threadCount; index++)
+    {
+        threads.push_back(thread([&]()
+        {
+            for (size_t file = next++; file < images.size(); file = next++)
+            {
+                Process(images[file], blockSize);
+            }
+        }));
+    }
+
+    for (size_t index = 0; index < threads.size(); index++)
+    {
+        threads[index].join();
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t blockSize = DefaultBlockSize;
+    const char *referencePath = NULL;
+    vector<Image> images;
+
+    for (int arg = 1; arg < argc; arg++)
+    {
+        if ((strcmp(argv[arg], "-b") == 0) && (arg + 1 < argc))
+        {
+            blockSize = strtoul(argv[++arg], NULL, 16);
+        }
+        else if ((strcmp(argv[arg], "-r") == 0) && (arg + 1 < argc))
+        {
+            referencePath = argv[++arg];
+        }
+        else
+        {
+            Image image = { argv[arg], false, 0 };
+            images.push_back(image);
+        }
+    }
+
+    if (images.empty() || (blockSize == 0))
+    {
+        printf("Usage: crcmap [-b <block size>] [-r <reference.bin>] <file.bin> ...\r\n");
+        return 1;
+    }
+
+    InitSlices();
+
+    // The reference goes first, so that it is processed along with the rest.
+    if (referencePath != NULL)
+    {
+        Image reference = { referencePath, false, 0 };
+        images.insert(images.begin(), reference);
+    }
+
+    ProcessAll(images, blockSize);
+
+    int result = 0;
+    const Image *reference = (referencePath != NULL) ? &images[0] : NULL;
+    if ((reference != NULL) && !reference->loaded)
+    {
+        printf("Unable to read %s\r\n", reference->path);
+        return 1;
+    }
+
+    for (size_t file = (reference != NULL) ? 1 : 0; file < images.size(); file++)
+    {
+        const Image &image = images[file];
+        if (!image.loaded)
+        {
+            printf("Unable to read %s\r\n", image.path);
+            result = 1;
+            continue;
+        }
+
+        if (reference == NULL)
+        {
+            printf("%s %08X\r\n", image.path, image.crc);
+            for (size_t block = 0; block < image.blocks.size(); block++)
+            {
+                printf("  %06X %08X\r\n", (unsigned)(block * blockSize), image.blocks[block]);
+            }
+
+            continue;
+        }
+
+        if (image.blocks.size() != reference->blocks.size())
+        {
+            printf("%s: size does not match %s\r\n", image.path, reference->path);
+            result = 1;
+            continue;
+        }
+
+        int different = 0;
+        for (size_t block = 0; block < image.blocks.size(); block++)
+        {
+            if (image.blocks[block] != reference->blocks[block])
+            {
+                if (different == 0)
+                {
+                    printf("%s: differs from %s\r\n", image.path, reference->path);
+                }
+
+                printf("  %06X %08X %08X\r\n", (unsigned)(block * blockSize), image.blocks[block], reference->blocks[block]);
+                different++;
+            }
+        }
+
+        if (different == 0)
+        {
+            printf("%s: same as %s\r\n", image.path, reference->path);
+        }
+        else
+        {
+            result = 1;
+        }
+    }
+
+    return result;
+}
@@ -5,8 +5,8 @@
 #include "common.h"
 #include "flash.h"
 
-#define COMMAND_REG_AAA (*((volatile uint16_t*)0xAAA))
-#define COMMAND_REG_554 (*((volatile uint16_t*)0x554))
+#define COMMAND_REG_AAA 0xAAA
+#define COMMAND_REG_554 0x554
 
 ///////////////////////////////////////////////////////////////////////////////
 // Get the manufacturer and type of flash chip.
@@ -18,9 +18,9 @@ uint32_t Amd_GetFlashId()
 
 	// Switch to flash into ID-query mode.
 	SIM_CSOR0 = 0x7060;
-	COMMAND_REG_AAA = 0xAAAA;
-	COMMAND_REG_554 = 0x5555;
-	COMMAND_REG_AAA = 0x9090;
+	FLASH_WRITE(COMMAND_REG_AAA, 0xAAAA);
+	FLASH_WRITE(COMMAND_REG_554, 0x5555);
+	FLASH_WRITE(COMMAND_REG_AAA, 0x9090);
 
 	// Read the identifier from address zero.
 	//flashIdentifier = FLASH_IDENTIFIER;
@@ -29,91 +29,195 @@ uint32_t Amd_GetFlashId()
 	uint32_t id = ((uint32_t)manufacturer << 16) | device;
 
 	// Switch back to standard mode.
-	FLASH_BASE = READ_ARRAY_COMMAND;
+	FLASH_WRITE(FLASH_BASE, READ_ARRAY_COMMAND);
 	SIM_CSOR0 = 0x1060;
 
 	return id;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Erase the given block.
+// Start erasing the given block. Amd_PollErase says when it's done.
 ///////////////////////////////////////////////////////////////////////////////
-uint8_t Amd_EraseBlock(uint32_t address)
+void Amd_StartErase(uint32_t address)
 {
-	// Return zero if successful, anything else is an error code.
-	unsigned short status = 0;
-
 	uint16_t volatile * flashBase = (uint16_t*)address;
 
 	// Tell the chip to erase the given block.
 	SIM_CSOR0 = 0x7060;
-	COMMAND_REG_AAA = 0xAAAA;
-	COMMAND_REG_554 = 0x5555;
-	COMMAND_REG_AAA = 0x8080;
-	COMMAND_REG_AAA = 0xAAAA;
-	COMMAND_REG_554 = 0x5555;
+	FLASH_WRITE(COMMAND_REG_AAA, 0xAAAA);
+	FLASH_WRITE(COMMAND_REG_554, 0x5555);
+	FLASH_WRITE(COMMAND_REG_AAA, 0x8080);
+	FLASH_WRITE(COMMAND_REG_AAA, 0xAAAA);
+	FLASH_WRITE(COMMAND_REG_554, 0x5555);
 
-	*flashBase = 0x3030;
+	FLASH_WRITE(flashBase, 0x3030);
+}
 
-	uint16_t read1 = 0;
-	uint16_t read2 = 0;
+///////////////////////////////////////////////////////////////////////////////
+// Add another block to an erase started by Amd_StartErase. The chip only takes
+// more blocks until 50us after the last one, then it starts erasing and DQ3
+// goes high. Returns zero if the block might not have been added.
+///////////////////////////////////////////////////////////////////////////////
+int Amd_QueueErase(uint32_t address)
+{
+	uint16_t volatile * flashBase = (uint16_t*)address;
 
-	for (int iterations = 0; iterations < 0x640000; iterations++)
+	if ((FLASH_READ(flashBase) & 0x08) != 0)
 	{
-		read1 = *flashBase & 0x40;
+		return 0;
+	}
 
-		ScratchWatchdog();
+	FLASH_WRITE(flashBase, 0x3030);
 
-		read2 = *flashBase & 0x40;
+	// The data sheet says to check again, in case the window closed just
+	// before the write. Erasing the block later is harmless either way.
+	return (FLASH_READ(flashBase) & 0x08) == 0;
+}
 
-		if (read1 == read2)
-		{
-			// Success!
-			break;
-		}
+///////////////////////////////////////////////////////////////////////////////
+// Check on an erase started by Amd_StartErase. Returns FlashEraseBusy while
+// the chip is still erasing. Otherwise the chip is back in read-array mode,
+// and the result is the same as Amd_EraseBlock's.
+///////////////////////////////////////////////////////////////////////////////
+uint8_t Amd_PollErase(uint32_t address, int giveUp)
+{
+	// Return zero if successful, anything else is an error code.
+	unsigned short status = 0;
 
-		uint16_t read3 = *flashBase & 0x20;
-		if (read3 == 0)
-		{
-			continue;
-		}
+	uint16_t volatile * flashBase = (uint16_t*)address;
 
-		status = 0xA0;
-		break;
-	}
+	PerfCount(PerfErasePolls);
+
+	// DQ6 toggles on every read until the erase is done.
+	uint16_t read1 = FLASH_READ(flashBase) & 0x40;
+	uint16_t read2 = FLASH_READ(flashBase) & 0x40;
 
-	if (status == 0xA0)
+	if (read1 != read2)
 	{
-		read1 = *flashBase & 0x40;
-		read2 = *flashBase & 0x40;
-		if (read1 != read2)
+		// DQ5 means the chip has exceeded its own time limit. Check DQ6
+		// once more, in case the erase finished at the same moment.
+		if ((FLASH_READ(flashBase) & 0x20) != 0)
 		{
-			status = 0xB0;
+			read1 = FLASH_READ(flashBase) & 0x40;
+			read2 = FLASH_READ(flashBase) & 0x40;
+			if (read1 != read2)
+			{
+				status = 0xB0;
+			}
+		}
+		else if (!giveUp)
+		{
+			return FlashEraseBusy;
 		}
 		else
 		{
-			// Success!
-			status = 0;
+			// Make sure a timeout is never mistaken for success.
+			status = 0xAA;
 		}
 	}
 
 	// Return to array mode.
-	*flashBase = 0xF0F0;
-	*flashBase = 0xF0F0;
+	FLASH_WRITE(flashBase, 0xF0F0);
+	FLASH_WRITE(flashBase, 0xF0F0);
 	SIM_CSOR0 = 0x1060;
 
 	return status;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Write data to flash memory.
-// This is invoked by HandleWriteMode36 in common-readwrite.c
+// Erase the given block.
 ///////////////////////////////////////////////////////////////////////////////
-uint8_t Amd_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes, int testWrite)
+uint8_t Amd_EraseBlock(uint32_t address)
 {
-	char errorCode = 0;
-	unsigned short status;
+	Amd_StartErase(address);
+
+	uint8_t status = FlashEraseBusy;
+	for (int iterations = 0; status == FlashEraseBusy; iterations++)
+	{
+		ScratchWatchdog();
+		DlcService();
+		status = Amd_PollErase(address, iterations >= FlashEraseTimeout);
+	}
 
+	return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Wait for a word to be programmed. Returns 1 on success, 0 on timeout.
+///////////////////////////////////////////////////////////////////////////////
+static int Amd_WaitForWord(unsigned short volatile *address, unsigned short value, int testWrite)
+{
+	if (!testWrite)
+	{
+		PerfCount(PerfFlashWords);
+	}
+
+	for (int iterations = 0; iterations < 0x1000; iterations++)
+	{
+		ScratchWatchdog();
+
+		uint16_t read = testWrite ? value : FLASH_READ(address);
+
+		if (read == value)
+		{
+			if (!testWrite)
+			{
+				PerfAdd(PerfFlashPolls, iterations + 1);
+			}
+
+			return 1;
+		}
+	}
+
+	PerfAdd(PerfFlashPolls, 0x1000);
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Get the chip ready for one or more calls to Amd_ProgramWords.
+//
+// When unlockBypass is set, the chip is switched into unlock bypass mode, and
+// each word then only needs the two-cycle A0/data program sequence instead of
+// the full three-cycle unlock. Flash jobs do this once for the whole write,
+// rather than once per chunk. Reads still return the array in bypass mode.
+///////////////////////////////////////////////////////////////////////////////
+void Amd_StartProgramming(int unlockBypass)
+{
+	SIM_CSOR0 = 0x7060;
+
+	if (unlockBypass)
+	{
+		FLASH_WRITE(COMMAND_REG_AAA, 0xAAAA);
+		FLASH_WRITE(COMMAND_REG_554, 0x5555);
+		FLASH_WRITE(COMMAND_REG_AAA, 0x2020);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Return the chip to read-array mode after programming.
+///////////////////////////////////////////////////////////////////////////////
+void Amd_EndProgramming(int unlockBypass)
+{
+	FLASH_WRITE(FLASH_BASE, 0xF0F0);
+
+	if (unlockBypass)
+	{
+		// Exit unlock bypass mode. The reset command above only returns a
+		// chip that reported an error to bypass mode, not to read mode.
+		FLASH_WRITE(FLASH_BASE, 0x9090);
+		FLASH_WRITE(FLASH_BASE, 0x0000);
+	}
+
+	FLASH_WRITE(FLASH_BASE, 0xF0F0);
+	SIM_CSOR0 = 0x1060;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Program a range of words, after Amd_StartProgramming. If a word fails, the
+// chip is reset, and Amd_EndProgramming must still be called.
+///////////////////////////////////////////////////////////////////////////////
+uint8_t Amd_ProgramWords(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes, int unlockBypass)
+{
 	unsigned short* payloadArray = (unsigned short*) payloadBytes;
 	unsigned short* flashArray = (unsigned short*) startAddress;
 
@@ -122,53 +226,57 @@ uint8_t Amd_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int startAd
 		unsigned short volatile  *address = &(flashArray[index]);
 		unsigned short value = payloadArray[index];
 
-		if (!testWrite)
+		DlcService();
+
+		if (unlockBypass)
 		{
-			SIM_CSOR0 = 0x7060;
-			COMMAND_REG_AAA = 0xAAAA;
-			COMMAND_REG_554 = 0x5555;
-			COMMAND_REG_AAA = 0xA0A0;
-			*address = value;
+			FLASH_WRITE(address, 0xA0A0);
+			FLASH_WRITE(address, value);
 		}
-
-		char success = 0;
-		for(int iterations = 0; iterations < 0x1000; iterations++)
+		else
 		{
-			ScratchWatchdog();
-
-			uint16_t read = testWrite ? value : *address;
-
-			if (read == value)
-			{
-				success = 1;
-				break;
-			}
+			FLASH_WRITE(COMMAND_REG_AAA, 0xAAAA);
+			FLASH_WRITE(COMMAND_REG_554, 0x5555);
+			FLASH_WRITE(COMMAND_REG_AAA, 0xA0A0);
+			FLASH_WRITE(address, value);
 		}
 
-		if (!success)
+		if (!Amd_WaitForWord(address, value, 0))
 		{
-			// Return flash to normal mode and return the error code.
-			errorCode = 0xAA;
+			FLASH_WRITE(address, 0xF0F0);
+			return 0xAA;
+		}
+	}
 
-			if (!testWrite)
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Write data to flash memory.
+// This is invoked by HandleWriteMode36 in common-readwrite.c
+//
+// Chips that do not support unlock bypass mode get the full unlock sequence
+// for every word, see Amd_StartProgramming.
+///////////////////////////////////////////////////////////////////////////////
+uint8_t Amd_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes, int testWrite, int unlockBypass)
+{
+	if (testWrite)
+	{
+		unsigned short* payloadArray = (unsigned short*) payloadBytes;
+		for (unsigned index = 0; index < payloadLengthInBytes / 2; index++)
+		{
+			DlcService();
+			if (!Amd_WaitForWord(0, payloadArray[index], 1))
 			{
-				*address = 0xF0F0;
-				*address = 0xF0F0;
-				SIM_CSOR0 = 0x1060;
+				return 0xAA;
 			}
-
-			return errorCode;
 		}
-	}
 
-	if (!testWrite)
-	{
-		// Return flash to normal mode.
-		unsigned short* address = (unsigned short*)startAddress;
-		*address = 0xF0F0;
-		*address = 0xF0F0;
-		SIM_CSOR0 = 0x1060;
+		return 0;
 	}
 
-	return 0;
+	Amd_StartProgramming(unlockBypass);
+	uint8_t result = Amd_ProgramWords(payloadLengthInBytes, startAddress, payloadBytes, unlockBypass);
+	Amd_EndProgramming(unlockBypass);
+	return result;
 }
@@ -27,7 +27,7 @@ void FlashUnlock(bool unlock)
 		HARDWARE_IO &= 0xFFFE;
 	}
 	// P01 Critical
-	VariableSleep(0x50);
+	MicroSleep(160 * 1000);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -42,13 +42,13 @@ uint32_t Intel_GetFlashId()
 	SIM_CSOR0 = 0x7060;
 
 	// Switch the flash into ID-query mode
-	FLASH_BASE = SIGNATURE_COMMAND;
+	FLASH_WRITE(FLASH_BASE, SIGNATURE_COMMAND);
 
 	// Read the identifier from address zero.
 	uint32_t id = FLASH_IDENTIFIER;
 
 	// Switch back to standard mode
-	FLASH_BASE = READ_ARRAY_COMMAND;
+	FLASH_WRITE(FLASH_BASE, READ_ARRAY_COMMAND);
 
 	SIM_CSOR0 = 0x1060; // flash chip 12v A9 disable
 
@@ -56,34 +56,48 @@ uint32_t Intel_GetFlashId()
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Erase the given block.
+// Start erasing the given block. Intel_PollErase says when it's done.
 ///////////////////////////////////////////////////////////////////////////////
-uint8_t Intel_EraseBlock(uint32_t address)
+void Intel_StartErase(uint32_t address)
 {
-	unsigned short status = 0;
-
 	FlashUnlock(true);
 
 	uint16_t *flashBase = (uint16_t*)address;
-	*flashBase = 0x5050; // TODO: Move these commands to defines
-	*flashBase = 0x2020;
-	*flashBase = 0xD0D0;
-	*flashBase = 0x7070;
+	FLASH_WRITE(flashBase, 0x5050); // TODO: Move these commands to defines
+	FLASH_WRITE(flashBase, 0x2020);
+	FLASH_WRITE(flashBase, 0xD0D0);
+	FLASH_WRITE(flashBase, 0x7070);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Check on an erase started by Intel_StartErase. Returns FlashEraseBusy while
+// the chip is still erasing. Otherwise the chip is back in read-array mode,
+// and the result is the same as Intel_EraseBlock's.
+///////////////////////////////////////////////////////////////////////////////
+uint8_t Intel_PollErase(uint32_t address, int giveUp)
+{
+	uint16_t *flashBase = (uint16_t*)address;
+	unsigned short status = FLASH_READ(flashBase);
 
-	for (int iterations = 0; iterations < 0x640000; iterations++)
+	PerfCount(PerfErasePolls);
+
+	if ((status & 0x80) == 0)
 	{
-		ScratchWatchdog();
-		status = *flashBase;
-		if ((status & 0x80) != 0)
+		if (!giveUp)
 		{
-			break;
+			return FlashEraseBusy;
 		}
-	}
 
-	status &= 0x00E8;
+		// Make sure a timeout is never mistaken for success.
+		status = 0xAA;
+	}
+	else
+	{
+		status &= 0x00E8;
+	}
 
-	*flashBase = READ_ARRAY_COMMAND;
-	*flashBase = READ_ARRAY_COMMAND;
+	FLASH_WRITE(flashBase, READ_ARRAY_COMMAND);
+	FLASH_WRITE(flashBase, READ_ARRAY_COMMAND);
 
 	FlashUnlock(false);
 
@@ -97,50 +111,80 @@ uint8_t Intel_EraseBlock(uint32_t address)
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Write data to flash memory.
-// This is invoked by HandleWriteMode36 in common-readwrite.c
-// read-kernel.c has a stub to keep the compiler happy until this is released.
+// Erase the given block.
 ///////////////////////////////////////////////////////////////////////////////
-uint8_t Intel_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes, int testWrite)
+uint8_t Intel_EraseBlock(uint32_t address)
 {
-	char errorCode = 0;
-	unsigned short status;
+	Intel_StartErase(address);
 
-	if (!testWrite)
+	uint8_t status = FlashEraseBusy;
+	for (int iterations = 0; status == FlashEraseBusy; iterations++)
 	{
-		FlashUnlock(true);
+		ScratchWatchdog();
+		DlcService();
+		status = Intel_PollErase(address, iterations >= FlashEraseTimeout);
 	}
 
+	return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Turn on the programming voltage and clear the status register, before one
+// or more calls to Intel_ProgramWords. The 12v supply takes 160ms to settle
+// each way, so a flash job does this once rather than once per chunk.
+///////////////////////////////////////////////////////////////////////////////
+void Intel_StartProgramming(unsigned int startAddress)
+{
+	FlashUnlock(true);
+	FLASH_WRITE(startAddress, 0x5050); // Clear status register
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Turn off the programming voltage after Intel_ProgramWords.
+///////////////////////////////////////////////////////////////////////////////
+void Intel_EndProgramming()
+{
+	FlashUnlock(false);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Program a range of words, with programming voltage already on.
+//
+// The 28F400B and 28F800B boot-block parts do not have the write-to-buffer
+// command, so each word still gets its own program command. The status
+// register is only cleared when programming starts, since its error bits are
+// sticky, and the chip returns status after a program command without needing
+// 0x70. The chip is back in read-array mode when this returns.
+///////////////////////////////////////////////////////////////////////////////
+uint8_t Intel_ProgramWords(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes)
+{
+	unsigned short status = 0x80;
+
 	unsigned short* payloadArray = (unsigned short*) payloadBytes;
 	unsigned short* flashArray = (unsigned short*) startAddress;
 
 	for (unsigned index = 0; index < payloadLengthInBytes / 2; index++)
 	{
-		unsigned short *address = &(flashArray[index]);
+		unsigned short volatile *address = &(flashArray[index]);
 		unsigned short value = payloadArray[index];
 
-		if (!testWrite)
-		{
-			*address = 0x5050; // Clear status register TODO: use #define
-			*address = 0x4040; // Program setup
-			*address = value;  // Program
-			*address = 0x7070; // Prepare to read status register
-		}
+		DlcService();
+
+		FLASH_WRITE(address, 0x4040); // Program setup
+		FLASH_WRITE(address, value);  // Program
 
+		// Programming a word takes microseconds, so the watchdog only needs
+		// to be scratched occasionally while polling.
 		char success = 0;
-		for(int iterations = 0; iterations < 0x1000; iterations++)
+		int iterations;
+		for (iterations = 0; iterations < 0x8000; iterations++)
 		{
-			if  (testWrite)
-			{
-				status = 0x80;
-			}
-			else
+			if ((iterations & 0xFF) == 0)
 			{
-				status = *address;
+				ScratchWatchdog();
 			}
 
-			ScratchWatchdog();
-
+			status = FLASH_READ(address);
 			if (status & 0x80)
 			{
 				success = 1;
@@ -148,37 +192,57 @@ uint8_t Intel_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int start
 			}
 		}
 
-		if (!success)
+		PerfCount(PerfFlashWords);
+		PerfAdd(PerfFlashPolls, iterations + success);
+
+		if (!success || (status & 0x18))
 		{
 			// Return flash to normal mode and return the error code.
-			errorCode = status;
-
-			if (!testWrite)
-			{
-				*address = 0xFFFF;
-				*address = 0xFFFF;
-				FlashUnlock(false);
-			}
+			FLASH_WRITE(address, 0xFFFF);
+			FLASH_WRITE(address, 0xFFFF);
 
-			return errorCode;
+			// A timeout can leave all of the status bits clear, which would
+			// look like success to the caller.
+			return (status & 0xFF) ? status : 0xAA;
 		}
 	}
 
-	if (!testWrite)
-	{
-		// Return flash to normal mode.
-		unsigned short* address = (unsigned short*)startAddress;
-		*address = 0xFFFF;
-		*address = 0xFFFF;
-		FlashUnlock(false);
-	}
+	// Return flash to normal mode.
+	FLASH_WRITE(startAddress, 0xFFFF);
+	FLASH_WRITE(startAddress, 0xFFFF);
 
 	// Check the last value we got from the status register.
 	if ((status & 0x98) != 0x80)
 	{
-		errorCode = status;
+		return status;
 	}
 
-	return errorCode;
+	return 0;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Write data to flash memory.
+// This is invoked by HandleWriteMode36 in common-readwrite.c
+// read-kernel.c has a stub to keep the compiler happy until this is released.
+//
+// This turns the programming voltage on and off around the write. Flash jobs
+// use Intel_StartProgramming and Intel_ProgramWords directly, so that the
+// voltage stays on from one chunk to the next.
+///////////////////////////////////////////////////////////////////////////////
+uint8_t Intel_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes, int testWrite)
+{
+	if (testWrite)
+	{
+		for (unsigned index = 0; index < payloadLengthInBytes / 2; index++)
+		{
+			DlcService();
+		}
+
+		return 0;
+	}
+
+	Intel_StartProgramming(startAddress);
+	uint8_t result = Intel_ProgramWords(payloadLengthInBytes, startAddress, payloadBytes);
+	Intel_EndProgramming();
+	return result;
+}
@@ -2,6 +2,8 @@
 // Functions for erasing and writing flash
 ///////////////////////////////////////////////////////////////////////////////
 
+// The host simulator (see simulator.h) defines its own versions of these.
+#ifndef SIM_BASE
 #define SIM_BASE        0x00FFFA00
 #define SIM_CSBARBT     (*(unsigned short *)(SIM_BASE + 0x48)) // CSRBASEREG, boot chip select, chip select base addr boot ROM reg,
 															   // must be updated to $0006 on each update of flash CE/WE states
@@ -9,11 +11,24 @@
 #define SIM_CSBAR0      (*(unsigned short *)(SIM_BASE + 0x4c)) // CSBASEREG, chip selects
 #define SIM_CSOR0       (*(unsigned short *)(SIM_BASE + 0x4e)) // CSOPREG, *Chip select option reg., $1060 for normal op, $7060 for accessing flash chip
 #define HARDWARE_IO     (*(unsigned short *)(0xFFFFE2FA))      // Hardware I/O reg
+#endif
 
-#define FLASH_BASE         (*(unsigned short *)(0x00000000))
-#define FLASH_IDENTIFIER   (*(uint32_t *)(0x00000000))
-#define FLASH_MANUFACTURER (*(uint16_t *)(0x00000000))
-#define FLASH_DEVICE       (*(uint16_t *)(0x00000002))
+// All access to the flash chip goes through these, so that the host simulator
+// can stand in for the chip.
+#ifndef FLASH_READ
+#define FLASH_READ(address)         (*(volatile uint16_t *)(address))
+#define FLASH_WRITE(address, value) (*(volatile uint16_t *)(address) = (value))
+#endif
+
+// Flash contents in read-array mode, for code that reads a whole range back.
+#ifndef FLASH_ARRAY
+#define FLASH_ARRAY(address)        ((unsigned char *)(address))
+#endif
+
+#define FLASH_BASE         0x00000000
+#define FLASH_MANUFACTURER FLASH_READ(0x00000000)
+#define FLASH_DEVICE       FLASH_READ(0x00000002)
+#define FLASH_IDENTIFIER   (((uint32_t)FLASH_MANUFACTURER << 16) | FLASH_DEVICE)
 
 #define SIGNATURE_COMMAND  0x9090
 #define READ_ARRAY_COMMAND 0xFFFF
@@ -45,17 +60,35 @@ char volatile * const  SIM_CSOR6    =   SIM_BASE + 0x66;*/
 // true to unlock, false to lock.
 void FlashUnlock(bool unlock);
 
+// Erase can run in the background: start it, then poll until the result is
+// something other than FlashEraseBusy. A poll with giveUp set always returns
+// a result. The EraseBlock functions do all of that in one call, and give up
+// after FlashEraseTimeout polls.
+#define FlashEraseBusy    0xFF
+#define FlashEraseTimeout 0x640000
+
 // Functions prefixed with Intel512 work with this chip ID
 #define FLASH_ID_INTEL_512  0x00894471
 #define FLASH_ID_INTEL_1024 0x0089889D
 
 uint32_t Intel_GetFlashId();
 uint8_t Intel_EraseBlock(uint32_t address);
+void Intel_StartErase(uint32_t address);
+uint8_t Intel_PollErase(uint32_t address, int giveUp);
 uint8_t Intel_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes, int testWrite);
+void Intel_StartProgramming(unsigned int startAddress);
+uint8_t Intel_ProgramWords(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes);
+void Intel_EndProgramming();
 
 // Functions prefixed with Amd1024 work with this chip ID
 #define FLASH_ID_AMD_1024  0x00012258
 
 uint32_t Amd_GetFlashId();
 uint8_t Amd_EraseBlock(uint32_t address);
-uint8_t Amd_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes, int testWrite);
+void Amd_StartErase(uint32_t address);
+int Amd_QueueErase(uint32_t address);
+uint8_t Amd_PollErase(uint32_t address, int giveUp);
+uint8_t Amd_WriteToFlash(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes, int testWrite, int unlockBypass);
+void Amd_StartProgramming(int unlockBypass);
+uint8_t Amd_ProgramWords(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes, int unlockBypass);
+void Amd_EndProgramming(int unlockBypass);
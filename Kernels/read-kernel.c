@@ -29,7 +29,18 @@ void ProcessMessage()
 		break;
 
 	case 0x35:
-		HandleReadMode35();
+		if (MessageBuffer[4] == 0x02)
+		{
+			HandleReadMode35Compressed();
+		}
+		else if (MessageBuffer[4] == 0x03)
+		{
+			HandleReadMode35Stream();
+		}
+		else
+		{
+			HandleReadMode35();
+		}
 		break;
 
 	case 0x36:
@@ -49,6 +60,18 @@ void ProcessMessage()
 		{
 			HandleVersionQuery(0xAA);
 		}
+		else if (MessageBuffer[4] == 0x07)
+		{
+			HandleBlankMapQuery();
+		}
+		else if (MessageBuffer[4] == 0x0A)
+		{
+			HandleTurnaroundQuery();
+		}
+		else if (MessageBuffer[4] == 0x0B)
+		{
+			HandlePerfCounterQuery();
+		}
 		else
 		{
 			SendToolPresent(
@@ -77,6 +100,19 @@ unsigned char WriteToFlash(const unsigned length, const unsigned startAddress, u
 	// This space intentionally left blank.
 }
 
+void FlashWriteStart(const unsigned startAddress)
+{
+}
+
+unsigned char FlashWriteWords(const unsigned length, const unsigned startAddress, unsigned char *data)
+{
+	// This space intentionally left blank.
+}
+
+void FlashWriteEnd()
+{
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // This is the entry point for the kernel.
 ///////////////////////////////////////////////////////////////////////////////
@@ -90,17 +126,21 @@ KernelStart(void)
 	ScratchWatchdog();
 
 	DLC_INTERRUPTCONFIGURATION = 0x00;
-	LongSleepWithWatchdog();
+	MicroSleep(500 * 1000);
 
 	// Flush the DLC
 	DLC_TRANSMIT_COMMAND = 0x03;
 	DLC_TRANSMIT_FIFO = 0x00;
+	DlcResetReceiveRing();
+	turnaroundMicroseconds = ElmTurnaroundMicroseconds;
+	PerfReset();
+	FlashJobReset();
 
 	ClearMessageBuffer();
 	WasteTime();
 
 	SendToolPresent(0, 0, 0, 0);
-	LongSleepWithWatchdog();
+	MicroSleep(500 * 1000);
 
 	// If we choose to loop forever we need a good story for how to get out of that state.
 	// Pull the PCM fuse? Give the app button to tell the kernel to reboot?
@@ -139,16 +179,17 @@ KernelStart(void)
 		if (readState != 1)
 		{
 			SendToolPresent(0xBB, 0xBB, readState, readState);
-			LongSleepWithWatchdog();
+			MicroSleep(500 * 1000);
 			continue;
 		}
 
 		lastMessage = iterations;
+		PerfCount(PerfMessages);
 
 		// Did the tool just request a reboot?
 		if (MessageBuffer[3] == 0x20)
 		{
-			LongSleepWithWatchdog();
+			MicroSleep(500 * 1000);
 			Reboot(0xCC000000 | iterations);
 		}
 
@@ -0,0 +1,824 @@
+///////////////////////////////////////////////////////////////////////////////
+// A host model of the PCM hardware that the kernel talks to. See simulator.h.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+#include "common.h"
+#include "flash.h"
+
+// What a register access costs, roughly, including the instructions around
+// it. Bus-cycle timing for the 68332 is more detailed than this.
+#define SimulatorAccessCycles 12
+
+// VPW bytes take 8 bits at an average of 96 microseconds per bit at 1x.
+#define SimulatorByteCycles1x (8 * 96 * SystemClockMhz)
+#define SimulatorByteCycles4x (SimulatorByteCycles1x / 4)
+
+// The DLC FIFOs hold 12 bytes. The status register says "almost full" when
+// there's room for 3 more.
+#define SimulatorFifoSize 12
+#define SimulatorFifoAlmostFull 9
+
+#define SimulatorCompletionCode 0x100
+#define SimulatorWireSize (MessageBufferSize + 16)
+
+// Typical times from the data sheets.
+#define SimulatorIntelProgramCycles (9 * SystemClockMhz)
+#define SimulatorIntelEraseCycles (500 * 1000 * SystemClockMhz)
+#define SimulatorAmdProgramCycles (7 * SystemClockMhz)
+#define SimulatorAmdEraseCycles (700 * 1000 * SystemClockMhz)
+#define SimulatorAmdEraseWindowCycles (50 * SystemClockMhz)
+
+#define SimulatorFlashMaxSize (1024 * 1024)
+
+SimulatorCounters simulatorCounters;
+unsigned char simulatorWatchdog2;
+unsigned short simulatorChipSelect[4];
+unsigned short simulatorHardwareIo;
+
+///////////////////////////////////////////////////////////////////////////////
+// Register writes land here, see SimulatorRegisterWrite.
+///////////////////////////////////////////////////////////////////////////////
+static unsigned pendingAddress;
+static unsigned char pendingValue;
+static unsigned char readValue;
+
+///////////////////////////////////////////////////////////////////////////////
+// DLC state.
+///////////////////////////////////////////////////////////////////////////////
+static unsigned long long byteCycles;
+
+static int transmitCount;
+static unsigned long long transmitDoneAt;
+static unsigned char transmitCommand;
+static unsigned char transmitFrame[SimulatorWireSize];
+static int transmitLength;
+static unsigned char lastFrame[SimulatorWireSize];
+static int lastFrameLength;
+
+static unsigned short wire[SimulatorWireSize];
+static unsigned long long wireArrival[SimulatorWireSize];
+static int wireHead;
+static int wireTail;
+
+static unsigned short receiveFifo[SimulatorFifoSize];
+static int receiveCount;
+static int receiveOverflow;
+
+///////////////////////////////////////////////////////////////////////////////
+// Flash state.
+///////////////////////////////////////////////////////////////////////////////
+typedef enum
+{
+	ReadArray,
+	ReadStatus,
+	ReadId,
+	IntelProgramSetup,
+	IntelEraseSetup,
+	AmdUnlock1,
+	AmdUnlock2,
+	AmdProgram,
+	AmdEraseSetup,
+	AmdEraseUnlock1,
+	AmdEraseUnlock2,
+	AmdBypassProgram,
+	AmdBypassExit,
+} FlashMode;
+
+static unsigned flashId;
+static unsigned flashSize;
+static unsigned short flashArray[SimulatorFlashMaxSize / 2];
+static FlashMode flashMode;
+static int amdBypass;
+static unsigned long long flashBusyUntil;
+static unsigned long long amdEraseWindowEnd;
+static unsigned short intelStatus;
+static unsigned short amdExpected;
+static unsigned short amdToggle;
+
+// Block sizes in kb, lowest address first, for the bottom-boot parts.
+static const unsigned short intelBlocks[] = { 16, 8, 8, 96, 128, 128, 128, 128, 128, 128, 128, 0 };
+static const unsigned short amdBlocks[] = { 16, 8, 8, 32, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 0 };
+
+///////////////////////////////////////////////////////////////////////////////
+// Start over with an idle bus and an erased flash chip.
+///////////////////////////////////////////////////////////////////////////////
+void SimulatorReset(unsigned id, int fourX)
+{
+	memset(&simulatorCounters, 0, sizeof(simulatorCounters));
+	pendingAddress = 0;
+
+	byteCycles = fourX ? SimulatorByteCycles4x : SimulatorByteCycles1x;
+	transmitCount = 0;
+	transmitCommand = 0;
+	transmitLength = 0;
+	lastFrameLength = 0;
+	wireHead = 0;
+	wireTail = 0;
+	receiveCount = 0;
+	receiveOverflow = 0;
+
+	flashId = id;
+	flashSize = (id == FLASH_ID_INTEL_512) ? 512 * 1024 : 1024 * 1024;
+	memset(flashArray, 0xFF, sizeof(flashArray));
+	flashMode = ReadArray;
+	amdBypass = 0;
+	flashBusyUntil = 0;
+	amdEraseWindowEnd = 0;
+	intelStatus = 0x80;
+
+	simulatorChipSelect[3] = 0x1060;
+	simulatorHardwareIo = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Let time pass on the bus: bytes leave the transmit FIFO and arrive in the
+// receive FIFO.
+///////////////////////////////////////////////////////////////////////////////
+static void Advance(unsigned long long cycles)
+{
+	simulatorCounters.cycles += cycles;
+
+	while ((transmitCount > 0) && (simulatorCounters.cycles >= transmitDoneAt))
+	{
+		transmitCount--;
+		transmitDoneAt += byteCycles;
+	}
+
+	while ((wireTail != wireHead) && (simulatorCounters.cycles >= wireArrival[wireTail]))
+	{
+		if (receiveCount == SimulatorFifoSize)
+		{
+			simulatorCounters.receiveOverruns++;
+			receiveOverflow = 1;
+			receiveCount = 0;
+		}
+		else
+		{
+			receiveFifo[receiveCount++] = wire[wireTail];
+		}
+
+		wireTail++;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Put a message on the bus.
+///////////////////////////////////////////////////////////////////////////////
+void SimulatorQueueMessage(const unsigned char *message, int length)
+{
+	unsigned long long arrival = simulatorCounters.cycles;
+	if (wireTail == wireHead)
+	{
+		wireHead = 0;
+		wireTail = 0;
+	}
+
+	for (int index = 0; (index <= length) && (wireHead < SimulatorWireSize); index++)
+	{
+		arrival += byteCycles;
+		wire[wireHead] = (index == length) ? SimulatorCompletionCode : message[index];
+		wireArrival[wireHead] = arrival;
+		wireHead++;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The last frame that the kernel finished sending.
+///////////////////////////////////////////////////////////////////////////////
+int SimulatorLastFrame(const unsigned char **frame)
+{
+	*frame = lastFrame;
+	return lastFrameLength;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A byte written to the transmit FIFO.
+///////////////////////////////////////////////////////////////////////////////
+static void TransmitByte(unsigned char value)
+{
+	unsigned char command = transmitCommand;
+	transmitCommand = 0;
+
+	// The flush command's data byte doesn't go on the wire.
+	if (command == 0x03)
+	{
+		return;
+	}
+
+	if (transmitCount == SimulatorFifoSize)
+	{
+		simulatorCounters.transmitOverruns++;
+		return;
+	}
+
+	if (transmitCount++ == 0)
+	{
+		transmitDoneAt = simulatorCounters.cycles + byteCycles;
+	}
+
+	if (transmitLength < SimulatorWireSize)
+	{
+		transmitFrame[transmitLength++] = value;
+	}
+
+	// 0x0C marks the last byte of the frame.
+	if (command == 0x0C)
+	{
+		memcpy(lastFrame, transmitFrame, transmitLength);
+		lastFrameLength = transmitLength;
+		transmitLength = 0;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Act on the last register write.
+///////////////////////////////////////////////////////////////////////////////
+static void FinishWrite()
+{
+	unsigned address = pendingAddress;
+	pendingAddress = 0;
+
+	switch (address)
+	{
+	case 0xFFF60C:
+		if (pendingValue == 0x14)
+		{
+			transmitLength = 0;
+		}
+		else if (pendingValue != 0x02)
+		{
+			transmitCommand = pendingValue;
+		}
+		break;
+
+	case 0xFFF60D:
+		TransmitByte(pendingValue);
+		break;
+
+	case 0xFFFA27:
+		if (pendingValue == 0xAA)
+		{
+			simulatorCounters.watchdogScratches++;
+		}
+		break;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the slot that a register write goes into.
+///////////////////////////////////////////////////////////////////////////////
+unsigned char *SimulatorRegisterWrite(unsigned address)
+{
+	if (pendingAddress != 0)
+	{
+		FinishWrite();
+	}
+
+	simulatorCounters.registerAccesses++;
+	Advance(SimulatorAccessCycles);
+
+	pendingAddress = address;
+	pendingValue = 0;
+	return &pendingValue;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The receive half of the DLC status register, from the DLC data sheet.
+///////////////////////////////////////////////////////////////////////////////
+static unsigned char ReceiveStatus()
+{
+	if (receiveOverflow)
+	{
+		return 3;
+	}
+
+	if (receiveCount == 0)
+	{
+		return 0;
+	}
+
+	if (receiveFifo[0] & SimulatorCompletionCode)
+	{
+		if (receiveCount == 1)
+		{
+			return 7;
+		}
+
+		for (int index = 1; index < receiveCount; index++)
+		{
+			if (receiveFifo[index] & SimulatorCompletionCode)
+			{
+				return 6;
+			}
+		}
+
+		return 5;
+	}
+
+	if (receiveCount == 1)
+	{
+		return 4;
+	}
+
+	for (int index = 1; index < receiveCount; index++)
+	{
+		if (receiveFifo[index] & SimulatorCompletionCode)
+		{
+			return 2;
+		}
+	}
+
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Returns the current value of a register.
+///////////////////////////////////////////////////////////////////////////////
+unsigned char *SimulatorRegisterRead(unsigned address)
+{
+	if (pendingAddress != 0)
+	{
+		FinishWrite();
+	}
+
+	simulatorCounters.registerAccesses++;
+	Advance(SimulatorAccessCycles);
+
+	readValue = 0;
+	if (address == 0xFFF60E)
+	{
+		simulatorCounters.statusPolls++;
+
+		unsigned char transmitStatus = 0;
+		if (transmitCount == SimulatorFifoSize)
+		{
+			transmitStatus = 3;
+		}
+		else if (transmitCount >= SimulatorFifoAlmostFull)
+		{
+			transmitStatus = 2;
+		}
+		else if (transmitCount > 0)
+		{
+			transmitStatus = 1;
+		}
+
+		readValue = (ReceiveStatus() << 5) | transmitStatus;
+	}
+	else if (address == 0xFFF60F)
+	{
+		if (receiveOverflow)
+		{
+			receiveOverflow = 0;
+		}
+		else if (receiveCount > 0)
+		{
+			readValue = receiveFifo[0] & 0xFF;
+			receiveCount--;
+			memmove(receiveFifo, receiveFifo + 1, receiveCount * sizeof(receiveFifo[0]));
+		}
+	}
+
+	return &readValue;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DelayLoop passes the time without touching any registers.
+///////////////////////////////////////////////////////////////////////////////
+void SimulatorDelay(unsigned int loops)
+{
+	unsigned long long cycles = (unsigned long long)loops * DelayLoopCycles;
+	simulatorCounters.delayCycles += cycles;
+	Advance(cycles);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Find the erase block that contains the given address.
+///////////////////////////////////////////////////////////////////////////////
+static void FindBlock(unsigned address, unsigned *start, unsigned *size)
+{
+	const unsigned short *blocks = (flashId == FLASH_ID_AMD_1024) ? amdBlocks : intelBlocks;
+	unsigned blockStart = 0;
+	for (int index = 0; blocks[index] != 0; index++)
+	{
+		unsigned blockSize = blocks[index] * 1024;
+		if (address < blockStart + blockSize)
+		{
+			*start = blockStart;
+			*size = blockSize;
+			return;
+		}
+
+		blockStart += blockSize;
+	}
+
+	*start = 0;
+	*size = 0;
+}
+
+static void EraseBlock(unsigned address)
+{
+	unsigned start;
+	unsigned size;
+	FindBlock(address, &start, &size);
+	if (start + size > flashSize)
+	{
+		size = flashSize - start;
+	}
+
+	memset(&flashArray[start / 2], 0xFF, size);
+}
+
+static int FlashBusy()
+{
+	return simulatorCounters.cycles < flashBusyUntil;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Program a word. Flash can only clear bits, so the result is the AND of the
+// old and new values, and the return value says whether that's what was
+// asked for.
+///////////////////////////////////////////////////////////////////////////////
+static int ProgramWord(unsigned address, unsigned short value, unsigned cycles)
+{
+	unsigned short *word = &flashArray[(address % flashSize) / 2];
+	*word &= value;
+	flashBusyUntil = simulatorCounters.cycles + cycles;
+	return *word == value;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The Intel command interface. Only the low byte of a command matters.
+///////////////////////////////////////////////////////////////////////////////
+static void IntelWrite(unsigned address, unsigned short value)
+{
+	unsigned char command = value & 0xFF;
+
+	if (FlashBusy())
+	{
+		if (command == 0x70)
+		{
+			flashMode = ReadStatus;
+		}
+
+		return;
+	}
+
+	switch (flashMode)
+	{
+	case IntelProgramSetup:
+		flashMode = ReadStatus;
+		if ((simulatorHardwareIo & 1) == 0)
+		{
+			// No programming voltage.
+			intelStatus |= 0x18;
+			simulatorCounters.flashCommandErrors++;
+		}
+		else if (!ProgramWord(address, value, SimulatorIntelProgramCycles))
+		{
+			intelStatus |= 0x10;
+			simulatorCounters.flashCommandErrors++;
+		}
+		return;
+
+	case IntelEraseSetup:
+		flashMode = ReadStatus;
+		if (command != 0xD0)
+		{
+			intelStatus |= 0x30;
+			simulatorCounters.flashCommandErrors++;
+		}
+		else if ((simulatorHardwareIo & 1) == 0)
+		{
+			intelStatus |= 0x28;
+			simulatorCounters.flashCommandErrors++;
+		}
+		else
+		{
+			EraseBlock(address);
+			flashBusyUntil = simulatorCounters.cycles + SimulatorIntelEraseCycles;
+		}
+		return;
+
+	default:
+		// Anything else starts a new command.
+		break;
+	}
+
+	switch (command)
+	{
+	case 0xFF:
+		flashMode = ReadArray;
+		break;
+
+	case 0x90:
+		flashMode = ReadId;
+		break;
+
+	case 0x50:
+		intelStatus = 0x80;
+		break;
+
+	case 0x70:
+		flashMode = ReadStatus;
+		break;
+
+	case 0x10:
+	case 0x40:
+		flashMode = IntelProgramSetup;
+		break;
+
+	case 0x20:
+		flashMode = IntelEraseSetup;
+		break;
+
+	default:
+		simulatorCounters.flashCommandErrors++;
+		break;
+	}
+}
+
+static unsigned short IntelRead(unsigned address)
+{
+	switch (flashMode)
+	{
+	case ReadStatus:
+		return FlashBusy() ? (intelStatus & 0x7F) : intelStatus;
+
+	case ReadId:
+		return (address & 2) ? (flashId & 0xFFFF) : (flashId >> 16);
+
+	default:
+		return flashArray[(address % flashSize) / 2];
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The AMD command interface. Only the low byte of a command matters.
+///////////////////////////////////////////////////////////////////////////////
+static void AmdWrite(unsigned address, unsigned short value)
+{
+	unsigned char command = value & 0xFF;
+	unsigned offset = address & 0xFFF;
+
+	// More blocks can be added to an erase until 50us after the last one.
+	// The chip erases them one after another.
+	if (FlashBusy() && (simulatorCounters.cycles < amdEraseWindowEnd) && (command == 0x30))
+	{
+		EraseBlock(address);
+		flashBusyUntil += SimulatorAmdEraseCycles;
+		amdEraseWindowEnd = simulatorCounters.cycles + SimulatorAmdEraseWindowCycles;
+		return;
+	}
+
+	// The chip ignores everything but suspend while it's busy.
+	if (FlashBusy())
+	{
+		return;
+	}
+
+	switch (flashMode)
+	{
+	case AmdProgram:
+	case AmdBypassProgram:
+		flashMode = ReadArray;
+		amdExpected = value;
+		if (!ProgramWord(address, value, SimulatorAmdProgramCycles))
+		{
+			simulatorCounters.flashCommandErrors++;
+		}
+		return;
+
+	case AmdBypassExit:
+		amdBypass = (command != 0x00);
+		flashMode = ReadArray;
+		return;
+
+	case AmdUnlock1:
+		flashMode = ((offset == 0x554) && (command == 0x55)) ? AmdUnlock2 : ReadArray;
+		return;
+
+	case AmdUnlock2:
+		flashMode = ReadArray;
+		if (offset != 0xAAA)
+		{
+			break;
+		}
+
+		switch (command)
+		{
+		case 0x90:
+			flashMode = ReadId;
+			return;
+
+		case 0xA0:
+			flashMode = AmdProgram;
+			return;
+
+		case 0x80:
+			flashMode = AmdEraseSetup;
+			return;
+
+		case 0x20:
+			amdBypass = 1;
+			return;
+		}
+		break;
+
+	case AmdEraseSetup:
+		flashMode = ((offset == 0xAAA) && (command == 0xAA)) ? AmdEraseUnlock1 : ReadArray;
+		return;
+
+	case AmdEraseUnlock1:
+		flashMode = ((offset == 0x554) && (command == 0x55)) ? AmdEraseUnlock2 : ReadArray;
+		return;
+
+	case AmdEraseUnlock2:
+		flashMode = ReadArray;
+		if (command == 0x30)
+		{
+			EraseBlock(address);
+			amdExpected = 0xFFFF;
+			flashBusyUntil = simulatorCounters.cycles + SimulatorAmdEraseCycles;
+			amdEraseWindowEnd = simulatorCounters.cycles + SimulatorAmdEraseWindowCycles;
+			return;
+		}
+		break;
+
+	default:
+		if (amdBypass)
+		{
+			if (command == 0xA0)
+			{
+				flashMode = AmdBypassProgram;
+			}
+			else if (command == 0x90)
+			{
+				flashMode = AmdBypassExit;
+			}
+
+			// Reset leaves the chip in bypass mode.
+			return;
+		}
+
+		if (command == 0xF0)
+		{
+			flashMode = ReadArray;
+			return;
+		}
+
+		if ((offset == 0xAAA) && (command == 0xAA))
+		{
+			flashMode = AmdUnlock1;
+			return;
+		}
+		break;
+	}
+
+	simulatorCounters.flashCommandErrors++;
+}
+
+static unsigned short AmdRead(unsigned address)
+{
+	// While busy, DQ7 is the complement of the data being written and DQ6
+	// toggles on every read. During an erase, DQ3 goes high once the chip
+	// stops taking more blocks.
+	if (FlashBusy())
+	{
+		amdToggle ^= 0x40;
+		unsigned short eraseStarted = (simulatorCounters.cycles >= amdEraseWindowEnd) ? 0x08 : 0x00;
+		return (~amdExpected & 0x80) | amdToggle | eraseStarted;
+	}
+
+	if (flashMode == ReadId)
+	{
+		return (address & 2) ? (flashId & 0xFFFF) : (flashId >> 16);
+	}
+
+	return flashArray[(address % flashSize) / 2];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Flash accesses from the drivers, see FLASH_READ and FLASH_WRITE.
+///////////////////////////////////////////////////////////////////////////////
+unsigned short SimulatorFlashRead(unsigned long address)
+{
+	simulatorCounters.registerAccesses++;
+	simulatorCounters.flashReads++;
+	Advance(SimulatorAccessCycles);
+
+	if (flashId == FLASH_ID_AMD_1024)
+	{
+		return AmdRead((unsigned)address);
+	}
+
+	return IntelRead((unsigned)address);
+}
+
+void SimulatorFlashWrite(unsigned long address, unsigned short value)
+{
+	simulatorCounters.registerAccesses++;
+	simulatorCounters.flashWrites++;
+	Advance(SimulatorAccessCycles);
+
+	// Without this chip select setting, writes never reach the chip.
+	if (simulatorChipSelect[3] != 0x7060)
+	{
+		simulatorCounters.flashCommandErrors++;
+		return;
+	}
+
+	if (flashId == FLASH_ID_AMD_1024)
+	{
+		AmdWrite((unsigned)address, value);
+	}
+	else
+	{
+		IntelWrite((unsigned)address, value);
+	}
+}
+
+unsigned short SimulatorFlashPeek(unsigned address)
+{
+	return flashArray[(address % flashSize) / 2];
+}
+
+// The words are stored in host order, so the bytes are in the same order as
+// the data that was programmed, the same as on the PCM.
+unsigned char *SimulatorFlashArray(unsigned long address)
+{
+	// The kernel must only read the array when the chip is in read-array mode.
+	if (FlashBusy() || (flashMode == ReadStatus) || (flashMode == ReadId))
+	{
+		simulatorCounters.flashCommandErrors++;
+	}
+
+	return (unsigned char *)&flashArray[(address % flashSize) / 2] + (address & 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// This stands in for the one in write-kernel.c.
+///////////////////////////////////////////////////////////////////////////////
+unsigned char WriteToFlash(const unsigned length, const unsigned startAddress, unsigned char *data, int testWrite)
+{
+	switch (flashId)
+	{
+	case FLASH_ID_INTEL_512:
+	case FLASH_ID_INTEL_1024:
+		return Intel_WriteToFlash(length, startAddress, data, testWrite);
+
+	case FLASH_ID_AMD_1024:
+		return Amd_WriteToFlash(length, startAddress, data, testWrite, 1);
+	}
+
+	return 0xEE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// These stand in for the ones in write-kernel.c.
+///////////////////////////////////////////////////////////////////////////////
+void FlashWriteStart(const unsigned startAddress)
+{
+	switch (flashId)
+	{
+	case FLASH_ID_INTEL_512:
+	case FLASH_ID_INTEL_1024:
+		Intel_StartProgramming(startAddress);
+		break;
+
+	case FLASH_ID_AMD_1024:
+		Amd_StartProgramming(1);
+		break;
+	}
+}
+
+unsigned char FlashWriteWords(const unsigned length, const unsigned startAddress, unsigned char *data)
+{
+	switch (flashId)
+	{
+	case FLASH_ID_INTEL_512:
+	case FLASH_ID_INTEL_1024:
+		return Intel_ProgramWords(length, startAddress, data);
+
+	case FLASH_ID_AMD_1024:
+		return Amd_ProgramWords(length, startAddress, data, 1);
+	}
+
+	return 0xEE;
+}
+
+void FlashWriteEnd()
+{
+	switch (flashId)
+	{
+	case FLASH_ID_INTEL_512:
+	case FLASH_ID_INTEL_1024:
+		Intel_EndProgramming();
+		break;
+
+	case FLASH_ID_AMD_1024:
+		Amd_EndProgramming(1);
+		break;
+	}
+}
@@ -0,0 +1,95 @@
+///////////////////////////////////////////////////////////////////////////////
+// A host model of the PCM's DLC, watchdog, chip selects and flash chip, so
+// that kernel code can be built and measured without a bench PCM. See
+// benchmark.c and 'make bench'.
+///////////////////////////////////////////////////////////////////////////////
+//
+// The makefile force-includes this file before each kernel source file, so
+// these macros take the place of the register macros in common.h and flash.h.
+//
+// The kernel only ever writes some registers and only ever reads others.
+// A write lands in a slot that the model acts on at the next register access.
+// A read asks the model for the register's current value.
+//
+// Time only passes in the model when the kernel touches a register or calls
+// DelayLoop. That makes the numbers repeatable, and good for comparing two
+// versions of the kernel, but they are not a prediction of what a real PCM
+// will do.
+//
+///////////////////////////////////////////////////////////////////////////////
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+unsigned char *SimulatorRegisterWrite(unsigned address);
+unsigned char *SimulatorRegisterRead(unsigned address);
+unsigned short SimulatorFlashRead(unsigned long address);
+void SimulatorFlashWrite(unsigned long address, unsigned short value);
+unsigned char *SimulatorFlashArray(unsigned long address);
+void SimulatorDelay(unsigned int loops);
+
+extern unsigned char simulatorWatchdog2;
+extern unsigned short simulatorChipSelect[4];
+extern unsigned short simulatorHardwareIo;
+
+#define DLC_CONFIGURATION          (*SimulatorRegisterWrite(0xFFF600))
+#define DLC_INTERRUPTCONFIGURATION (*SimulatorRegisterWrite(0xFFF606))
+#define DLC_TRANSMIT_COMMAND       (*SimulatorRegisterWrite(0xFFF60C))
+#define DLC_TRANSMIT_FIFO          (*SimulatorRegisterWrite(0xFFF60D))
+#define DLC_STATUS                 (*SimulatorRegisterRead(0xFFF60E))
+#define DLC_RECEIVE_FIFO           (*SimulatorRegisterRead(0xFFF60F))
+#define WATCHDOG1                  (*SimulatorRegisterWrite(0xFFFA27))
+#define WATCHDOG2                  simulatorWatchdog2
+
+#define SIM_BASE                   0x00FFFA00
+#define SIM_CSBARBT                simulatorChipSelect[0]
+#define SIM_CSORBT                 simulatorChipSelect[1]
+#define SIM_CSBAR0                 simulatorChipSelect[2]
+#define SIM_CSOR0                  simulatorChipSelect[3]
+#define HARDWARE_IO                simulatorHardwareIo
+
+#define FLASH_READ(address)         SimulatorFlashRead((unsigned long)(address))
+#define FLASH_WRITE(address, value) SimulatorFlashWrite((unsigned long)(address), (value))
+#define FLASH_ARRAY(address)        SimulatorFlashArray((unsigned long)(address))
+
+///////////////////////////////////////////////////////////////////////////////
+// Everything the model counts. Cycles are 68332 clock cycles.
+///////////////////////////////////////////////////////////////////////////////
+typedef struct
+{
+	unsigned long long cycles;
+	unsigned long long delayCycles;
+	unsigned long registerAccesses;
+	unsigned long statusPolls;
+	unsigned long watchdogScratches;
+	unsigned long flashReads;
+	unsigned long flashWrites;
+	unsigned long flashCommandErrors;
+	unsigned long transmitOverruns;
+	unsigned long receiveOverruns;
+} SimulatorCounters;
+
+extern SimulatorCounters simulatorCounters;
+
+///////////////////////////////////////////////////////////////////////////////
+// Start over with an idle bus and an erased flash chip of the given type
+// (one of the FLASH_ID values in flash.h).
+///////////////////////////////////////////////////////////////////////////////
+void SimulatorReset(unsigned flashId, int fourX);
+
+///////////////////////////////////////////////////////////////////////////////
+// Put a message on the bus. The bytes arrive at the bus speed, starting now,
+// followed by a completion code.
+///////////////////////////////////////////////////////////////////////////////
+void SimulatorQueueMessage(const unsigned char *message, int length);
+
+///////////////////////////////////////////////////////////////////////////////
+// The last frame that the kernel finished sending. Returns the length.
+///////////////////////////////////////////////////////////////////////////////
+int SimulatorLastFrame(const unsigned char **frame);
+
+///////////////////////////////////////////////////////////////////////////////
+// Read the flash array directly, bypassing the chip's command interface.
+///////////////////////////////////////////////////////////////////////////////
+unsigned short SimulatorFlashPeek(unsigned address);
+
+#endif
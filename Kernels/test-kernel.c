@@ -21,6 +21,76 @@ void HandleEchoRequest(int length)
 	WriteMessage(MessageBuffer, length, Complete);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Link throughput test: 3D 0E size(2) count(2)
+//
+// Send 'count' frames back to back, each with a 2-byte sequence number and
+// 'size' bytes of data, then a summary: 3D 0F, the number of frames sent,
+// then the changes in the transmit stall, receive overflow and receive error
+// counters while the frames were going out. There's no timer to read, so the
+// app times the frames as they arrive. Missing sequence numbers tell it which
+// frames the interface dropped.
+//
+// The data in each frame is (sequence + index) so the app can spot frames
+// that were corrupted.
+///////////////////////////////////////////////////////////////////////////////
+#define ThroughputHeaderSize 7
+
+void AppendLong(unsigned char *buffer, uint32_t value)
+{
+	buffer[0] = value >> 24;
+	buffer[1] = value >> 16;
+	buffer[2] = value >> 8;
+	buffer[3] = value;
+}
+
+void HandleThroughputTest()
+{
+	unsigned size = (MessageBuffer[5] << 8) | MessageBuffer[6];
+	unsigned count = (MessageBuffer[7] << 8) | MessageBuffer[8];
+	if (size > MessageBufferSize - ThroughputHeaderSize)
+	{
+		size = MessageBufferSize - ThroughputHeaderSize;
+	}
+
+	uint32_t stalls = perfCounters[PerfTransmitStalls];
+	uint32_t overflows = perfCounters[PerfReceiveOverflows];
+	uint32_t errors = perfCounters[PerfReceiveErrors];
+
+	ElmSleep();
+
+	MessageBuffer[0] = 0x6C;
+	MessageBuffer[1] = 0xF0;
+	MessageBuffer[2] = 0x10;
+	MessageBuffer[3] = 0x7D;
+	MessageBuffer[4] = 0x0E;
+
+	unsigned sequence;
+	for (sequence = 0; sequence < count; sequence++)
+	{
+		ScratchWatchdog();
+		MessageBuffer[5] = sequence >> 8;
+		MessageBuffer[6] = sequence;
+
+		unsigned char value = sequence;
+		unsigned char *data = &MessageBuffer[ThroughputHeaderSize];
+		for (unsigned index = 0; index < size; index++)
+		{
+			data[index] = value++;
+		}
+
+		WriteMessage(MessageBuffer, ThroughputHeaderSize + size, Complete);
+	}
+
+	MessageBuffer[4] = 0x0F;
+	MessageBuffer[5] = sequence >> 8;
+	MessageBuffer[6] = sequence;
+	AppendLong(&MessageBuffer[7], perfCounters[PerfTransmitStalls] - stalls);
+	AppendLong(&MessageBuffer[11], perfCounters[PerfReceiveOverflows] - overflows);
+	AppendLong(&MessageBuffer[15], perfCounters[PerfReceiveErrors] - errors);
+	WriteMessage(MessageBuffer, 19, Complete);
+}
+
 #define SIM_BASE        0x00FFFA00
 #define SIM_CSBARBT     (*(unsigned short *)(SIM_BASE + 0x48)) // CSRBASEREG, boot chip select, chip select base addr boot ROM reg,
 
@@ -55,7 +125,7 @@ void Handle_512kb_FlashChipQuery()
 
 	// The AllPro and ScanTool devices need a short delay to switch from
 	// sending to receiving. Otherwise they'll miss the response.
-	VariableSleep(1);
+	ElmSleep();
 
 	MessageBuffer[0] = 0x6C;
 	MessageBuffer[1] = 0xF0;
@@ -90,7 +160,7 @@ void Handle_1mb_FlashChipQuery()
 
 	// The AllPro and ScanTool devices need a short delay to switch from
 	// sending to receiving. Otherwise they'll miss the response.
-	VariableSleep(1);
+	ElmSleep();
 
 	MessageBuffer[0] = 0x6C;
 	MessageBuffer[1] = 0xF0;
@@ -139,6 +209,10 @@ void ProcessMessage(int length)
 			Handle_1mb_FlashChipQuery();
 			break;
 
+		case 0x0E:
+			HandleThroughputTest();
+			break;
+
 		default:
 			SendToolPresent(
 				0xBB,
@@ -169,6 +243,19 @@ unsigned char WriteToFlash(const unsigned length, const unsigned startAddress, u
 	// This space intentionally left blank.
 }
 
+void FlashWriteStart(const unsigned startAddress)
+{
+}
+
+unsigned char FlashWriteWords(const unsigned length, const unsigned startAddress, unsigned char *data)
+{
+	// This space intentionally left blank.
+}
+
+void FlashWriteEnd()
+{
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // This is the entry point for the kernel.
 ///////////////////////////////////////////////////////////////////////////////
@@ -182,17 +269,21 @@ KernelStart(void)
 	ScratchWatchdog();
 
 	DLC_INTERRUPTCONFIGURATION = 0x00;
-	LongSleepWithWatchdog();
+	MicroSleep(500 * 1000);
 
 	// Flush the DLC
 	DLC_TRANSMIT_COMMAND = 0x03;
 	DLC_TRANSMIT_FIFO = 0x00;
+	DlcResetReceiveRing();
+	turnaroundMicroseconds = ElmTurnaroundMicroseconds;
+	PerfReset();
+	BackgroundTask = 0;
 
 	ClearMessageBuffer();
 	WasteTime();
 
 	SendToolPresent(0, 0, 0, 0);
-	LongSleepWithWatchdog();
+	MicroSleep(500 * 1000);
 
 	// If we choose to loop forever we need a good story for how to get out of that state.
 	// Pull the PCM fuse? Give the app button to tell the kernel to reboot?
@@ -225,7 +316,7 @@ KernelStart(void)
 		if (readState != 1)
 		{
 			SendToolPresent(0xBB, 0xBB, readState, readState);
-			LongSleepWithWatchdog();
+			MicroSleep(500 * 1000);
 			continue;
 		}
 
@@ -234,7 +325,7 @@ KernelStart(void)
 		// Did the tool just request a reboot?
 		if (MessageBuffer[3] == 0x20)
 		{
-			LongSleepWithWatchdog();
+			MicroSleep(500 * 1000);
 			Reboot(0xCC000000 | iterations);
 		}
 
@@ -2,16 +2,68 @@
 //#include "common.h"
 #include <iostream>
 #include <fstream>
+#include "crc-table.h"
 using namespace std;
 
-extern int crcTable[256];
+const unsigned crcTable256[256] = { CRC_TABLE_256 };
+const unsigned crcTable16[16] = { CRC_TABLE_16 };
 
 void __cdecl crcInit(void);
 unsigned __cdecl crcFast(unsigned char *message, int nBytes);
 void ScratchWatchdog();
 
+// Compute a table entry a bit at a time, the way crcInit used to.
+unsigned SlowTableEntry(unsigned dividend, int bits)
+{
+    unsigned remainder = dividend << (32 - bits);
+    for (int bit = bits; bit > 0; --bit)
+    {
+        if (remainder & 0x80000000)
+        {
+            remainder = (remainder << 1) ^ 0x04C11DB7;
+        }
+        else
+        {
+            remainder = (remainder << 1);
+        }
+    }
+
+    return remainder;
+}
+
+// Make sure the constant tables in crc-table.h are correct.
+int CheckTables()
+{
+    int errors = 0;
+
+    for (unsigned i = 0; i < 256; i++)
+    {
+        if (crcTable256[i] != SlowTableEntry(i, 8))
+        {
+            printf("256-entry table mismatch at %u: %08X\r\n", i, crcTable256[i]);
+            errors++;
+        }
+    }
+
+    for (unsigned i = 0; i < 16; i++)
+    {
+        if (crcTable16[i] != SlowTableEntry(i, 4))
+        {
+            printf("16-entry table mismatch at %u: %08X\r\n", i, crcTable16[i]);
+            errors++;
+        }
+    }
+
+    return errors;
+}
+
 int  main()
 {
+    if (CheckTables() != 0)
+    {
+        return 1;
+    }
+
     crcInit();
 
     ifstream file ("FirstReadFromCorvette.bin", ios::in|ios::binary|ios::ate);
@@ -28,7 +80,7 @@ int  main()
 	//printf("Pointer: %08X\r\n", (uint32_t)pData);
 	for (int i = 0; i < 10; i++)
 	{
-		printf("%02d %08X %08X\r\n", i, crcTable[i], pData[i]);
+		printf("%02d %08X %08X\r\n", i, crcTable256[i], pData[i]);
 	}
 
     unsigned crc = crcFast((unsigned char*)content, 0x2000);
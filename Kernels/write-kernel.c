@@ -7,6 +7,20 @@
 
 uint32_t __attribute((section(".kerneldata"))) flashIdentifier;
 
+// Background erase, see HandleEraseJobRequest and HandleBatchEraseRequest.
+#define EraseIdle 0x00
+#define EraseBusy 0x01
+#define EraseDone 0x02
+#define EraseMaxBlocks 20
+
+unsigned __attribute((section(".kerneldata"))) eraseBlocks[EraseMaxBlocks];
+unsigned char __attribute((section(".kerneldata"))) eraseResults[EraseMaxBlocks];
+unsigned __attribute((section(".kerneldata"))) erasePolls;
+unsigned char __attribute((section(".kerneldata"))) eraseCount;
+unsigned char __attribute((section(".kerneldata"))) eraseFirst;
+unsigned char __attribute((section(".kerneldata"))) eraseNext;
+unsigned char __attribute((section(".kerneldata"))) eraseState;
+
 // This kernel uses Mode 3D extensively, because apparently nothing else does. Submodes are:
 //
 // 00 - Get kernel version
@@ -16,6 +30,13 @@ uint32_t __attribute((section(".kerneldata"))) flashIdentifier;
 // 04 - lock flash
 // 05 - erase calibration
 // 06 - erase everything? (not until everything else is thoroughly proven)
+// 07 - map uniform (e.g. blank) chunks of a memory range
+// 08 - query CRCs for a list of ranges
+// 09 - compare a block with flash
+// 0A - set the reply turnaround delay
+// 0B - get performance counters
+// 0C - start a background erase, or get its status
+// 0D - erase a list of blocks in the background, or get their status
 // FF - send debug info (because I was curious about the stack address)
 //
 // Writes to flash use mode 35 and mode 36, like writing to RAM.
@@ -71,7 +92,7 @@ void HandleFlashChipQuery()
 
 	// The AllPro and ScanTool devices need a short delay to switch from
 	// sending to receiving. Otherwise they'll miss the response.
-	VariableSleep(1);
+	ElmSleep();
 
 	MessageBuffer[0] = 0x6C;
 	MessageBuffer[1] = 0xF0;
@@ -108,7 +129,7 @@ void HandleCrcQuery()
 	else
 	{
 		path = 2;
-		crcProcessSlice();
+		crcProcessSlice(CrcPollSliceSize);
 	}
 
 	ElmSleep();
@@ -149,6 +170,174 @@ void HandleCrcQuery()
 	}
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Get the CRCs of a list of memory ranges.
+//
+// Request: 3D 08 [restart] [count] then [length, 3 bytes] [address, 3 bytes]
+// for each range. Reply: 7D 08 [count] then a 4-byte CRC for each range.
+//
+// Like HandleCrcQuery, each request processes one slice, and the main loop
+// keeps working on the batch between requests. The app keeps repeating the
+// request until the results are ready. The app sets the restart
+// byte on the first request so that results from an earlier batch of the same
+// ranges are not reused after the flash has been rewritten.
+//
+// If the request doesn't hold [count] ranges, the reply is
+// 7F 3D 08 [count] [received length].
+///////////////////////////////////////////////////////////////////////////////
+void HandleBatchCrcQuery()
+{
+	int restart = MessageBuffer[5];
+	int count = MessageBuffer[6];
+
+	if (count > CrcBatchMaxRanges)
+	{
+		ElmSleep();
+		SendReply(0, 0x08, count, CrcBatchMaxRanges);
+		return;
+	}
+
+	// Otherwise the ranges would be read from bytes left in the buffer by an
+	// earlier message, and their CRCs reported as the ones requested.
+	if (!MessageLengthIs(7 + (count * 6)))
+	{
+		ElmSleep();
+		SendReply(0, 0x08, count, readMessageLength);
+		return;
+	}
+
+	ScratchWatchdog();
+
+	int same = !restart && (count == crcBatchCount);
+	for (int index = 0; same && (index < count); index++)
+	{
+		unsigned char *range = &MessageBuffer[7 + (index * 6)];
+		unsigned length = (range[0] << 16) + (range[1] << 8) + range[2];
+		unsigned address = (range[3] << 16) + (range[4] << 8) + range[5];
+		same = crcBatchMatches(index, (uint8_t*)address, length);
+	}
+
+	if (!same)
+	{
+		crcReset();
+		for (int index = 0; index < count; index++)
+		{
+			unsigned char *range = &MessageBuffer[7 + (index * 6)];
+			unsigned length = (range[0] << 16) + (range[1] << 8) + range[2];
+			unsigned address = (range[3] << 16) + (range[4] << 8) + range[5];
+			crcBatchAdd((uint8_t*)address, length);
+		}
+	}
+
+	crcBatchProcessSlice(CrcPollSliceSize);
+
+	ElmSleep();
+
+	MessageBuffer[0] = 0x6C;
+	MessageBuffer[1] = 0xF0;
+	MessageBuffer[2] = 0x10;
+	MessageBuffer[3] = 0x7D;
+
+	if (!crcBatchIsDone())
+	{
+		// Same bogus submode as HandleCrcQuery, plus the number of ranges done.
+		MessageBuffer[4] = 0xFF;
+		MessageBuffer[5] = 0x08;
+		MessageBuffer[6] = crcBatchDone;
+		WriteMessage(MessageBuffer, 7, Complete);
+		return;
+	}
+
+	MessageBuffer[4] = 0x08;
+	MessageBuffer[5] = count;
+	for (int index = 0; index < count; index++)
+	{
+		unsigned crc = crcBatchGetResult(index);
+		unsigned char *result = &MessageBuffer[6 + (index * 4)];
+		result[0] = (char)(crc >> 24);
+		result[1] = (char)(crc >> 16);
+		result[2] = (char)(crc >> 8);
+		result[3] = (char)crc;
+	}
+
+	WriteMessage(MessageBuffer, 6 + (count * 4), Complete);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Compare a block of data from the app with the current flash contents.
+//
+// Request: 3D 09 [length, 2 bytes] [address, 3 bytes] then the data.
+// Reply: 7D 09 [length] [address] [result], where the result is:
+//   00 - the flash already contains this data.
+//   01 - the data can be written without erasing, because it only needs
+//        bits to change from 1 to 0.
+//   02 - the block must be erased before the data can be written.
+// If the data that arrived isn't the given length, the reply is
+// 7F 3D 09 [received length, 2 bytes].
+///////////////////////////////////////////////////////////////////////////////
+void HandleBlockDiffQuery()
+{
+	unsigned length = (MessageBuffer[5] << 8) + MessageBuffer[6];
+	unsigned address = (MessageBuffer[7] << 16) + (MessageBuffer[8] << 8) + MessageBuffer[9];
+
+	if (length + 10 > MessageBufferSize)
+	{
+		ElmSleep();
+		SendReply(0, 0x09, MessageBuffer[5], MessageBuffer[6]);
+		return;
+	}
+
+	// Otherwise the flash would be compared with whatever was in the buffer
+	// past the end of the message.
+	if (!MessageLengthIs(10 + length))
+	{
+		ElmSleep();
+		SendReply(0, 0x09, readMessageLength >> 8, readMessageLength);
+		return;
+	}
+
+	unsigned char *flash = (unsigned char*)address;
+	unsigned char *data = &MessageBuffer[10];
+	unsigned char result = 0;
+
+	// Scratch the watchdog from a countdown, like CopyPayload, since the
+	// CPU32 divide is too slow for index % N tests.
+	ScratchWatchdog();
+	int countdown = 1024;
+
+	for (unsigned index = 0; index < length; index++)
+	{
+		if (--countdown == 0)
+		{
+			ScratchWatchdog();
+			countdown = 1024;
+		}
+
+		if (flash[index] == data[index])
+		{
+			continue;
+		}
+
+		if ((flash[index] & data[index]) != data[index])
+		{
+			result = 2;
+			break;
+		}
+
+		result = 1;
+	}
+
+	ElmSleep();
+
+	MessageBuffer[0] = 0x6C;
+	MessageBuffer[1] = 0xF0;
+	MessageBuffer[2] = 0x10;
+	MessageBuffer[3] = 0x7D;
+	MessageBuffer[4] = 0x09;
+	MessageBuffer[10] = result;
+	WriteMessage(MessageBuffer, 11, Complete);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Tell the app which OS is installed on this PCM.
 //
@@ -183,36 +372,317 @@ void HandleOperatingSystemQuery()
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Erase the given block.
+// The erase job. EraseJobStart tells the chip to start erasing the blocks in
+// eraseBlocks, and the main loop calls EraseJobStep between messages until the
+// chip is done.
+//
+// The Intel chips erase one block at a time. The AMD chip can be given more
+// blocks within 50us of the first one, and then erases all of them in one go,
+// so the job gives it as many as it will take.
+//
+// Neither flash chip can be read while it is erasing, so ProcessMessage calls
+// EraseJobFinish before anything that might touch flash.
 ///////////////////////////////////////////////////////////////////////////////
-void HandleEraseBlock()
+void EraseJobReset()
+{
+	eraseCount = 0;
+	eraseFirst = 0;
+	eraseNext = 0;
+	erasePolls = 0;
+	eraseState = EraseIdle;
+}
+
+void EraseJobStartNext()
 {
-	unsigned address = (MessageBuffer[5] << 16) + (MessageBuffer[6] << 8) + MessageBuffer[7];
-	uint8_t status = 0;
+	eraseFirst = eraseNext;
+	erasePolls = 0;
+
+	unsigned address = eraseBlocks[eraseNext++];
+
+	switch (flashIdentifier)
+	{
+		case FLASH_ID_AMD_1024:
+			Amd_StartErase(address);
+			while ((eraseNext < eraseCount) && Amd_QueueErase(eraseBlocks[eraseNext]))
+			{
+				eraseNext++;
+			}
+			break;
+
+		default:
+			Intel_StartErase(address);
+			break;
+	}
+}
 
+// The caller fills in eraseBlocks and eraseCount first.
+int EraseJobStart()
+{
 	switch (flashIdentifier)
 	{
 		case FLASH_ID_INTEL_512:
 		case FLASH_ID_INTEL_1024:
-			status = Intel_EraseBlock(address);
+		case FLASH_ID_AMD_1024:
 			break;
 
+		default:
+			eraseCount = 0;
+			return 0;
+	}
+
+	for (int index = 0; index < eraseCount; index++)
+	{
+		eraseResults[index] = FlashEraseBusy;
+	}
+
+	eraseNext = 0;
+	eraseState = EraseBusy;
+	EraseJobStartNext();
+	return 1;
+}
+
+void EraseJobStep()
+{
+	if (eraseState != EraseBusy)
+	{
+		return;
+	}
+
+	int giveUp = erasePolls >= FlashEraseTimeout;
+	erasePolls++;
+
+	uint8_t status;
+	switch (flashIdentifier)
+	{
 		case FLASH_ID_AMD_1024:
-			status = Amd_EraseBlock(address);
+			status = Amd_PollErase(eraseBlocks[eraseFirst], giveUp);
 			break;
 
 		default:
-			VariableSleep(2);
-			SendReply(0, 0x05, 0xFF, 0xFF);
+			status = Intel_PollErase(eraseBlocks[eraseFirst], giveUp);
+			break;
+	}
+
+	if (status == FlashEraseBusy)
+	{
+		return;
+	}
+
+	// The AMD chip only has one result for all of the blocks it was given.
+	for (int index = eraseFirst; index < eraseNext; index++)
+	{
+		eraseResults[index] = status;
+	}
+
+	if (eraseNext < eraseCount)
+	{
+		EraseJobStartNext();
+	}
+	else
+	{
+		eraseState = EraseDone;
+	}
+}
+
+void EraseJobFinish()
+{
+	while (eraseState == EraseBusy)
+	{
+		ScratchWatchdog();
+		DlcService();
+		EraseJobStep();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Get ready for a new erase job. Any CRC or write error from before the erase
+// no longer means anything.
+///////////////////////////////////////////////////////////////////////////////
+void EraseJobPrepare()
+{
+	EraseJobFinish();
+	crcReset();
+	FlashJobReset();
+	eraseCount = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Requests that can be handled while the chip is erasing, because they don't
+// go anywhere near flash.
+///////////////////////////////////////////////////////////////////////////////
+int CanRunDuringErase()
+{
+	if (MessageBuffer[3] == 0x3F)
+	{
+		return 1;
+	}
+
+	if (MessageBuffer[3] != 0x3D)
+	{
+		return 0;
+	}
+
+	switch (MessageBuffer[4])
+	{
+		case 0x00:
+		case 0x0A:
+		case 0x0B:
+		case 0x0C:
+		case 0x0D:
+			return 1;
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Start a background erase, or report on it.
+//
+// Request: 3D 0C 00 [address, 3 bytes] to start erasing the block at that
+// address, or 3D 0C 01 to ask how it's going.
+// Reply: 7D 0C [state] [status] [address, 3 bytes], where the state is:
+//   00 - no erase has been started.
+//   01 - the chip is still erasing.
+//   02 - the erase is done, and the status is its result (zero for success).
+//
+// Starting an erase while another one is running waits for the first one.
+// After a batch erase, this reports on the first block in the batch.
+// If a start request isn't the right length, the reply is
+// 7F 3D 0C [received length, 2 bytes] and nothing is erased.
+///////////////////////////////////////////////////////////////////////////////
+void HandleEraseJobRequest()
+{
+	if (MessageBuffer[5] == 0x00)
+	{
+		// Otherwise a short frame would erase the block named by the bytes
+		// left in the buffer from an earlier message.
+		if (!MessageLengthIs(9))
+		{
+			ElmSleep();
+			SendReply(0, 0x0C, readMessageLength >> 8, readMessageLength);
+			return;
+		}
+
+		EraseJobPrepare();
+		eraseBlocks[0] = (MessageBuffer[6] << 16) + (MessageBuffer[7] << 8) + MessageBuffer[8];
+		eraseCount = 1;
+
+		if (!EraseJobStart())
+		{
+			MicroSleep(4000);
+			SendReply(0, 0x0C, 0xFF, 0xFF);
 			return;
+		}
+	}
+
+	unsigned address = eraseCount ? eraseBlocks[0] : 0;
+
+	ElmSleep();
+
+	MessageBuffer[0] = 0x6C;
+	MessageBuffer[1] = 0xF0;
+	MessageBuffer[2] = 0x10;
+	MessageBuffer[3] = 0x7D;
+	MessageBuffer[4] = 0x0C;
+	MessageBuffer[5] = eraseState;
+	MessageBuffer[6] = eraseCount ? eraseResults[0] : 0;
+	MessageBuffer[7] = (char)(address >> 16);
+	MessageBuffer[8] = (char)(address >> 8);
+	MessageBuffer[9] = (char)address;
+	WriteMessage(MessageBuffer, 10, Complete);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Erase a list of blocks in the background, or report on them.
+//
+// Request: 3D 0D [count] then [address, 3 bytes] for each block. A count of
+// zero just asks how it's going.
+// Reply: 7D 0D [state] [count] then the result for each block. The state is
+// the same as for 3D 0C, and blocks that haven't been erased yet have a
+// result of FF.
+// If the request doesn't hold [count] addresses, the reply is
+// 7F 3D 0D [count] [received length] and nothing is erased.
+///////////////////////////////////////////////////////////////////////////////
+void HandleBatchEraseRequest()
+{
+	int count = MessageBuffer[5];
+
+	if (count > EraseMaxBlocks)
+	{
+		ElmSleep();
+		SendReply(0, 0x0D, count, EraseMaxBlocks);
+		return;
 	}
 
+	// Otherwise a short frame would erase whatever blocks were named by the
+	// bytes left in the buffer from an earlier message.
+	if (!MessageLengthIs(6 + (count * 3)))
+	{
+		ElmSleep();
+		SendReply(0, 0x0D, count, readMessageLength);
+		return;
+	}
+
+	if (count != 0)
+	{
+		EraseJobPrepare();
+		for (int index = 0; index < count; index++)
+		{
+			unsigned char *block = &MessageBuffer[6 + (index * 3)];
+			eraseBlocks[index] = (block[0] << 16) + (block[1] << 8) + block[2];
+		}
+
+		eraseCount = count;
+
+		if (!EraseJobStart())
+		{
+			MicroSleep(4000);
+			SendReply(0, 0x0D, 0xFF, 0xFF);
+			return;
+		}
+	}
+
+	ElmSleep();
+
+	MessageBuffer[0] = 0x6C;
+	MessageBuffer[1] = 0xF0;
+	MessageBuffer[2] = 0x10;
+	MessageBuffer[3] = 0x7D;
+	MessageBuffer[4] = 0x0D;
+	MessageBuffer[5] = eraseState;
+	MessageBuffer[6] = eraseCount;
+	for (int index = 0; index < eraseCount; index++)
+	{
+		MessageBuffer[7 + index] = eraseResults[index];
+	}
+
+	WriteMessage(MessageBuffer, 7 + eraseCount, Complete);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Erase the given block.
+///////////////////////////////////////////////////////////////////////////////
+void HandleEraseBlock()
+{
+	eraseBlocks[0] = (MessageBuffer[5] << 16) + (MessageBuffer[6] << 8) + MessageBuffer[7];
+	eraseCount = 1;
+
+	if (!EraseJobStart())
+	{
+		MicroSleep(4000);
+		SendReply(0, 0x05, 0xFF, 0xFF);
+		return;
+	}
+
+	EraseJobFinish();
+	uint8_t status = eraseResults[0];
+
 	// The AllPro and ScanTool devices need a short delay to switch from
 	// sending to receiving. Otherwise they'll miss the response.
 	// Also, give the lock-flash operation time to take full effect, because
 	// the signal quality is degraded and the AllPro and ScanTool can't read
 	// messages when the PCM is in that state.
-	VariableSleep(2);
+	MicroSleep(4000);
 
 	SendReply(1, 0x05, status, 0x00);
 }
@@ -236,7 +706,6 @@ void HandleEraseEverythingRequest()
 ///////////////////////////////////////////////////////////////////////////////
 // This is available for arbitrary diagnostic / troubleshooting use.
 ///////////////////////////////////////////////////////////////////////////////
-extern unsigned int *crcTable;
 void HandleDebugQuery()
 {
 	uint32_t value = 0x12345678;
@@ -267,13 +736,70 @@ unsigned char WriteToFlash(unsigned int payloadLengthInBytes, unsigned int start
 		return Intel_WriteToFlash(payloadLengthInBytes, startAddress, payloadBytes, testWrite);
 
 	case FLASH_ID_AMD_1024:
-		return Amd_WriteToFlash(payloadLengthInBytes, startAddress, payloadBytes, testWrite);
+		// The AM29F800B supports unlock bypass mode.
+		return Amd_WriteToFlash(payloadLengthInBytes, startAddress, payloadBytes, testWrite, 1);
 
 	default:
 		return 0xEE;
 	}
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Unlock the flash chip for a series of FlashWriteWords calls.
+// This is invoked by the pipelined flash job in common-readwrite.c
+///////////////////////////////////////////////////////////////////////////////
+void FlashWriteStart(unsigned int startAddress)
+{
+	switch (flashIdentifier)
+	{
+	case FLASH_ID_INTEL_512:
+	case FLASH_ID_INTEL_1024:
+		Intel_StartProgramming(startAddress);
+		break;
+
+	case FLASH_ID_AMD_1024:
+		Amd_StartProgramming(1);
+		break;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Program data into flash memory that FlashWriteStart has unlocked.
+///////////////////////////////////////////////////////////////////////////////
+unsigned char FlashWriteWords(unsigned int payloadLengthInBytes, unsigned int startAddress, unsigned char *payloadBytes)
+{
+	switch (flashIdentifier)
+	{
+	case FLASH_ID_INTEL_512:
+	case FLASH_ID_INTEL_1024:
+		return Intel_ProgramWords(payloadLengthInBytes, startAddress, payloadBytes);
+
+	case FLASH_ID_AMD_1024:
+		return Amd_ProgramWords(payloadLengthInBytes, startAddress, payloadBytes, 1);
+
+	default:
+		return 0xEE;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Lock the flash chip after FlashWriteStart.
+///////////////////////////////////////////////////////////////////////////////
+void FlashWriteEnd()
+{
+	switch (flashIdentifier)
+	{
+	case FLASH_ID_INTEL_512:
+	case FLASH_ID_INTEL_1024:
+		Intel_EndProgramming();
+		break;
+
+	case FLASH_ID_AMD_1024:
+		Amd_EndProgramming(1);
+		break;
+	}
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Process an incoming message.
 ///////////////////////////////////////////////////////////////////////////////
@@ -291,10 +817,24 @@ void ProcessMessage(int iterations)
 		return;
 	}
 
+	// Don't let anything else use the flash while a pipelined write is still
+	// being programmed. HandleWriteMode36 does this itself, after it has
+	// validated the incoming block.
+	if (MessageBuffer[3] != 0x36)
+	{
+		FlashJobFinish();
+	}
+
+	// Likewise for a background erase.
+	if (!CanRunDuringErase())
+	{
+		EraseJobFinish();
+	}
+
 	switch (MessageBuffer[3])
 	{
 	case 0x20:
-		LongSleepWithWatchdog();
+		MicroSleep(500 * 1000);
 		Reboot(0xCC000000 | iterations);
 		break;
 
@@ -304,12 +844,30 @@ void ProcessMessage(int iterations)
 		break;
 
 	case 0x35:
-		HandleReadMode35();
+		if (MessageBuffer[4] == 0x02)
+		{
+			HandleReadMode35Compressed();
+		}
+		else if (MessageBuffer[4] == 0x03)
+		{
+			HandleReadMode35Stream();
+		}
+		else if (MessageBuffer[4] == 0x04)
+		{
+			HandleReadMode35Crc();
+		}
+		else
+		{
+			HandleReadMode35();
+		}
 		break;
 
 	case 0x36:
 		if (MessageBuffer[0] == 0x6D)
 		{
+			// Writing makes any CRC in progress meaningless. This also frees
+			// the CRC batch memory, which the program buffer shares.
+			crcReset();
 			HandleWriteMode36();
 		}
 		break;
@@ -348,6 +906,35 @@ void ProcessMessage(int iterations)
 		case 0x05:
 			HandleEraseBlock();
 			crcReset();
+			FlashJobReset();
+			break;
+
+		case 0x07:
+			HandleBlankMapQuery();
+			break;
+
+		case 0x08:
+			HandleBatchCrcQuery();
+			break;
+
+		case 0x09:
+			HandleBlockDiffQuery();
+			break;
+
+		case 0x0A:
+			HandleTurnaroundQuery();
+			break;
+
+		case 0x0B:
+			HandlePerfCounterQuery();
+			break;
+
+		case 0x0C:
+			HandleEraseJobRequest();
+			break;
+
+		case 0x0D:
+			HandleBatchEraseRequest();
 			break;
 
 		case 0xFF:
@@ -396,6 +983,11 @@ KernelStart(void)
 	// Flush the DLC
 	DLC_TRANSMIT_COMMAND = 0x03;
 	DLC_TRANSMIT_FIFO = 0x00;
+	DlcResetReceiveRing();
+	turnaroundMicroseconds = ElmTurnaroundMicroseconds;
+	PerfReset();
+	FlashJobReset();
+	EraseJobReset();
 
 	ClearMessageBuffer();
 	WasteTime();
@@ -406,7 +998,7 @@ KernelStart(void)
 	
 	// This message proves that the kernel is now running (if you're watching the data bus).
 	SendToolPresent(1, 2, 3, 4);
-	LongSleepWithWatchdog();
+	MicroSleep(500 * 1000);
 
 	uint32_t iterations = 0;
 	uint32_t timeout = 2500; // Timeout of 2500 = 2.2 seconds between messages. 5,000 = 3.9 seconds.
@@ -415,10 +1007,26 @@ KernelStart(void)
 
 	for(;;)
 	{
-		iterations++;
-
 		ScratchWatchdog();
 
+		// Keep a background erase going, as long as no message is arriving.
+		if ((eraseState == EraseBusy) && !DlcReceivePending())
+		{
+			EraseJobStep();
+			continue;
+		}
+
+		// Keep working on any CRC the app asked for, as long as no message is
+		// arriving. This doesn't count as an iteration, so it won't trigger
+		// the tool-present message below.
+		if (crcIsPending() && !DlcReceivePending())
+		{
+			crcProcessIdleSlice();
+			continue;
+		}
+
+		iterations++;
+
 		char completionCode = 0xFF;
 		char readState = 0xFF;
 		int length = ReadMessage(&completionCode, &readState);
@@ -459,6 +1067,7 @@ KernelStart(void)
 		lastMessage = iterations;
 		lastActivity = iterations;
 
+		PerfCount(PerfMessages);
 		ProcessMessage(iterations);
 	}
 